@@ -0,0 +1,79 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Блочный фильтр Блума (split block bloom filter): каждый ключ целиком попадает в один блок из 8 32-битных слов
+// (32 байта, половина кэш-линии) и ставит по одному биту в каждом слове. Проверка отсутствующего ключа - одно
+// чтение блока и 8 независимых сравнений без ветвлений, которые компилятор сворачивает в SIMD.
+// При 10 битах на ключ доля ложных срабатываний около 1%.
+// Удаление ключа из фильтра невозможно: удалённые ключи остаются "возможно присутствующими" до перестроения.
+class BlockedBloomFilter {
+public:
+    BlockedBloomFilter() : BlockedBloomFilter(0, 0) {
+    }
+
+    // Размер под expected_keys ключей при bits_per_key битах на ключ, округлённый вверх до целого блока
+    BlockedBloomFilter(size_t expected_keys, size_t bits_per_key)
+        : blocks_(std::max<size_t>(1, (expected_keys * bits_per_key + kBlockBits - 1) / kBlockBits)) {
+    }
+
+    // O(1)
+    void add(uint64_t hash) noexcept {
+        Block& block = blocks_[BlockIndex(hash)];
+        const Mask mask = MakeMask(static_cast<uint32_t>(hash));
+        for (size_t i = 0; i < kWords; ++i) {
+            block.words[i] |= mask[i];
+        }
+    }
+
+    // false - ключа точно нет, true - ключ, возможно, есть. O(1)
+    bool mayContain(uint64_t hash) const noexcept {
+        const Block& block = blocks_[BlockIndex(hash)];
+        const Mask mask = MakeMask(static_cast<uint32_t>(hash));
+
+        uint32_t missing = 0;
+        for (size_t i = 0; i < kWords; ++i) {
+            missing |= mask[i] & ~block.words[i];
+        }
+        return missing == 0;
+    }
+
+    size_t sizeInBytes() const noexcept {
+        return blocks_.size() * sizeof(Block);
+    }
+
+private:
+    static constexpr size_t kWords = 8;
+    static constexpr size_t kBlockBits = kWords * 32;
+
+    using Mask = std::array<uint32_t, kWords>;
+
+    // Выравнивание: блок не пересекает границу кэш-линии
+    struct alignas(32) Block {
+        Mask words;
+    };
+
+    // Нечётные множители для выбора бита в каждом слове блока
+    static constexpr std::array<uint32_t, kWords> kSalt = {0x47B6137BU, 0x44974D91U, 0x8824AD5BU, 0xA2B7289DU,
+                                                           0x705495C7U, 0x2DF1424BU, 0x9EFC4947U, 0x5C6BFB31U};
+
+    // Старшие 32 бита хеша выбирают блок умножением вместо деления по модулю
+    size_t BlockIndex(uint64_t hash) const noexcept {
+        return static_cast<size_t>(((hash >> 32) * blocks_.size()) >> 32);
+    }
+
+    // Младшие 32 бита хеша дают по биту в каждом слове: старшие 5 бит произведения на соль
+    static Mask MakeMask(uint32_t key) noexcept {
+        Mask mask;
+        for (size_t i = 0; i < kWords; ++i) {
+            mask[i] = uint32_t{1} << ((key * kSalt[i]) >> 27);
+        }
+        return mask;
+    }
+
+    std::vector<Block> blocks_;
+};
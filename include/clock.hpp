@@ -0,0 +1,22 @@
+#pragma once
+
+#include <chrono>
+#include <concepts>
+
+// Требования KVStorage к абстракции часов: тип time_point, константный now() и возможность
+// представить бесконечный TTL через time_point::max() и прибавить к моменту времени ttl в секундах.
+template <typename C>
+concept StorageClock = requires(const C& clock) {
+    typename C::time_point;
+    { clock.now() } -> std::same_as<typename C::time_point>;
+    { C::time_point::max() } -> std::same_as<typename C::time_point>;
+    { clock.now() + std::chrono::seconds(1) } -> std::convertible_to<typename C::time_point>;
+    { clock.now() - clock.now() } -> std::convertible_to<typename C::time_point::duration>;
+} && std::totally_ordered<typename C::time_point>;
+
+// Тег вместо часов: KVStorage<NoTtl, ...> хранит записи без времени жизни. Часы не нужны и не читаются,
+// запись состоит только из значения, а методы, связанные с TTL, недоступны на этапе компиляции.
+// time_point нужен только для объявления типов хранилища и никогда не используется.
+struct NoTtl {
+    using time_point = std::chrono::steady_clock::time_point;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Байты в куче, которыми владеет значение: освобождение именно их стоит времени (для больших строк - munmap)
+template <typename Value>
+size_t HeapBytes(const Value& value) noexcept {
+    if constexpr (requires { value.capacity(); value.data(); }) {
+        return value.capacity() * sizeof(*value.data());
+    } else {
+        return 0;
+    }
+}
+
+// Очередь отложенного освобождения больших значений: dispose перемещает значение от MinBytes байт в очередь за O(1),
+// а память освобождается фоновым потоком (Background) или порциями в drain, например в простое.
+// Значение считается большим по HeapBytes - у std::string и std::vector это ёмкость буфера.
+// Если в очереди уже kMaxPendingBytes, значение освобождается на месте: память, ждущая освобождения, ограничена.
+// Потокобезопасна.
+template <typename Value, size_t MinBytes, bool Background>
+class DeferredFreeQueue {
+public:
+    static constexpr size_t kMaxPendingBytes = size_t{256} << 20;
+
+    DeferredFreeQueue() {
+        if constexpr (Background) {
+            thread_ = std::thread([this] { Run(); });
+        }
+    }
+
+    DeferredFreeQueue(const DeferredFreeQueue&) = delete;
+    DeferredFreeQueue& operator=(const DeferredFreeQueue&) = delete;
+
+    // Оставшиеся значения освобождаются здесь
+    ~DeferredFreeQueue() {
+        if constexpr (Background) {
+            {
+                std::lock_guard lock(mutex_);
+                stopping_ = true;
+            }
+            cv_.notify_one();
+            thread_.join();
+        }
+    }
+
+    // Забирает большое значение в очередь, value остаётся пустым (moved-from). Маленькие значения не трогает.
+    // O(1) амортизированно независимо от размера значения
+    void dispose(Value& value) {
+        const size_t bytes = HeapBytes(value);
+        if (bytes < MinBytes) {
+            return;
+        }
+
+        {
+            std::lock_guard lock(mutex_);
+            if (pending_bytes_ + bytes > kMaxPendingBytes) {
+                return;
+            }
+            pending_.emplace_back(std::move(value), bytes);
+            pending_bytes_ += bytes;
+        }
+
+        if constexpr (Background) {
+            cv_.notify_one();
+        }
+    }
+
+    // Освобождает значения из начала очереди, пока освобождено меньше max_bytes (хотя бы одно значение, если
+    // очередь не пуста). Возвращает кол-во освобождённых байт. Освобождение идёт без блокировки очереди
+    size_t drain(size_t max_bytes) {
+        std::vector<Value> batch;
+        size_t freed = 0;
+        {
+            std::lock_guard lock(mutex_);
+            while (!pending_.empty() && (freed == 0 || freed < max_bytes)) {
+                freed += pending_.front().second;
+                batch.push_back(std::move(pending_.front().first));
+                pending_.pop_front();
+            }
+            pending_bytes_ -= freed;
+        }
+
+        return freed;
+    }
+
+    size_t pendingBytes() const {
+        std::lock_guard lock(mutex_);
+        return pending_bytes_;
+    }
+
+private:
+    void Run() {
+        std::unique_lock lock(mutex_);
+
+        while (true) {
+            cv_.wait(lock, [&] { return stopping_ || !pending_.empty(); });
+            if (pending_.empty()) {
+                return;
+            }
+
+            std::deque<std::pair<Value, size_t>> batch;
+            batch.swap(pending_);
+            pending_bytes_ = 0;
+
+            lock.unlock();
+            batch.clear();
+            lock.lock();
+        }
+    }
+
+    mutable std::mutex mutex_;
+    std::deque<std::pair<Value, size_t /* bytes */>> pending_;
+    size_t pending_bytes_ = 0;
+
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
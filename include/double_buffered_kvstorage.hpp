@@ -0,0 +1,184 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "kvstorage.hpp"
+
+// Двойная буферизация хранилища для горячей перезагрузки всего набора данных: новый экземпляр Storage строится
+// в стороне (обычно конструктором из свежих данных) и публикуется атомарной заменой указателя. Читатели не ждут
+// ни построения, ни замены: чтение, начатое до замены, дочитывает старый экземпляр, следующее видит новый.
+// Старый экземпляр разрушается фоновым потоком, когда из него вышли все читатели (epoch-based reclamation).
+//
+// Читатель отмечается в счётчике своей полосы (полосы закреплены за потоками) для чётности текущей эпохи;
+// публикация меняет эпоху, и фоновый поток ждёт, пока счётчики прошлой чётности не обнулятся. Поэтому чтение
+// добавляет только приращение и уменьшение счётчика в кэш-линии своей полосы, без общей блокировки.
+// Следующая публикация ждёт разрушения предыдущего экземпляра. rebuild дожидается его до построения нового,
+// поэтому в памяти не больше двух экземпляров; с publish третий - уже построенный вызывающим экземпляр.
+template <typename Storage>
+class DoubleBufferedKVStorage {
+public:
+    using KeyView = typename Storage::KeyView;
+
+    // Закреплённый экземпляр: пока Pin жив, экземпляр не разрушается. Pin держат недолго (на время запроса):
+    // пока он жив, следующая публикация не может разрушить экземпляр, ставший старым.
+    // Изменения через Pin (set/remove) допустимы с потокобезопасной политикой блокировок, но теряются при
+    // следующей публикации вместе со старым экземпляром.
+    class Pin {
+    public:
+        Pin(Pin&& other) noexcept
+            : readers_(std::exchange(other.readers_, nullptr)), storage_(std::exchange(other.storage_, nullptr)) {
+        }
+
+        Pin(const Pin&) = delete;
+        Pin& operator=(const Pin&) = delete;
+        Pin& operator=(Pin&&) = delete;
+
+        ~Pin() {
+            if (readers_ != nullptr) {
+                readers_->fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+        Storage& operator*() const noexcept {
+            return *storage_;
+        }
+
+        Storage* operator->() const noexcept {
+            return storage_;
+        }
+
+    private:
+        friend class DoubleBufferedKVStorage;
+
+        Pin(std::atomic<uint64_t>* readers, Storage* storage) noexcept : readers_(readers), storage_(storage) {
+        }
+
+        std::atomic<uint64_t>* readers_;
+        Storage* storage_;
+    };
+
+    explicit DoubleBufferedKVStorage(std::unique_ptr<Storage> initial) : current_(initial.release()) {
+    }
+
+    DoubleBufferedKVStorage(const DoubleBufferedKVStorage&) = delete;
+    DoubleBufferedKVStorage& operator=(const DoubleBufferedKVStorage&) = delete;
+
+    // Все Pin должны быть уже уничтожены
+    ~DoubleBufferedKVStorage() {
+        synchronize();
+        delete current_.load();
+    }
+
+    // Закрепляет текущий экземпляр. O(1), без блокировок
+    Pin pin() const {
+        Stripe& stripe = stripes_[ThreadStripe()];
+
+        while (true) {
+            const uint64_t epoch = epoch_.load();
+            std::atomic<uint64_t>& readers = stripe.readers[epoch & 1];
+            readers.fetch_add(1);
+
+            // Эпоха сменилась до отметки: публикация может уже не ждать счётчик этой чётности
+            if (epoch_.load() == epoch) {
+                return Pin(&readers, current_.load());
+            }
+            readers.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    auto get(const KeyView key) const {
+        return pin()->get(key);
+    }
+
+    auto getManySorted(const KeyView key, const uint32_t count) const {
+        return pin()->getManySorted(key, count);
+    }
+
+    // Публикует next вместо текущего экземпляра. Читатели, закрепившие текущий экземпляр, дочитывают его, затем
+    // он разрушается в фоновом потоке. Ждёт разрушения экземпляра от предыдущей публикации.
+    // O(1) плюс ожидание предыдущего разрушения
+    void publish(std::unique_ptr<Storage> next) {
+        std::lock_guard lock(publish_mutex_);
+        WaitForReclaim();
+        Publish(std::move(next));
+    }
+
+    // Дожидается разрушения экземпляра от предыдущей публикации, строит новый экземпляр из args (аргументы
+    // конструктора Storage) и публикует его. Читатели на время построения не блокируются
+    template <typename... Args>
+    void rebuild(Args&&... args) {
+        std::lock_guard lock(publish_mutex_);
+        WaitForReclaim();
+        Publish(std::make_unique<Storage>(std::forward<Args>(args)...));
+    }
+
+    // Ждёт, пока экземпляр от последней публикации не будет разрушен
+    void synchronize() {
+        std::lock_guard lock(publish_mutex_);
+        WaitForReclaim();
+    }
+
+    // Кол-во публикаций
+    uint64_t version() const noexcept {
+        return version_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr size_t kStripes = 16;
+
+    // Читатели полосы по чётности эпохи, на своей кэш-линии
+    struct alignas(64) Stripe {
+        std::array<std::atomic<uint64_t>, 2> readers{};
+    };
+
+    // Полоса потока выбирается один раз при первом обращении
+    static size_t ThreadStripe() noexcept {
+        static std::atomic<size_t> next_stripe = 0;
+        thread_local const size_t stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % kStripes;
+        return stripe;
+    }
+
+    // Вызывается под publish_mutex_ после WaitForReclaim
+    void Publish(std::unique_ptr<Storage> next) {
+        Storage* old = current_.exchange(next.release());
+        const uint64_t epoch = epoch_.fetch_add(1);
+        ++version_;
+
+        reclaimed_ = std::async(std::launch::async, [this, old, epoch] {
+            WaitForReaders(epoch);
+            delete old;
+        });
+    }
+
+    void WaitForReclaim() {
+        if (reclaimed_.valid()) {
+            reclaimed_.wait();
+        }
+    }
+
+    // Читатели, отметившиеся в эпохе epoch, видели экземпляр до замены; новые читатели видят новую эпоху
+    void WaitForReaders(uint64_t epoch) const {
+        for (const Stripe& stripe : stripes_) {
+            while (stripe.readers[epoch & 1].load(std::memory_order_acquire) != 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    std::atomic<Storage*> current_;
+    std::atomic<uint64_t> epoch_ = 0;
+    std::atomic<uint64_t> version_ = 0;
+    mutable std::array<Stripe, kStripes> stripes_;
+
+    std::mutex publish_mutex_;
+    // Фоновое разрушение экземпляра от последней публикации
+    std::future<void> reclaimed_;
+};
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Count-min sketch: оценка частоты ключа сверху по depth строкам из width счётчиков. Каждая строка выбирает
+// счётчик своей хеш-функцией, оценка - минимум по строкам. Обновление консервативное: увеличиваются только
+// счётчики, равные текущему минимуму, что уменьшает переоценку редких ключей из-за коллизий.
+// Память фиксирована: width * depth * 4 байта независимо от кол-ва ключей.
+class CountMinSketch {
+public:
+    // width округляется вверх до степени двойки
+    explicit CountMinSketch(size_t width = 2048, size_t depth = 4)
+        : mask_(std::bit_ceil(std::max<size_t>(width, 2)) - 1), depth_(std::max<size_t>(depth, 1)),
+          counters_((mask_ + 1) * depth_, 0) {
+    }
+
+    // Учитывает count обращений к ключу с хешем hash и возвращает новую оценку. O(depth)
+    uint32_t add(uint64_t hash, uint32_t count = 1) noexcept {
+        const uint32_t estimate = this->estimate(hash);
+        const uint32_t target = estimate > UINT32_MAX - count ? UINT32_MAX : estimate + count;
+
+        for (size_t row = 0; row < depth_; ++row) {
+            uint32_t& counter = counters_[Slot(hash, row)];
+            counter = std::max(counter, target);
+        }
+
+        return target;
+    }
+
+    // Не меньше истинного кол-ва обращений (до halve). O(depth)
+    uint32_t estimate(uint64_t hash) const noexcept {
+        uint32_t result = UINT32_MAX;
+        for (size_t row = 0; row < depth_; ++row) {
+            result = std::min(result, counters_[Slot(hash, row)]);
+        }
+        return result;
+    }
+
+    // Делит все счётчики на 2^times: старые обращения весят меньше новых. O(width * depth)
+    void halve(uint32_t times = 1) noexcept {
+        if (times >= 32) {
+            std::fill(counters_.begin(), counters_.end(), 0);
+            return;
+        }
+        for (uint32_t& counter : counters_) {
+            counter >>= times;
+        }
+    }
+
+private:
+    // Двойное хеширование: строка row использует h1 + row * h2, где h1 и h2 - половины 64-битного хеша
+    size_t Slot(uint64_t hash, size_t row) const noexcept {
+        const auto h1 = static_cast<uint32_t>(hash);
+        const auto h2 = static_cast<uint32_t>(hash >> 32) | 1;
+        return row * (mask_ + 1) + ((h1 + row * h2) & mask_);
+    }
+
+    size_t mask_;
+    size_t depth_;
+    std::vector<uint32_t> counters_;
+};
+
+// Горячий ключ из отчёта HotKeyTracker
+template <typename Key>
+struct HotKey {
+    Key key;
+    uint64_t accesses = 0; // оценка кол-ва обращений с учётом выборки и старения
+    double per_second = 0; // оценка частоты обращений
+
+    bool operator==(const HotKey&) const = default;
+};
+
+// Профилировщик горячих ключей по выборке обращений: в среднем одно из SampleEvery обращений потока попадает в
+// выборку, выборки копятся в буферах потоков (полосах, закреплённых за потоками) и пачками учитываются в
+// CountMinSketch. TopK ключей с наибольшей оценкой хранятся по схеме space-saving: новый ключ вытесняет ключ
+// с наименьшей оценкой, если его оценка больше. Каждые kHalfLife секунд счётчики делятся пополам, поэтому
+// отчёт отражает текущую нагрузку. Обращение вне выборки - уменьшение счётчика потока и ветвление.
+// Ключи сравниваются по 64-битному хешу: ключи, равные для индекса, учитываются вместе.
+template <typename Key, size_t TopK, uint32_t SampleEvery>
+class HotKeyTracker {
+public:
+    static_assert(TopK > 0 && SampleEvery > 0);
+
+    HotKeyTracker() : last_update_(std::chrono::steady_clock::now()), last_halving_(last_update_) {
+    }
+
+    // Решение о выборке: true в среднем раз в SampleEvery вызовов потока. Интервал между выборками случайный,
+    // чтобы периодическая нагрузка не попадала в выборку всегда одними и теми же ключами
+    static bool shouldSample() noexcept {
+        if constexpr (SampleEvery == 1) {
+            return true;
+        } else {
+            thread_local uint32_t countdown = 1;
+            if (--countdown != 0) {
+                return false;
+            }
+
+            thread_local uint64_t state = 0x9E3779B97F4A7C15ULL ^ reinterpret_cast<uintptr_t>(&countdown);
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            countdown = 1 + static_cast<uint32_t>(state % (2 * SampleEvery - 1));
+            return true;
+        }
+    }
+
+    // Обращение из выборки. hash должен хорошо перемешивать биты. O(1) амортизированно
+    template <typename KeyView>
+    void sample(const KeyView key, uint64_t hash) {
+        Stripe& stripe = stripes_[ThreadStripe()];
+
+        std::vector<Sample> full;
+        {
+            std::lock_guard lock(stripe.mutex);
+            stripe.samples.push_back({Key(key), hash});
+            if (stripe.samples.size() < kBufferedSamples) {
+                return;
+            }
+            full.swap(stripe.samples);
+        }
+
+        std::lock_guard lock(mutex_);
+        Age();
+        Merge(full);
+    }
+
+    // Горячие ключи по убыванию оценки, до TopK. Учитывает и ещё не слитые буферы потоков. O(s + TopK log TopK),
+    // s - кол-во выборок в буферах
+    std::vector<HotKey<Key>> hottest() {
+        std::lock_guard lock(mutex_);
+
+        for (Stripe& stripe : stripes_) {
+            std::vector<Sample> samples;
+            {
+                std::lock_guard stripe_lock(stripe.mutex);
+                samples.swap(stripe.samples);
+            }
+            Merge(samples);
+        }
+        Age();
+
+        const double seconds = std::max(window_seconds_, 1e-3);
+        std::vector<HotKey<Key>> result;
+        result.reserve(top_.size());
+        for (const auto& entry : top_) {
+            const uint64_t accesses = uint64_t{entry.count} * SampleEvery;
+            result.push_back({entry.key, accesses, static_cast<double>(accesses) / seconds});
+        }
+
+        std::sort(result.begin(), result.end(),
+                  [](const HotKey<Key>& lhs, const HotKey<Key>& rhs) { return lhs.accesses > rhs.accesses; });
+        return result;
+    }
+
+private:
+    static constexpr size_t kStripes = 16;
+    static constexpr size_t kBufferedSamples = 64;
+    static constexpr std::chrono::seconds kHalfLife{10};
+
+    struct Sample {
+        Key key;
+        uint64_t hash;
+    };
+
+    // Полоса на своей кэш-линии: потоки разных полос не делят линии
+    struct alignas(64) Stripe {
+        std::mutex mutex;
+        std::vector<Sample> samples;
+    };
+
+    struct TopEntry {
+        Key key;
+        uint64_t hash;
+        uint32_t count;
+    };
+
+    // Полоса потока выбирается один раз при первом обращении
+    static size_t ThreadStripe() noexcept {
+        static std::atomic<size_t> next_stripe = 0;
+        thread_local const size_t stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % kStripes;
+        return stripe;
+    }
+
+    void Merge(std::vector<Sample>& samples) {
+        for (Sample& sample : samples) {
+            const uint32_t estimate = sketch_.add(sample.hash);
+
+            auto it = std::find_if(top_.begin(), top_.end(),
+                                   [&](const TopEntry& entry) { return entry.hash == sample.hash; });
+            if (it != top_.end()) {
+                it->count = estimate;
+            } else if (top_.size() < TopK) {
+                top_.push_back({std::move(sample.key), sample.hash, estimate});
+            } else {
+                auto min = std::min_element(top_.begin(), top_.end(), [](const TopEntry& lhs, const TopEntry& rhs) {
+                    return lhs.count < rhs.count;
+                });
+                if (estimate > min->count) {
+                    *min = {std::move(sample.key), sample.hash, estimate};
+                }
+            }
+        }
+    }
+
+    // Окно, за которое накоплены счётчики, уменьшается вдвое вместе с ними: частота - счётчик, делённый на окно.
+    // Все пропущенные за время простоя периоды применяются за один проход по счётчикам
+    void Age() {
+        const auto now = std::chrono::steady_clock::now();
+        window_seconds_ += std::chrono::duration<double>(now - last_update_).count();
+        last_update_ = now;
+
+        const auto periods = (now - last_halving_) / kHalfLife;
+        if (periods <= 0) {
+            return;
+        }
+        last_halving_ += periods * kHalfLife;
+
+        // Через 32 периода от любого uint32_t счётчика ничего не остаётся
+        if (periods >= 32) {
+            sketch_.halve(32);
+            top_.clear();
+            window_seconds_ = 0;
+            return;
+        }
+
+        const auto times = static_cast<uint32_t>(periods);
+        sketch_.halve(times);
+        for (auto& entry : top_) {
+            entry.count >>= times;
+        }
+        window_seconds_ = std::ldexp(window_seconds_, -static_cast<int>(times));
+    }
+
+    std::array<Stripe, kStripes> stripes_;
+
+    std::mutex mutex_; // sketch_, top_ и окно
+    CountMinSketch sketch_;
+    std::vector<TopEntry> top_;
+    double window_seconds_ = 0;
+    std::chrono::steady_clock::time_point last_update_;
+    std::chrono::steady_clock::time_point last_halving_;
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string_view>
+
+// Хеш строковых ключей для хеш-таблицы индекса (по мотивам wyhash): ключ читается словами по 8 байт,
+// каждые 16 байт перемешиваются одним умножением 64x64 -> 128 бит, ключи от 48 байт - в три независимых потока.
+// Быстрее std::hash<std::string_view> из libstdc++ (побайтовый murmur) на ключах любой длины, при этом
+// каждый бит ключа влияет на все биты хеша.
+class StringHash {
+public:
+    using is_transparent = void;
+
+    constexpr StringHash() noexcept = default;
+
+    constexpr explicit StringHash(uint64_t seed) noexcept : seed_(seed) {
+    }
+
+    // O(|key|)
+    size_t operator()(const std::string_view key) const noexcept {
+        return static_cast<size_t>(hash(key.data(), key.size(), seed_));
+    }
+
+    static uint64_t hash(const char* data, size_t len, uint64_t seed) noexcept {
+        const auto* p = reinterpret_cast<const unsigned char*>(data);
+        seed ^= Mix(seed ^ kSecret[0], kSecret[1]);
+
+        uint64_t a = 0;
+        uint64_t b = 0;
+
+        if (len <= 16) {
+            if (len >= 4) {
+                // Два перекрывающихся чтения по 4 байта с каждого края покрывают ключи длиной 4..16
+                const size_t shift = (len >> 3) << 2;
+                a = Read4(p) << 32 | Read4(p + shift);
+                b = Read4(p + len - 4) << 32 | Read4(p + len - 4 - shift);
+            } else if (len > 0) {
+                a = uint64_t{p[0]} << 16 | uint64_t{p[len >> 1]} << 8 | p[len - 1];
+            }
+        } else {
+            size_t i = len;
+
+            if (i >= 48) {
+                uint64_t see1 = seed;
+                uint64_t see2 = seed;
+                do {
+                    seed = Mix(Read8(p) ^ kSecret[1], Read8(p + 8) ^ seed);
+                    see1 = Mix(Read8(p + 16) ^ kSecret[2], Read8(p + 24) ^ see1);
+                    see2 = Mix(Read8(p + 32) ^ kSecret[3], Read8(p + 40) ^ see2);
+                    p += 48;
+                    i -= 48;
+                } while (i >= 48);
+                seed ^= see1 ^ see2;
+            }
+
+            while (i > 16) {
+                seed = Mix(Read8(p) ^ kSecret[1], Read8(p + 8) ^ seed);
+                p += 16;
+                i -= 16;
+            }
+
+            // Последние 16 байт ключа, возможно перекрываясь с уже обработанными
+            a = Read8(p + i - 16);
+            b = Read8(p + i - 8);
+        }
+
+        a ^= kSecret[1];
+        b ^= seed;
+        Multiply(a, b);
+        return Mix(a ^ kSecret[0] ^ len, b ^ kSecret[1]);
+    }
+
+private:
+    static constexpr uint64_t kSecret[4] = {0x2D358DCCAA6C78A5ULL, 0x8BB84B93962EACC9ULL, 0x4B33A62ED433D4A3ULL,
+                                            0x4D5A2DA51DE1AA47ULL};
+
+    // (a, b) <- младшие и старшие 64 бита произведения a * b
+    static void Multiply(uint64_t& a, uint64_t& b) noexcept {
+#if defined(__SIZEOF_INT128__)
+        const unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+        a = static_cast<uint64_t>(product);
+        b = static_cast<uint64_t>(product >> 64);
+#else
+        const uint64_t a_hi = a >> 32, a_lo = static_cast<uint32_t>(a);
+        const uint64_t b_hi = b >> 32, b_lo = static_cast<uint32_t>(b);
+        const uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo, lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+        const uint64_t cross = (lo_lo >> 32) + static_cast<uint32_t>(hi_lo) + lo_hi;
+        a = (cross << 32) | static_cast<uint32_t>(lo_lo);
+        b = hi_hi + (hi_lo >> 32) + (cross >> 32);
+#endif
+    }
+
+    static uint64_t Mix(uint64_t a, uint64_t b) noexcept {
+        Multiply(a, b);
+        return a ^ b;
+    }
+
+    // memcpy вместо разыменования: невыровненное чтение без UB, компилируется в одну инструкцию
+    static uint64_t Read8(const unsigned char* p) noexcept {
+        uint64_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uint64_t Read4(const unsigned char* p) noexcept {
+        uint32_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    uint64_t seed_ = 0;
+};
+
+// StringHash со случайным для каждого процесса зерном: раскладку ключей по корзинам хеш-таблицы нельзя
+// подобрать заранее, что защищает от заполнения одной корзины специально подобранными ключами (hash flooding).
+// Хеши разных процессов различаются, поэтому их нельзя сохранять или передавать между процессами.
+class SeededStringHash : public StringHash {
+public:
+    SeededStringHash() noexcept : StringHash(processSeed()) {
+    }
+
+    static uint64_t processSeed() noexcept {
+        static const uint64_t seed = MakeSeed();
+        return seed;
+    }
+
+private:
+    static uint64_t MakeSeed() noexcept {
+        uint64_t seed = static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+        // Адрес статической переменной меняется между запусками при ASLR
+        static const char anchor = 0;
+        seed ^= reinterpret_cast<uintptr_t>(&anchor);
+
+        try {
+            std::random_device device;
+            seed ^= uint64_t{device()} << 32 | device();
+        } catch (...) {
+            // Без источника энтропии остаются время и адрес
+        }
+
+        return hash(reinterpret_cast<const char*>(&seed), sizeof(seed), 0);
+    }
+};
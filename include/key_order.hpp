@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "kv_policies.hpp"
+
+// Нестандартные порядки строковых ключей для MapIndexPolicy. Компараторы прозрачные: принимают std::string и
+// std::string_view без создания временных строк, поэтому get и getManySorted по string_view остаются без аллокаций.
+// Каждый порядок идёт в паре с согласованными хешем и равенством для хеш-таблицы индекса.
+
+constexpr char AsciiToLower(const char c) noexcept {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+constexpr bool IsAsciiDigit(const char c) noexcept {
+    return c >= '0' && c <= '9';
+}
+
+// Регистронезависимый порядок (ASCII): "apple" < "Banana" < "cherry". Ключи, отличающиеся только регистром,
+// эквивалентны - set("KEY") перезаписывает значение записи "key", сохраняя ключ в исходном написании.
+struct CaseInsensitiveLess {
+    using is_transparent = void;
+
+    // O(min(|lhs|, |rhs|))
+    constexpr bool operator()(const std::string_view lhs, const std::string_view rhs) const noexcept {
+        return std::lexicographical_compare(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), [](char a, char b) {
+            return static_cast<unsigned char>(AsciiToLower(a)) < static_cast<unsigned char>(AsciiToLower(b));
+        });
+    }
+};
+
+struct CaseInsensitiveEqual {
+    constexpr bool operator()(const std::string_view lhs, const std::string_view rhs) const noexcept {
+        return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin(), [](char a, char b) {
+                   return AsciiToLower(a) == AsciiToLower(b);
+               });
+    }
+};
+
+// FNV-1a по байтам в нижнем регистре, без копии ключа
+struct CaseInsensitiveHash {
+    constexpr size_t operator()(const std::string_view key) const noexcept {
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        for (const char c : key) {
+            hash ^= static_cast<unsigned char>(AsciiToLower(c));
+            hash *= 0x100000001B3ULL;
+        }
+
+        return static_cast<size_t>(hash);
+    }
+};
+
+// Естественный порядок: последовательности цифр сравниваются как числа, "key2" < "key10" < "key10a".
+// Числа любой длины сравниваются без переполнения: по длине без ведущих нулей, затем по цифрам.
+// Ключи, равные как числа, но записанные по-разному ("key01" и "key1"), упорядочиваются побайтово, поэтому
+// эквивалентность совпадает с обычным равенством строк и подходят стандартные хеш и равенство.
+struct NaturalLess {
+    using is_transparent = void;
+
+    // O(|lhs| + |rhs|)
+    constexpr bool operator()(const std::string_view lhs, const std::string_view rhs) const noexcept {
+        const int order = Compare(lhs, rhs);
+        return order != 0 ? order < 0 : lhs < rhs;
+    }
+
+private:
+    static constexpr int Compare(const std::string_view lhs, const std::string_view rhs) noexcept {
+        size_t i = 0;
+        size_t j = 0;
+
+        while (i < lhs.size() && j < rhs.size()) {
+            if (!IsAsciiDigit(lhs[i]) || !IsAsciiDigit(rhs[j])) {
+                // Число занимает место цифр в порядке байтов, поэтому сравнение с не-цифрой - по первому байту
+                if (lhs[i] != rhs[j]) {
+                    return static_cast<unsigned char>(lhs[i]) < static_cast<unsigned char>(rhs[j]) ? -1 : 1;
+                }
+                ++i;
+                ++j;
+                continue;
+            }
+
+            const size_t lhs_begin = SkipZeros(lhs, i);
+            const size_t rhs_begin = SkipZeros(rhs, j);
+            const size_t lhs_end = SkipDigits(lhs, lhs_begin);
+            const size_t rhs_end = SkipDigits(rhs, rhs_begin);
+
+            if (lhs_end - lhs_begin != rhs_end - rhs_begin) {
+                return lhs_end - lhs_begin < rhs_end - rhs_begin ? -1 : 1;
+            }
+
+            const auto lhs_digits = lhs.substr(lhs_begin, lhs_end - lhs_begin);
+            const auto rhs_digits = rhs.substr(rhs_begin, rhs_end - rhs_begin);
+            if (const int digits = lhs_digits.compare(rhs_digits); digits != 0) {
+                return digits < 0 ? -1 : 1;
+            }
+
+            i = lhs_end;
+            j = rhs_end;
+        }
+
+        return (i < lhs.size()) - (j < rhs.size());
+    }
+
+    static constexpr size_t SkipZeros(const std::string_view str, size_t pos) noexcept {
+        while (pos < str.size() && str[pos] == '0') {
+            ++pos;
+        }
+
+        return pos;
+    }
+
+    static constexpr size_t SkipDigits(const std::string_view str, size_t pos) noexcept {
+        while (pos < str.size() && IsAsciiDigit(str[pos])) {
+            ++pos;
+        }
+
+        return pos;
+    }
+};
+
+// Готовые политики индекса для строковых ключей
+using CaseInsensitiveIndexPolicy = MapIndexPolicy<CaseInsensitiveLess, CaseInsensitiveHash, CaseInsensitiveEqual>;
+using NaturalOrderIndexPolicy = MapIndexPolicy<NaturalLess>;
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "key_hash.hpp"
+
+// Разница между двумя хранилищами (KVStorage::diff): ключи в порядке индекса
+template <typename Key>
+struct StorageDiff {
+    std::vector<Key> added;   // есть только в новом хранилище
+    std::vector<Key> removed; // есть только в старом
+    std::vector<Key> changed; // есть в обоих, значения различаются
+
+    bool empty() const noexcept {
+        return added.empty() && removed.empty() && changed.empty();
+    }
+
+    bool operator==(const StorageDiff&) const = default;
+};
+
+// Значения, для которых можно посчитать хеш сводки MerkleDigest: строки, типы с std::hash и тривиально копируемые
+template <typename Value>
+concept DigestibleValue =
+    std::same_as<Value, std::string> || std::is_trivially_copyable_v<Value> ||
+    requires(const Value& value) {
+        { std::hash<Value>{}(value) } -> std::convertible_to<size_t>;
+    };
+
+// Хеш значения для сводки. Одинаковые значения дают одинаковый хеш в пределах процесса. Тривиально копируемое
+// значение хешируется по байтам объекта: разные байты заполнения дают разные хеши, и diff просто сравнит такие
+// значения через operator==
+template <DigestibleValue Value>
+uint64_t ValueDigest(const Value& value) noexcept {
+    if constexpr (std::same_as<Value, std::string>) {
+        return StringHash::hash(value.data(), value.size(), 0);
+    } else if constexpr (requires { std::hash<Value>{}(value); }) {
+        return std::hash<Value>{}(value);
+    } else {
+        return StringHash::hash(reinterpret_cast<const char*>(&value), sizeof(Value), 0);
+    }
+}
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+// Тип, которым ключ передаётся в методы чтения и хранится в хеш-таблице для доступа по ключу.
+// Для строк это string_view на ключ внутри узла map - поиск без временных строк и без второй копии ключа.
+// Для остальных типов (например, целых) - сам ключ: без аллокаций и с дешёвым хешированием.
+template <typename Key>
+struct KeyTraits {
+    using view_type = Key;
+};
+
+template <>
+struct KeyTraits<std::string> {
+    using view_type = std::string_view;
+};
+
+// Результат вставки в индекс: ключ в том виде, в котором он хранится в индексе (для строк - string_view на ключ
+// внутри узла, действителен, пока запись в индексе), значение и признак вставки новой записи.
+template <typename KeyView, typename Mapped>
+struct EmplaceResult {
+    KeyView key;
+    Mapped* mapped;
+    bool inserted;
+};
+
+// Запись индекса: ключ в том виде, в котором он хранится в индексе, и значение (nullptr - ключа нет)
+template <typename KeyView, typename Mapped>
+struct IndexEntry {
+    KeyView key;
+    Mapped* mapped;
+};
+
+// Ключ хеш-таблицы вместе с его хешем. Хеш считается один раз при вставке и при поиске: при обходе корзины
+// хеш-таблица берёт сохранённый хеш соседних узлов вместо пересчёта по ключу, а ключи сравниваются, только
+// если хеши совпали. Для длинных строковых ключей это заметно ускоряет get.
+template <typename KeyView>
+struct HashedKey {
+    KeyView key;
+    size_t hash;
+};
+
+// Упорядоченный индекс KVStorage общего вида: std::map для getManySorted и хеш-таблица поверх узлов map
+// для доступа по ключу за O(1)*.
+// Интерфейс индекса (его же реализует RadixIndex):
+//   find(key)                       - указатель на Mapped или nullptr, O(1)*
+//   findEntry(key)                  - то же вместе с хранимым ключом (IndexEntry)
+//   tryEmplace(key, mapped)         - вставка, если ключа нет; иначе существующая запись (EmplaceResult)
+//   extract(key)                    - перемещает ключ и Mapped из индекса
+//   forEachFrom(key, fn)            - обход записей с ключами >= key в порядке Compare, пока fn возвращает true
+//   forEach(fn)                     - обход всех записей (у неконстантного индекса fn может менять Mapped)
+//   forEachWhile(fn)                - обход с наименьшего ключа, пока fn возвращает true
+//   extractIf(max_count, pred, fn)  - обход по порядку с извлечением до max_count записей, для которых pred - true
+//   mergeFrom(other, insert, conflict) - перенос всех записей other: insert(key, mapped) для новых ключей,
+//                                   conflict(key, mapped, other_mapped) для ключей, которые есть в обоих индексах
+//   hashKey(key)                    - хеш ключа, например для распределения записей по времени или шардам
+// Hash и KeyEqual должны быть согласованы с Compare: ключи, эквивалентные по Compare, равны по KeyEqual и имеют
+// одинаковый хеш (например, регистронезависимые Compare, Hash и KeyEqual, см. key_order.hpp).
+template <typename Key, typename Mapped, typename Compare, typename Hash, typename KeyEqual = std::equal_to<>>
+class MapIndex {
+public:
+    using KeyView = typename KeyTraits<Key>::view_type;
+
+    MapIndex() = default;
+    MapIndex(MapIndex&&) noexcept = default;
+    MapIndex& operator=(MapIndex&&) noexcept = default;
+
+    // Копия хеш-таблицы ссылалась бы на узлы исходной map
+    MapIndex(const MapIndex&) = delete;
+    MapIndex& operator=(const MapIndex&) = delete;
+
+    Mapped* find(const KeyView key) noexcept {
+        auto it = key_to_storage_iter_.find(TableKeyOf(key));
+        return it == key_to_storage_iter_.end() ? nullptr : &it->second->second;
+    }
+
+    const Mapped* find(const KeyView key) const noexcept {
+        auto it = key_to_storage_iter_.find(TableKeyOf(key));
+        return it == key_to_storage_iter_.end() ? nullptr : &it->second->second;
+    }
+
+    IndexEntry<KeyView, Mapped> findEntry(const KeyView key) noexcept {
+        auto it = key_to_storage_iter_.find(TableKeyOf(key));
+        return it == key_to_storage_iter_.end() ? IndexEntry<KeyView, Mapped>{key, nullptr}
+                                                : IndexEntry<KeyView, Mapped>{ViewOf(it->first), &it->second->second};
+    }
+
+    // Вставка в map происходит за O(log n), плюс O(1) амортизированное для хеш-таблицы
+    EmplaceResult<KeyView, Mapped> tryEmplace(Key&& key, Mapped&& mapped) {
+        auto [map_it, inserted] = storage_.try_emplace(std::move(key), std::move(mapped));
+        if (inserted) {
+            key_to_storage_iter_.emplace(TableKeyOf(map_it->first), map_it);
+        }
+
+        return {map_it->first, &map_it->second, inserted};
+    }
+
+    // O(1)* - erase по итератору в std::map амортизированно O(1)
+    std::optional<std::pair<Key, Mapped>> extract(const KeyView key) {
+        auto it = key_to_storage_iter_.find(TableKeyOf(key));
+        if (it == key_to_storage_iter_.end()) {
+            return std::nullopt;
+        }
+
+        auto storage_it = it->second;
+        key_to_storage_iter_.erase(it);
+        auto node = storage_.extract(storage_it);
+
+        return std::make_pair(std::move(node.key()), std::move(node.mapped()));
+    }
+
+    // O(log n + k) - log n на поиск первого элемента (lower_bound), k - кол-во посещённых записей
+    template <typename F>
+    void forEachFrom(const KeyView key, F&& fn) const {
+        for (auto it = storage_.lower_bound(key); it != storage_.end(); ++it) {
+            if (!fn(it->first, it->second)) {
+                return;
+            }
+        }
+    }
+
+    // O(k) - k - кол-во посещённых записей
+    template <typename F>
+    void forEachWhile(F&& fn) const {
+        for (const auto& [key, mapped] : storage_) {
+            if (!fn(key, mapped)) {
+                return;
+            }
+        }
+    }
+
+    // O(n)
+    template <typename F>
+    void forEach(F&& fn) const {
+        for (const auto& [key, mapped] : storage_) {
+            fn(key, mapped);
+        }
+    }
+
+    template <typename F>
+    void forEach(F&& fn) {
+        for (auto& [key, mapped] : storage_) {
+            fn(key, mapped);
+        }
+    }
+
+    // O(n) - один проход по storage_
+    template <typename Pred, typename Sink>
+    size_t extractIf(const size_t max_count, Pred&& pred, Sink&& sink) {
+        size_t extracted = 0;
+
+        for (auto it = storage_.begin(); it != storage_.end() && extracted < max_count;) {
+            if (!pred(it->first, it->second)) {
+                ++it;
+                continue;
+            }
+
+            key_to_storage_iter_.erase(TableKeyOf(it->first));
+            auto node = storage_.extract(it++);
+            sink(std::move(node.key()), std::move(node.mapped()));
+            ++extracted;
+        }
+
+        return extracted;
+    }
+
+    // Слияние упорядоченных map одним совместным проходом: узлы other переносятся в storage_ вставкой с подсказкой
+    // без копирования ключей и значений. other остаётся пустым. O(n + m)
+    template <typename OnInsert, typename OnConflict>
+    void mergeFrom(MapIndex&& other, OnInsert&& on_insert, OnConflict&& on_conflict) {
+        key_to_storage_iter_.reserve(storage_.size() + other.storage_.size());
+
+        const auto less = storage_.key_comp();
+        auto hint = storage_.begin();
+
+        for (auto it = other.storage_.begin(); it != other.storage_.end();) {
+            while (hint != storage_.end() && less(hint->first, it->first)) {
+                ++hint;
+            }
+
+            if (hint != storage_.end() && !less(it->first, hint->first)) {
+                on_conflict(KeyView(hint->first), hint->second, it->second);
+                ++it;
+                continue;
+            }
+
+            // Узел встаёт прямо перед hint: вставка с верной подсказкой - O(1) амортизированно
+            auto inserted = storage_.insert(hint, other.storage_.extract(it++));
+            key_to_storage_iter_.emplace(TableKeyOf(inserted->first), inserted);
+            on_insert(KeyView(inserted->first), inserted->second);
+        }
+
+        // Хеш-таблица other ссылается на перенесённые узлы
+        other = MapIndex{};
+    }
+
+    size_t size() const noexcept {
+        return storage_.size();
+    }
+
+    size_t hashKey(const KeyView key) const {
+        return hash_(key);
+    }
+
+private:
+    // Хеш хранится рядом с ключом для нескалярных ключей (строк); скалярные ключи хешируются дёшево,
+    // и лишние 8 байт на запись им не нужны
+    static constexpr bool kStoreHash = !std::is_scalar_v<KeyView>;
+
+    struct StoredHash {
+        size_t operator()(const HashedKey<KeyView>& key) const noexcept {
+            return key.hash;
+        }
+    };
+
+    struct StoredHashEqual {
+        bool operator()(const HashedKey<KeyView>& lhs, const HashedKey<KeyView>& rhs) const {
+            return lhs.hash == rhs.hash && KeyEqual{}(lhs.key, rhs.key);
+        }
+    };
+
+    using TableKey = std::conditional_t<kStoreHash, HashedKey<KeyView>, KeyView>;
+    using TableHash = std::conditional_t<kStoreHash, StoredHash, Hash>;
+    using TableEqual = std::conditional_t<kStoreHash, StoredHashEqual, KeyEqual>;
+
+    TableKey TableKeyOf(const KeyView key) const {
+        if constexpr (kStoreHash) {
+            return {key, hash_(key)};
+        } else {
+            return key;
+        }
+    }
+
+    static KeyView ViewOf(const TableKey& key) noexcept {
+        if constexpr (kStoreHash) {
+            return key.key;
+        } else {
+            return key;
+        }
+    }
+
+    // Compare по умолчанию прозрачный (std::less<>), чтобы не создавать временные ключи из KeyView в методах мапы
+    using Storage = std::map<Key /* key */, Mapped /* value, ttl*/, Compare>;
+    using StorageIterator = typename Storage::iterator;
+
+    // Использую map, так как читающих запросов 95% и сортировать каждый раз при вызове getManySorted повышает время
+    // отклика системы
+    Storage storage_;
+    // Дополнительная хеш-таблица для доступа к элементам storage_ за O(1)*
+    // Для строк требуется примерно 32 байта на запись: 16 байт под string_view (указатель + длина) и 8 под хеш
+    // string_view ссылается на ключ внутри узла storage_ - узлы map не перемещаются, пока запись существует
+    std::unordered_map<TableKey, StorageIterator, TableHash, TableEqual> key_to_storage_iter_;
+    [[no_unique_address]] Hash hash_;
+};
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <type_traits>
+#include <utility>
+
+#include "key_hash.hpp"
+#include "bloom_filter.hpp"
+#include "deferred_free.hpp"
+#include "hot_keys.hpp"
+#include "kv_index.hpp"
+#include "packed_expiry.hpp"
+#include "radix_index.hpp"
+#include "spill_file.hpp"
+
+// Политики KVStorage, выбираемые на этапе компиляции. Каждая комбинация компилируется в отдельный код без
+// виртуальных вызовов: отключённые возможности (блокировки, телеметрия) не оставляют в нём ни проверок, ни полей.
+
+// ---- Упорядоченный индекс ----
+// Политика индекса задаёт шаблон type<Key, Mapped>, kSupportsKey<Key> - можно ли её использовать с типом ключа,
+// и CompareFor<Key> - порядок ключей в getManySorted.
+
+// Хеш по умолчанию для MapIndexPolicy: StringHash для строк, std::hash<KeyTraits<Key>::view_type> для остальных
+struct DefaultKeyHash {};
+
+// std::map + хеш-таблица. Compare задаёт порядок getManySorted и должен уметь сравнивать Key с
+// KeyTraits<Key>::view_type (по умолчанию прозрачный std::less<>). Hash и KeyEqual - хеш и равенство
+// KeyTraits<Key>::view_type для доступа по ключу; при нестандартном Compare они должны давать ту же
+// эквивалентность ключей, что и Compare (готовые наборы - в key_order.hpp).
+// MapIndexPolicy<std::less<>, SeededStringHash> - хеш строк со случайным зерном против hash flooding.
+template <typename Compare = std::less<>, typename Hash = DefaultKeyHash, typename KeyEqual = std::equal_to<>>
+struct MapIndexPolicy {
+    template <typename Key>
+    using DefaultHashFor = std::conditional_t<std::is_same_v<typename KeyTraits<Key>::view_type, std::string_view>,
+                                              StringHash, std::hash<typename KeyTraits<Key>::view_type>>;
+
+    template <typename Key>
+    using HashFor = std::conditional_t<std::is_same_v<Hash, DefaultKeyHash>, DefaultHashFor<Key>, Hash>;
+
+    template <typename Key, typename Mapped>
+    using type = MapIndex<Key, Mapped, Compare, HashFor<Key>, KeyEqual>;
+
+    template <typename Key>
+    using CompareFor = Compare;
+
+    // Для ключей, отличных от KeyView (строки), Compare должен быть прозрачным: иначе lower_bound в getManySorted
+    // создавал бы временный Key из string_view
+    template <typename Key>
+    static constexpr bool kSupportsKey =
+        (std::is_same_v<Key, typename KeyTraits<Key>::view_type> || requires { typename Compare::is_transparent; }) &&
+        std::is_invocable_r_v<bool, const Compare&, const Key&, const typename KeyTraits<Key>::view_type&> &&
+        std::is_invocable_r_v<bool, const Compare&, const typename KeyTraits<Key>::view_type&, const Key&> &&
+        std::is_invocable_r_v<size_t, const HashFor<Key>&, const typename KeyTraits<Key>::view_type&> &&
+        std::is_invocable_r_v<bool, const KeyEqual&, const typename KeyTraits<Key>::view_type&,
+                              const typename KeyTraits<Key>::view_type&>;
+};
+
+// Radix-дерево, только для беззнаковых целых ключей в числовом порядке
+struct RadixIndexPolicy {
+    template <typename Key, typename Mapped>
+    using type = RadixIndex<Key, Mapped>;
+
+    template <typename Key>
+    using CompareFor = std::less<>;
+
+    template <typename Key>
+    static constexpr bool kSupportsKey = std::unsigned_integral<Key>;
+};
+
+// По умолчанию: RadixIndexPolicy для беззнаковых целых ключей, MapIndexPolicy<> для остальных
+struct AutoIndexPolicy {
+    template <typename Key>
+    using Selected = std::conditional_t<std::unsigned_integral<Key>, RadixIndexPolicy, MapIndexPolicy<>>;
+
+    template <typename Key, typename Mapped>
+    using type = typename Selected<Key>::template type<Key, Mapped>;
+
+    template <typename Key>
+    using CompareFor = typename Selected<Key>::template CompareFor<Key>;
+
+    template <typename Key>
+    static constexpr bool kSupportsKey = Selected<Key>::template kSupportsKey<Key>;
+};
+
+// ---- Механизм удаления протухших записей ----
+// Политика задаёт шаблон Engine<KeyView, TimePoint> с методами:
+//   onInsert(key, reclaim_at), onErase(key, reclaim_at) - запись с моментом удаления reclaim_at появилась/исчезла
+//   reclaim(index, now, max_count, pred, sink)          - извлекает до max_count записей, готовых к удалению
+// reclaim_at - момент, начиная с которого запись можно удалять (expire_time плюс смещение в окне выравнивания).
+// kByReclaimTime - reclaim отбирает записи по reclaim_at и не вызывает pred.
+// Третий механизм, PackedExpiry (плотный массив моментов удаления с SIMD-поиском), - в packed_expiry.hpp.
+
+// Проход по индексу при каждом вызове: O(n), без дополнительной памяти
+struct ScanExpiry {
+    static constexpr bool kByReclaimTime = false;
+
+    template <typename KeyView, typename TimePoint>
+    class Engine {
+    public:
+        void onInsert(const KeyView, TimePoint) noexcept {
+        }
+
+        void onErase(const KeyView, TimePoint) noexcept {
+        }
+
+        template <typename Index, typename Pred, typename Sink>
+        size_t reclaim(Index& index, TimePoint, const size_t max_count, Pred&& pred, Sink&& sink) {
+            return index.extractIf(max_count, pred, sink);
+        }
+    };
+};
+
+// Очередь записей, упорядоченная по моменту удаления: O(log n) на удалённую запись вместо прохода по всему
+// индексу, ценой узла std::set на каждую запись с конечным TTL. Записи отдаются в порядке протухания.
+struct QueueExpiry {
+    static constexpr bool kByReclaimTime = true;
+
+    template <typename KeyView, typename TimePoint>
+    class Engine {
+    public:
+        void onInsert(const KeyView key, TimePoint reclaim_at) {
+            if (reclaim_at != TimePoint::max()) {
+                queue_.emplace(reclaim_at, key);
+            }
+        }
+
+        void onErase(const KeyView key, TimePoint reclaim_at) {
+            if (reclaim_at != TimePoint::max()) {
+                queue_.erase({reclaim_at, key});
+            }
+        }
+
+        template <typename Index, typename Pred, typename Sink>
+        size_t reclaim(Index& index, TimePoint now, const size_t max_count, Pred&&, Sink&& sink) {
+            size_t reclaimed = 0;
+
+            while (reclaimed < max_count && !queue_.empty() && queue_.begin()->first <= now) {
+                // Для строк KeyView ссылается на ключ в узле индекса: поиск завершается до того, как ключ
+                // перемещается из узла
+                const KeyView key = queue_.begin()->second;
+                queue_.erase(queue_.begin());
+
+                auto extracted = index.extract(key);
+                sink(std::move(extracted->first), std::move(extracted->second));
+                ++reclaimed;
+            }
+
+            return reclaimed;
+        }
+
+    private:
+        std::set<std::pair<TimePoint /* reclaim_at */, KeyView>> queue_;
+    };
+};
+
+// ---- Синхронизация ----
+// Политика задаёт shared() и exclusive(), возвращающие RAII-захват для чтения и для изменения.
+
+// Без синхронизации: хранилище используется из одного потока
+struct NoLock {
+    struct Guard {};
+
+    Guard shared() const noexcept {
+        return {};
+    }
+
+    Guard exclusive() const noexcept {
+        return {};
+    }
+};
+
+// std::shared_mutex: чтения (get, getManySorted...) идут параллельно, изменения - эксклюзивно
+class SharedMutexLock {
+public:
+    std::shared_lock<std::shared_mutex> shared() const {
+        return std::shared_lock(mutex_);
+    }
+
+    std::unique_lock<std::shared_mutex> exclusive() const {
+        return std::unique_lock(mutex_);
+    }
+
+private:
+    mutable std::shared_mutex mutex_;
+};
+
+template <typename Lock>
+concept LockPolicy = requires(const Lock& lock) {
+    lock.shared();
+    lock.exclusive();
+};
+
+// ---- Телеметрия ----
+
+struct NoStats {
+    static constexpr bool kEnabled = false;
+};
+
+// Счётчики и распределение времени протухания (KVStorage::expiryStats). Добавляет к set/remove/удалению
+// протухших записей O(log b), где b - кол-во различных секунд протухания.
+struct CollectStats {
+    static constexpr bool kEnabled = true;
+};
+
+// ---- Фильтр отсутствующих ключей ----
+
+struct NoFilter {
+    static constexpr bool kEnabled = false;
+};
+
+// Блочный фильтр Блума перед индексом (BlockedBloomFilter): get/getWithTtl/remove отсутствующего ключа
+// завершаются после чтения одного блока фильтра, без поиска в хеш-таблице индекса. BitsPerKey бит на ключ
+// (10 - около 1% ложных срабатываний). Удалённые ключи остаются в фильтре до перестроения: фильтр перестраивается
+// обходом индекса, когда число ключей превышает размер фильтра или удалённых становится больше половины,
+// то есть O(1) амортизированно на set/remove.
+template <size_t BitsPerKey = 10>
+struct BloomFilter {
+    static constexpr bool kEnabled = true;
+    static constexpr size_t kBitsPerKey = BitsPerKey;
+};
+
+// ---- Вытеснение холодных значений ----
+
+struct NoTiering {
+    static constexpr bool kEnabled = false;
+};
+
+// Два уровня хранения: горячие значения в памяти, холодные - в файле (SpillFile), ключи и метаданные записей
+// всегда остаются в индексе. get и getManySorted считают обращения к записи (8-битный счётчик на запись),
+// KVStorage::spillColdValues вытесняет значения записей без обращений и возвращает в память вытесненные значения
+// с PromoteHits и более обращениями. get холодного ключа - одно чтение из файла (pread).
+// Значения короче MinValueBytes не вытесняются: запись о месте в файле заняла бы не меньше памяти.
+// Value - std::string или тривиально копируемый тип (SpillableValue).
+template <size_t MinValueBytes = 64, uint8_t PromoteHits = 2>
+struct SpillColdValues {
+    static constexpr bool kEnabled = true;
+    static constexpr size_t kMinValueBytes = MinValueBytes;
+    static constexpr uint8_t kPromoteHits = PromoteHits;
+};
+
+// ---- Профилирование горячих ключей ----
+
+// Политика задаёт шаблон Tracker<Key> - профилировщик, который хранит KVStorage.
+
+struct NoHotKeys {
+    static constexpr bool kEnabled = false;
+
+    template <typename Key>
+    struct Tracker {};
+};
+
+// Горячие ключи по выборке обращений get/getWithTtl/set (HotKeyTracker, KVStorage::hotKeys): в выборку попадает
+// в среднем одно из SampleEvery обращений потока, отслеживаются TopK ключей с наибольшей частотой.
+template <size_t TopK = 16, uint32_t SampleEvery = 64>
+struct TrackHotKeys {
+    static constexpr bool kEnabled = true;
+
+    template <typename Key>
+    using Tracker = HotKeyTracker<Key, TopK, SampleEvery>;
+};
+
+// ---- Освобождение значений ----
+// Политика задаёт шаблон Disposer<Value> с dispose(value) - вызывается для значения перед его уничтожением
+// при перезаписи (set) и удалении (remove).
+
+// Значения освобождаются на месте, внутри set/remove
+struct FreeInPlace {
+    static constexpr bool kEnabled = false;
+
+    template <typename Value>
+    struct Disposer {
+        void dispose(Value&) noexcept {
+        }
+    };
+};
+
+// Значения от MinBytes байт (ёмкость строки или вектора) перемещаются в DeferredFreeQueue и освобождаются фоновым
+// потоком хранилища (Background) или порциями в KVStorage::freeDeferredValues: set и remove большого значения
+// не зависят от его размера.
+template <size_t MinBytes = size_t{1} << 20, bool Background = true>
+struct DeferFreeLargeValues {
+    static constexpr bool kEnabled = true;
+
+    template <typename Value>
+    using Disposer = DeferredFreeQueue<Value, MinBytes, Background>;
+};
+
+// ---- Сводка для сравнения хранилищ (KVStorage::diff) ----
+
+// Без сводки diff проходит оба индекса целиком
+struct NoDigest {
+    static constexpr bool kEnabled = false;
+};
+
+// Сводка по диапазонам упорядоченного индекса - дерево Меркла с границами по хешу ключа: на уровне l ключ,
+// хеш которого делится на RangeEvery^(l+1), начинает новый диапазон, и для каждого диапазона хранится сумма хешей
+// его записей (ключ и значение). Диапазон уровня l + 1 состоит из ~RangeEvery диапазонов уровня l; уровней столько,
+// чтобы RangeEvery^(уровень) не превышало 2^32, то есть для практических n на верхнем уровне единицы диапазонов.
+// Границы зависят только от ключей, поэтому у хранилищ с одинаковыми ключами они совпадают, и diff спускается
+// только в диапазоны с разными суммами, не читая остальные записи. Стоит 8 байт на запись, узел std::map
+// на ~RangeEvery записей и O(kLevels * log n) на set/remove, плюс O(RangeEvery) на уровень при вставке
+// или удалении ключа-границы.
+template <size_t RangeEvery = 64>
+struct MerkleDigest {
+    static_assert(RangeEvery > 1 && RangeEvery <= (uint64_t{1} << 32));
+
+    static constexpr bool kEnabled = true;
+    static constexpr size_t kRangeEvery = RangeEvery;
+
+    static constexpr size_t kLevels = [] {
+        size_t levels = 0;
+        for (uint64_t span = RangeEvery; span <= (uint64_t{1} << 32); span *= RangeEvery) {
+            ++levels;
+        }
+        return levels;
+    }();
+};
+
+// Набор политик KVStorage
+template <typename Index = AutoIndexPolicy, typename Expiry = ScanExpiry, typename Lock = NoLock,
+          typename Stats = NoStats, typename Filter = NoFilter, typename Tiering = NoTiering,
+          typename HotKeys = NoHotKeys, typename Disposal = FreeInPlace, typename Digest = NoDigest>
+struct KVPolicies {
+    using index = Index;
+    using expiry = Expiry;
+    using lock = Lock;
+    using stats = Stats;
+    using filter = Filter;
+    using tiering = Tiering;
+    using hot_keys = HotKeys;
+    using disposal = Disposal;
+    using digest = Digest;
+};
@@ -1,82 +1,293 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <chrono>
+#include <concepts>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <future>
 #include <map>
+#include <memory>
 #include <optional>
 #include <span>
 #include <string>
 #include <string_view>
 #include <tuple>
-#include <unordered_map>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-template <typename Clock>
+#include "clock.hpp"
+#include "kv_diff.hpp"
+#include "kv_index.hpp"
+#include "kv_policies.hpp"
+
+// Интерфейс получателя протухших записей. Вызывается механизмом удаления протухших записей
+// (removeExpiredEntries) один раз на пачку, а не на каждую запись. Ключи и значения перемещаются
+// из хранилища в пачку без копирования.
+template <typename Key = std::string, typename Value = std::string>
+class ExpiryListener {
+public:
+    virtual ~ExpiryListener() = default;
+
+    virtual void onExpired(std::vector<std::pair<Key, Value>>&& batch) = 0;
+};
+
+// Настройки механизма протухания записей.
+struct ExpiryOptions {
+    // Разброс TTL в процентах: при set с ttl != 0 фактическое время жизни выбирается случайно из
+    // [ttl * (100 - p) / 100, ttl], чтобы записи, загруженные пачкой с одинаковым ttl, не протухали одновременно.
+    // 0 - выключено, значения больше 100 приводятся к 100.
+    uint32_t ttl_jitter_percent = 0;
+
+    // Окно выравнивания нагрузки для removeExpiredEntries: протухшая запись становится доступной для удаления
+    // не сразу, а через смещение от expire_time, равномерно распределённое по [0, reclaim_window) по хешу ключа.
+    // Так одновременно протухшая когорта удаляется постепенно в течение окна. Для get/getManySorted запись
+    // недоступна сразу после expire_time независимо от окна. 0 - выключено.
+    std::chrono::milliseconds reclaim_window{0};
+
+    // Начальное состояние генератора случайных чисел для ttl_jitter_percent.
+    uint64_t jitter_seed = 0x9E3779B97F4A7C15ULL;
+};
+
+// Настройки вытеснения холодных значений (политика SpillColdValues).
+struct TieringOptions {
+    // Каталог для файла вытесненных значений, пустой - $TMPDIR или /tmp
+    std::string spill_directory;
+};
+
+// Какую запись оставляет KVStorage::mergeFrom, если ключ есть в обоих хранилищах
+enum class MergeConflict {
+    kNewestExpiry, // с более поздним моментом протухания (бессрочная - самая поздняя), при равенстве - целевую
+    kSourceWins,   // запись из other
+    kTargetWins,   // запись этого хранилища
+};
+
+// Key и Value - типы ключа и значения. Policies - набор политик KVPolicies (см. kv_policies.hpp): упорядоченный
+// индекс (по умолчанию RadixIndex для беззнаковых целых ключей и std::map + хеш-таблица для остальных),
+// механизм удаления протухших записей, синхронизация и телеметрия.
+// Вместо Clock можно передать тег NoTtl - хранилище без TTL (см. kHasTtl).
+template <typename Clock, typename Key = std::string, typename Value = std::string, typename Policies = KVPolicies<>>
+    requires StorageClock<Clock> || std::same_as<Clock, NoTtl>
 class KVStorage {
 public:
+    // false для KVStorage<NoTtl, ...>: запись хранит только значение, часы не читаются, а set без ttl
+    // и методы протухания (getWithTtl, removeOneExpiredEntry, removeExpiredEntries, expiryStats...) исключены
+    static constexpr bool kHasTtl = !std::same_as<Clock, NoTtl>;
+    static constexpr bool kCollectStats = Policies::stats::kEnabled;
+    static constexpr bool kUseFilter = Policies::filter::kEnabled;
+    static constexpr bool kTiered = Policies::tiering::kEnabled;
+    static constexpr bool kTrackHotKeys = Policies::hot_keys::kEnabled;
+    static constexpr bool kDeferFree = Policies::disposal::kEnabled;
+    static constexpr bool kDigest = Policies::digest::kEnabled;
+
+    static_assert(Policies::index::template kSupportsKey<Key>,
+                  "Index policy does not support this key type: RadixIndexPolicy needs an unsigned integral key, "
+                  "MapIndexPolicy needs a transparent comparator accepting Key and KeyTraits<Key>::view_type "
+                  "and a hash/equality pair over KeyTraits<Key>::view_type");
+    static_assert(kHasTtl || std::same_as<typename Policies::expiry, ScanExpiry>,
+                  "NoTtl storage has nothing to expire: use the default ScanExpiry policy");
+    static_assert(kHasTtl || !kCollectStats, "NoTtl storage has no expiry stats to collect");
+    static_assert(LockPolicy<typename Policies::lock>, "Lock policy must provide shared() and exclusive()");
+    static_assert(!kTiered || (SpillableValue<Value> && std::default_initializable<Value>),
+                  "SpillColdValues needs a default-constructible std::string or trivially copyable value");
+    static_assert(!kDigest || DigestibleValue<Value>,
+                  "MerkleDigest needs a std::string, trivially copyable or std::hash-able value");
+
     using TimePoint = typename Clock::time_point;
+    using Duration = typename TimePoint::duration;
+    using KeyView = typename KeyTraits<Key>::view_type;
+    using Listener = ExpiryListener<Key, Value>;
+
+    // Значение вместе с оставшимся временем жизни записи.
+    struct ValueWithTtl {
+        Value value;
+        std::optional<Duration> ttl; // std::nullopt - бессрочная запись (ttl == 0 при set)
+
+        bool operator==(const ValueWithTtl&) const = default;
+    };
+
+    // Размер гистограммы оставшегося TTL: бакет i содержит записи с оставшимся временем жизни
+    // (2^(i-1), 2^i] секунд, бакет 0 - не больше секунды, последний - всё, что больше.
+    static constexpr size_t kTtlHistogramSize = 33;
+
+    // Снимок телеметрии протухания (политика CollectStats).
+    struct ExpiryStats {
+        uint64_t sets = 0;
+        uint64_t removes = 0;
+        uint64_t reclaimed = 0;       // удалено протухших записей (removeOneExpiredEntry, removeExpiredEntries)
+        uint64_t infinite_entries = 0;
+
+        // Протухли, но ещё не удалены. Время протухания учитывается с точностью до секунды, поэтому записи,
+        // протухшие меньше секунды назад, могут быть ещё не учтены.
+        uint64_t expired_not_reclaimed = 0;
+        Duration oldest_unreclaimed_lag = Duration::zero(); // сколько уже лежит самая старая неудалённая запись
+        Duration max_reclaim_lag = Duration::zero();        // наибольшая задержка между протуханием и удалением
+
+        std::array<uint64_t, kTtlHistogramSize> remaining_ttl_histogram{};
+    };
+
+    // Снимок состояния вытеснения (политика SpillColdValues).
+    struct TieringStats {
+        uint64_t spilled_values = 0;   // записей, чьё значение сейчас в файле
+        uint64_t spill_file_bytes = 0; // размер файла вытеснения
+        uint64_t garbage_bytes = 0;    // байт файла, занятых перезаписанными, удалёнными и возвращёнными значениями
+    };
 
     // Инициализирует хранилище переданными множеством записей. Размер span может быть очень большим.
     // Также принимает абстракцию часов (Clock) для возможности управления временем в тестах.
+    // options задают разброс TTL и выравнивание удаления протухших записей (см. ExpiryOptions),
+    // tiering - файл вытесненных значений для политики SpillColdValues.
     explicit KVStorage(
-        std::span<std::tuple<std::string /* key */, std::string /* value */, uint32_t /* ttl */>> entries, Clock& clock)
-            : clock_(clock) {
+        std::span<std::tuple<Key /* key */, Value /* value */, uint32_t /* ttl */>> entries, Clock& clock,
+        const ExpiryOptions& options = {}, const TieringOptions& tiering = {})
+        requires kHasTtl
+            : ttl_(clock, options),
+              tier_(tiering) {
+        ReserveFilter(entries.size());
+
         // O(n log n) - где n - кол-во записей в span entries
         for (const auto& [key, value, ttl] : entries) {
             set(key, value, ttl);
         }
     }
 
+    // Инициализирует хранилище без TTL переданными множеством записей.
+    explicit KVStorage(std::span<std::tuple<Key /* key */, Value /* value */>> entries,
+                       const TieringOptions& tiering = {})
+        requires(!kHasTtl)
+        : tier_(tiering) {
+        ReserveFilter(entries.size());
+
+        // O(n log n) - где n - кол-во записей в span entries
+        for (const auto& [key, value] : entries) {
+            set(key, value);
+        }
+    }
+
     ~KVStorage() = default;
 
     // Присваивает по ключу key значение value.
     // Если ttl == 0, то время жизни - бесконечность, иначе запись должна перестать быть доступной через ttl секунд.
+    // При включённом ExpiryOptions::ttl_jitter_percent время жизни случайно укорачивается в пределах процента.
     // Вставка в map происходит за O(log n), плюс O(1) амортизированное для хеш-таблицы
-    void set(std::string key, std::string value, uint32_t ttl) {
-        TimePoint expire_time = ttl == 0 ? TimePoint::max() : clock_.now() + std::chrono::seconds(ttl);
+    void set(Key key, Value value, uint32_t ttl)
+        requires kHasTtl
+    {
+        [[maybe_unused]] auto guard = lock_.exclusive();
+
+        TimePoint expire_time = ttl == 0 ? TimePoint::max() : Now() + JitteredTtl(ttl);
+
+        Entry entry{std::move(value), expire_time};
+        auto [stored_key, slot, inserted] = index_.tryEmplace(std::move(key), std::move(entry));
+        if (!inserted) {
+            OnErase(stored_key, *slot);
+            DigestSubtract(stored_key, *slot, false);
+            ReleaseSpilled(*slot);
+            disposer_.dispose(slot->value);
+            *slot = std::move(entry);
+        } else {
+            FilterAdd(stored_key);
+        }
+
+        OnInsert(stored_key, *slot);
+        DigestAdd(stored_key, *slot, inserted);
+        TrackAccess(stored_key);
+
+        if constexpr (kCollectStats) {
+            ++stats_.counters.sets;
+        }
+    }
+
+    // Присваивает по ключу key значение value в хранилище без TTL.
+    // O(log n) для MapIndex, O(sizeof(Key)) для RadixIndex
+    void set(Key key, Value value)
+        requires(!kHasTtl)
+    {
+        [[maybe_unused]] auto guard = lock_.exclusive();
+
+        Entry entry{std::move(value)};
+        auto [stored_key, slot, inserted] = index_.tryEmplace(std::move(key), std::move(entry));
+        if (!inserted) {
+            DigestSubtract(stored_key, *slot, false);
+            ReleaseSpilled(*slot);
+            disposer_.dispose(slot->value);
+            *slot = std::move(entry);
+        } else {
+            FilterAdd(stored_key);
+        }
 
-        auto [map_it, inserted] = storage_.insert_or_assign(std::move(key), Entry{std::move(value), expire_time});
-        key_to_storage_iter_[map_it->first] = map_it;
+        DigestAdd(stored_key, *slot, inserted);
+        TrackAccess(stored_key);
     }
 
     // Удаляет запись по ключу key.
     // Возвращает true если запись была удалена. Если ключа не было до удаления, то вернет false.
     // O(1)* благодаря хеш-таблице в std::map erase по итератору - O(1)* амортизированно
-    bool remove(const std::string_view key) {
-        auto it = key_to_storage_iter_.find(key);
-        if (it == key_to_storage_iter_.end()) {
+    bool remove(const KeyView key) {
+        [[maybe_unused]] auto guard = lock_.exclusive();
+
+        if (!MayContain(key)) {
+            return false;
+        }
+
+        auto [stored_key, entry] = index_.findEntry(key);
+        if (entry == nullptr) {
             return false;
         }
 
-        storage_.erase(it->second);
-        key_to_storage_iter_.erase(it);
+        // До извлечения: механизм удаления протухших может хранить string_view на ключ в узле индекса.
+        // Ключ из индекса, а не key: при нестандартном сравнении (key_order.hpp) они могут различаться побайтово
+        if constexpr (kHasTtl) {
+            OnErase(stored_key, *entry);
+        }
+        DigestSubtract(stored_key, *entry, true);
+        ReleaseSpilled(*entry);
+        disposer_.dispose(entry->value);
+
+        index_.extract(key);
+        FilterRemoved(1);
+
+        if constexpr (kCollectStats) {
+            ++stats_.counters.removes;
+        }
+
         return true;
     }
 
     // Получает значение по ключу key. Если данного ключа нет, то вернёт std::nullopt.
-    // Получение происходит за O(1)* - за счёт доп хеш-таблицы
-    std::optional<std::string> get(const std::string_view key) const {
-        auto it = key_to_storage_iter_.find(key);
+    // Получение происходит за O(1)* - за счёт доп хеш-таблицы. Без TTL часы не читаются.
+    std::optional<Value> get(const KeyView key) const {
+        [[maybe_unused]] auto guard = lock_.shared();
+        TrackAccess(key);
 
-        if (it != key_to_storage_iter_.end()) {
-            const auto& [key, entry] = *it->second;
+        if (!MayContain(key)) {
+            return std::nullopt;
+        }
 
-            if (IsAlive(entry, clock_.now())) {
-                return entry.value;
-            }
+        const Entry* entry = index_.find(key);
+
+        if (entry != nullptr && IsAlive(*entry, Now())) {
+            return ReadValue(*entry);
         }
 
         return std::nullopt;
     }
 
-    // Возвращает следующие count записей начиная с key в порядке лексикографической сортировки ключей.
+    // Возвращает следующие count записей начиная с key в порядке сортировки ключей индекса (по умолчанию
+    // лексикографический для строк и числовой для целых).
     // Пример: ("a", "val11"), ("b", "val12"), ("d, "val13"), ("e", "val14")
     // getManySorted("c", 2) -> ("d", "val13"), ("e", "val14")
     // O(log n + k) - log n на поиск первого элемента (lower_bound), k — кол-во возвращаемых записей(count)
-    std::vector<std::pair<std::string, std::string>> getManySorted(const std::string_view key,
-                                                                   const uint32_t count) const {
-        auto now = clock_.now();
-        std::vector<std::pair<std::string, std::string>> result;
+    std::vector<std::pair<Key, Value>> getManySorted(const KeyView key, const uint32_t count) const {
+        [[maybe_unused]] auto guard = lock_.shared();
+
+        auto now = Now();
+        std::vector<std::pair<Key, Value>> result;
 
         if (count == 0) {
             return result;
@@ -84,77 +295,1223 @@ public:
 
         result.reserve(count);
 
-        for (auto it = storage_.lower_bound(key); it != storage_.end() && result.size() < count; ++it) {
-            if (IsAlive(it->second, now)) {
-                result.push_back({it->first, it->second.value});
+        index_.forEachFrom(key, [&](const Key& entry_key, const Entry& entry) {
+            if (IsAlive(entry, now)) {
+                result.push_back({entry_key, ReadValue(entry)});
             }
+            return result.size() < count;
+        });
+
+        return result;
+    }
+
+    // Аналог get, дополнительно возвращающий оставшееся время жизни записи.
+    // Оставшееся время считается от того же единственного чтения часов, что и проверка IsAlive.
+    // O(1)*
+    std::optional<ValueWithTtl> getWithTtl(const KeyView key) const
+        requires kHasTtl
+    {
+        [[maybe_unused]] auto guard = lock_.shared();
+        TrackAccess(key);
+
+        if (!MayContain(key)) {
+            return std::nullopt;
         }
 
+        const Entry* entry = index_.find(key);
+
+        if (entry != nullptr) {
+            auto now = Now();
+
+            if (IsAlive(*entry, now)) {
+                return ValueWithTtl{ReadValue(*entry), RemainingTtl(*entry, now)};
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    // Аналог getManySorted, дополнительно возвращающий оставшееся время жизни каждой записи.
+    // Для всех записей используется одно чтение часов.
+    // O(log n + k)
+    std::vector<std::pair<Key, ValueWithTtl>> getManySortedWithTtl(const KeyView key, const uint32_t count) const
+        requires kHasTtl
+    {
+        [[maybe_unused]] auto guard = lock_.shared();
+
+        auto now = Now();
+        std::vector<std::pair<Key, ValueWithTtl>> result;
+
+        if (count == 0) {
+            return result;
+        }
+
+        result.reserve(count);
+
+        index_.forEachFrom(key, [&](const Key& entry_key, const Entry& entry) {
+            if (IsAlive(entry, now)) {
+                result.push_back({entry_key, ValueWithTtl{ReadValue(entry), RemainingTtl(entry, now)}});
+            }
+            return result.size() < count;
+        });
+
         return result;
     }
 
+    // Читает значение, а при его отсутствии загружает loader(key) (например, из медленного источника) и сохраняет
+    // с временем жизни ttl. Одновременные промахи по одному ключу объединяются: loader вызывается один раз,
+    // остальные потоки ждут его результата. Исключение loader получают все ожидавшие, запись не сохраняется.
+    // loader вызывается без блокировки хранилища, поэтому может обращаться к нему, кроме getOrLoad того же ключа.
+    // O(1)* при попадании, плюс O(log m) на промахе, где m - кол-во загрузок в процессе
+    template <typename Loader>
+        requires std::invocable<Loader&, KeyView> && std::convertible_to<std::invoke_result_t<Loader&, KeyView>, Value>
+    Value getOrLoad(const KeyView key, Loader&& loader, uint32_t ttl)
+        requires kHasTtl
+    {
+        return GetOrLoad(key, loader, [&](Value value) { set(Key(key), std::move(value), ttl); });
+    }
+
+    // getOrLoad для хранилища без TTL
+    template <typename Loader>
+        requires std::invocable<Loader&, KeyView> && std::convertible_to<std::invoke_result_t<Loader&, KeyView>, Value>
+    Value getOrLoad(const KeyView key, Loader&& loader)
+        requires(!kHasTtl)
+    {
+        return GetOrLoad(key, loader, [&](Value value) { set(Key(key), std::move(value)); });
+    }
+
     // Удаляет протухшую запись из структуры и возвращает ее. Если удалять нечего, то вернёт std::nullopt.
     // Если на момент вызова метода протухло несколько записей, то можно удалить любую.
-    // O(n) - где n - кол-во записей в storage_
+    // O(n) - где n - кол-во записей в хранилище, O(log n) с политикой QueueExpiry, O(n / 8) сравнений
+    // по плотному массиву с PackedExpiry
 
     // Была идея сделать хеш таблицу для хранения ttl, но это доп память и не очень частая операция
-    // так как большой срок хранения записей
-    std::optional<std::pair<std::string, std::string>> removeOneExpiredEntry() {
-        auto now = clock_.now();
+    // так как большой срок хранения записей. Для частого удаления есть политика QueueExpiry.
+    std::optional<std::pair<Key, Value>> removeOneExpiredEntry()
+        requires kHasTtl
+    {
+        [[maybe_unused]] auto guard = lock_.exclusive();
 
-        for (const auto& [key, entry] : storage_) {
-            if (IsExpired(entry, now)) {
-                auto expired = std::make_pair(key, entry.value);
-                key_to_storage_iter_.erase(key);
-                storage_.erase(key);
+        auto now = Now();
+        std::optional<std::pair<Key, Value>> expired;
 
-                return expired;
+        auto is_expired = [&](const Key&, const Entry& entry) { return IsExpired(entry, now); };
+        auto sink = [&](Key&& key, Entry&& entry) {
+            TrackReclaim(entry.expire_time, now);
+            DigestSubtract(key, entry, true);
+            expired.emplace(std::move(key), TakeValue(entry));
+        };
+
+        expiry_.reclaim(index_, now, 1, is_expired, sink);
+
+        if constexpr (Policies::expiry::kByReclaimTime) {
+            // Механизм отбирает записи по моменту удаления с учётом окна выравнивания, поэтому протухшая запись
+            // может быть ему ещё не видна
+            if (!expired && ttl_.reclaim_window != Duration::zero()) {
+                index_.extractIf(1, is_expired, [&](Key&& key, Entry&& entry) {
+                    expiry_.onErase(key, ReclaimTime(key, entry.expire_time));
+                    sink(std::move(key), std::move(entry));
+                });
             }
         }
 
-        return std::nullopt;
+        if (expired) {
+            FilterRemoved(1);
+        }
+
+        return expired;
+    }
+
+    // Удаляет до max_count протухших записей за один проход и возвращает кол-во удалённых.
+    // При включённом ExpiryOptions::reclaim_window удаляются только записи, чьё смещение в окне уже прошло.
+    // Удалённые записи передаются слушателю (setExpiryListener) одной пачкой уже после того, как структуры
+    // хранилища приведены в согласованное состояние, поэтому слушатель может обращаться к хранилищу.
+    // Ключи и значения перемещаются из узлов индекса в пачку без копирования.
+    // Слушатель вызывается вне блокировки хранилища.
+    // O(n) - один проход по индексу вместо O(n) на каждую запись при вызовах removeOneExpiredEntry в цикле,
+    // O(k log n) с политикой QueueExpiry, где k - кол-во удалённых записей, O(n / 8 + k) с PackedExpiry
+    size_t removeExpiredEntries(const size_t max_count)
+        requires kHasTtl
+    {
+        std::vector<std::pair<Key, Value>> batch;
+        Listener* listener = nullptr;
+
+        {
+            [[maybe_unused]] auto guard = lock_.exclusive();
+
+            auto now = Now();
+            listener = ttl_.listener;
+
+            expiry_.reclaim(
+                index_, now, max_count, [&](const Key& key, const Entry& entry) { return IsReclaimable(key, entry, now); },
+                [&](Key&& key, Entry&& entry) {
+                    TrackReclaim(entry.expire_time, now);
+                    DigestSubtract(key, entry, true);
+                    batch.emplace_back(std::move(key), TakeValue(entry));
+                });
+
+            FilterRemoved(batch.size());
+        }
+
+        const size_t removed = batch.size();
+        if (listener != nullptr && removed != 0) {
+            listener->onExpired(std::move(batch));
+        }
+
+        return removed;
+    }
+
+    // Удаляет все записи. Хранилище пусто сразу после возврата: старые индекс и механизм удаления протухших
+    // записей передаются фоновому потоку, который разрушает их узлы, а при меньше чем kMinBackgroundClear записях
+    // разрушаются на месте. Слушатель протухших записей не вызывается, счётчики телеметрии sets/removes/reclaimed
+    // сохраняются. Если разрушение от предыдущего clear ещё идёт, вызов дожидается его вне блокировки.
+    // O(1) под блокировкой (O(b) со статистикой протухания, b - кол-во различных секунд протухания)
+    void clear() {
+        // Новый файл вытеснения создаётся до изменений: при ошибке хранилище остаётся прежним
+        [[maybe_unused]] auto spill_file = NewSpillFile();
+        std::unique_ptr<Retired> retired;
+        std::future<void> previous;
+
+        {
+            [[maybe_unused]] auto guard = lock_.exclusive();
+
+            retired = std::make_unique<Retired>(std::exchange(index_, Index{}), std::exchange(expiry_, ExpiryEngine{}),
+                                                std::exchange(digest_, {}));
+
+            OnIndexEmptied();
+            if constexpr (kTiered) {
+                tier_.file = std::move(spill_file);
+                tier_.garbage_bytes = 0;
+            }
+
+            if (retired->index.size() >= kMinBackgroundClear) {
+                previous = std::exchange(
+                    retired_, std::async(std::launch::async, [retired = std::move(retired)]() mutable { retired.reset(); }));
+            }
+        }
+
+        // Здесь, вне блокировки: previous ждёт предыдущего фонового разрушения, а маленькие структуры разрушаются
+        // на месте
+    }
+
+    // Переносит в хранилище все записи other слиянием упорядоченных индексов: один совместный проход по ключам
+    // вместо set каждой записи, узлы MapIndex переходят из индекса в индекс без копирования ключей и значений.
+    // Для ключа, который есть в обоих хранилищах, остаётся запись по политике conflict, другая разрушается.
+    // Моменты протухания переносятся как есть, поэтому хранилища должны использовать одни часы. Вытесненные
+    // значения other читаются из его файла. other остаётся пустым и пригодным к использованию.
+    // Возвращает кол-во записей, взятых из other.
+    // O(n + m) для MapIndex, O(m * sizeof(Key)) для RadixIndex - m - кол-во записей other, плюс O(log n) на запись
+    // с QueueExpiry
+    size_t mergeFrom(KVStorage&& other, const MergeConflict conflict) {
+        if (&other == this) {
+            return 0;
+        }
+
+        // Блокировки берутся в порядке адресов: встречные слияния не блокируют друг друга
+        const bool this_first = std::less<>{}(this, &other);
+        [[maybe_unused]] auto first_guard = (this_first ? lock_ : other.lock_).exclusive();
+        [[maybe_unused]] auto second_guard = (this_first ? other.lock_ : lock_).exclusive();
+
+        size_t taken = 0;
+
+        index_.mergeFrom(
+            std::move(other.index_),
+            [&](const KeyView key, Entry& entry) {
+                other.Unspill(entry);
+                FilterAdd(key);
+                if constexpr (kHasTtl) {
+                    OnInsert(key, entry);
+                }
+                DigestAdd(key, entry, true);
+                ++taken;
+            },
+            [&](const KeyView key, Entry& entry, Entry& other_entry) {
+                if (!Replaces(other_entry, entry, conflict)) {
+                    return;
+                }
+
+                other.Unspill(other_entry);
+                if constexpr (kHasTtl) {
+                    OnErase(key, entry);
+                }
+                DigestSubtract(key, entry, false);
+                ReleaseSpilled(entry);
+                disposer_.dispose(entry.value);
+                entry = std::move(other_entry);
+                if constexpr (kHasTtl) {
+                    OnInsert(key, entry);
+                }
+                DigestAdd(key, entry, false);
+                ++taken;
+            });
+
+        // Механизм удаления протухших other ссылался на записи, которых у него больше нет
+        other.expiry_ = ExpiryEngine{};
+        other.OnIndexEmptied();
+
+        return taken;
+    }
+
+    // Ключи, по которым other (например, более новый снимок или реплика) отличается от этого хранилища: added - есть
+    // только в other, removed - только здесь, changed - значения различаются. Сравниваются ключи и значения
+    // записей в индексе: TTL не сравнивается, протухшие, но ещё не удалённые записи участвуют в сравнении.
+    // Оба индекса проходятся совместно по порядку ключей. С политикой MerkleDigest diff спускается по дереву сводки
+    // и пропускает диапазоны с одинаковыми границами и суммами хешей без чтения записей (совпадение сумм разных
+    // диапазонов маловероятно, но возможно).
+    // O(n + m) без сводки; O(n / 2^32 + d * R * L) с MerkleDigest<R> - d - кол-во различающихся ключей,
+    // L = kLevels ~ log_R(2^32) уровней
+    StorageDiff<Key> diff(const KVStorage& other) const
+        requires std::equality_comparable<Value>
+    {
+        StorageDiff<Key> result;
+        if (&other == this) {
+            return result;
+        }
+
+        const bool this_first = std::less<>{}(this, &other);
+        [[maybe_unused]] auto first_guard = (this_first ? lock_ : other.lock_).shared();
+        [[maybe_unused]] auto second_guard = (this_first ? other.lock_ : lock_).shared();
+
+        if constexpr (kDigest) {
+            DiffRanges(other, Policies::digest::kLevels - 1, nullptr, nullptr, result);
+        } else {
+            DiffEntries(other, nullptr, nullptr, result);
+        }
+
+        return result;
+    }
+
+    // Хеш ключа, согласованный с равенством ключей индекса (ключи, равные для индекса, имеют равный хеш),
+    // например для распределения ключей по шардам. O(|key|) для строк
+    size_t keyHash(const KeyView key) const {
+        return index_.hashKey(key);
+    }
+
+    // Устанавливает слушателя протухших записей (nullptr - отключить). Хранилище не владеет слушателем.
+    // removeOneExpiredEntry слушателя не вызывает: запись и так возвращается вызывающему.
+    void setExpiryListener(Listener* listener)
+        requires kHasTtl
+    {
+        [[maybe_unused]] auto guard = lock_.exclusive();
+        ttl_.listener = listener;
+    }
+
+    // Возвращает снимок телеметрии протухания. Доступен только с политикой CollectStats.
+    // O(b) - где b - кол-во различных секунд протухания среди записей
+    ExpiryStats expiryStats() const
+        requires kCollectStats
+    {
+        [[maybe_unused]] auto guard = lock_.shared();
+
+        ExpiryStats result = stats_.counters;
+        auto now = Now();
+        // Секунды протухания округлены вверх, а текущее время - вниз: живая запись не попадёт в протухшие
+        const int64_t now_bucket = std::chrono::floor<std::chrono::seconds>(now.time_since_epoch()).count();
+
+        for (const auto& [bucket, count] : stats_.expiry_buckets) {
+            if (bucket <= now_bucket) {
+                if (result.expired_not_reclaimed == 0) {
+                    result.oldest_unreclaimed_lag = std::max(Duration::zero(), now - BucketTime(bucket));
+                }
+                result.expired_not_reclaimed += count;
+                continue;
+            }
+
+            const auto remaining = static_cast<uint64_t>(bucket - now_bucket);
+            const auto index = std::min<size_t>(std::bit_width(remaining - 1), kTtlHistogramSize - 1);
+            result.remaining_ttl_histogram[index] += count;
+        }
+
+        return result;
+    }
+
+    // Вытесняет в файл до max_count значений записей, к которым не обращались (get, getManySorted...) с прошлого
+    // вызова, и возвращает в память вытесненные значения, к которым обратились не меньше PromoteHits раз.
+    // Счётчики обращений всех записей делятся пополам - частота обращений учитывается со старением. Новая или
+    // перезаписанная запись считается один раз прочитанной, поэтому переживает хотя бы один вызов.
+    // Значения пишутся в файл пачками; когда больше половины файла занято неиспользуемыми значениями, файл
+    // переписывается с одними живыми. Возвращает кол-во вытесненных значений.
+    // O(n + s) - где s - суммарный размер записанных в файл значений
+    size_t spillColdValues(const size_t max_count)
+        requires kTiered
+    {
+        [[maybe_unused]] auto guard = lock_.exclusive();
+
+        std::string buffer;
+        std::vector<Entry*> pending;
+        size_t spilled = 0;
+
+        index_.forEach([&](const Key&, Entry& entry) {
+            TierSlot& tier = entry.tier;
+
+            if (tier.spilled) {
+                if (tier.hits.load() >= Policies::tiering::kPromoteHits) {
+                    Value value = LoadSpilled(tier);
+                    ReleaseSpilled(entry);
+                    entry.value = std::move(value);
+                }
+            } else if (spilled < max_count && tier.hits.load() == 0) {
+                const std::string_view bytes = ValueBytes(entry.value);
+                if (bytes.size() >= Policies::tiering::kMinValueBytes && bytes.size() <= UINT32_MAX) {
+                    tier.offset = tier_.file.size() + buffer.size();
+                    tier.length = static_cast<uint32_t>(bytes.size());
+                    buffer.append(bytes);
+                    pending.push_back(&entry);
+                    ++spilled;
+
+                    if (buffer.size() >= kSpillBatchBytes) {
+                        FlushSpilled(buffer, pending);
+                    }
+                }
+            }
+
+            tier.hits.decay();
+        });
+
+        FlushSpilled(buffer, pending);
+
+        if (tier_.garbage_bytes >= kMinCompactBytes && tier_.garbage_bytes > tier_.file.size() / 2) {
+            CompactSpillFile();
+        }
+
+        return spilled;
+    }
+
+    TieringStats tieringStats() const
+        requires kTiered
+    {
+        [[maybe_unused]] auto guard = lock_.shared();
+        return {tier_.spilled_values, tier_.file.size(), tier_.garbage_bytes};
+    }
+
+    // Освобождает отложенные большие значения (политика DeferFreeLargeValues), пока освобождено меньше max_bytes,
+    // например в простое или между запросами. Возвращает кол-во освобождённых байт. Не захватывает блокировку
+    // хранилища. O(k) - k - кол-во освобождённых значений
+    size_t freeDeferredValues(const size_t max_bytes)
+        requires kDeferFree
+    {
+        return disposer_.drain(max_bytes);
+    }
+
+    // Байт в значениях, ожидающих освобождения
+    size_t deferredBytes() const
+        requires kDeferFree
+    {
+        return disposer_.pendingBytes();
+    }
+
+    // Самые частые ключи get/getWithTtl/set по выборке обращений, по убыванию частоты (политика TrackHotKeys).
+    // Ключ может уже отсутствовать в хранилище. Не захватывает блокировку хранилища.
+    // O(s + k log k) - s - кол-во ещё не учтённых выборок потоков, k - TopK
+    std::vector<HotKey<Key>> hotKeys() const
+        requires kTrackHotKeys
+    {
+        return hot_keys_.hottest();
     }
 
 private:
-    struct Entry {
-        std::string value; // sizeof(value);
+    // Счётчик обращений к записи, который get увеличивает под разделяемой блокировкой. Приращение - relaxed-чтение
+    // и запись без атомарного инкремента: одновременные обращения могут потерять приращение, для оценки частоты
+    // это допустимо, а кэш-линия не захватывается на каждом чтении. Насыщается на 255.
+    class AccessCounter {
+    public:
+        AccessCounter() = default;
+
+        AccessCounter(const AccessCounter& other) noexcept : value_(other.load()) {
+        }
+
+        AccessCounter& operator=(const AccessCounter& other) noexcept {
+            value_.store(other.load(), std::memory_order_relaxed);
+            return *this;
+        }
+
+        void touch() const noexcept {
+            const uint8_t value = load();
+            if (value != UINT8_MAX) {
+                value_.store(value + 1, std::memory_order_relaxed);
+            }
+        }
+
+        void decay() noexcept {
+            value_.store(load() >> 1, std::memory_order_relaxed);
+        }
+
+        uint8_t load() const noexcept {
+            return value_.load(std::memory_order_relaxed);
+        }
+
+    private:
+        mutable std::atomic<uint8_t> value_{1};
+    };
+
+    // Счётчик обращений и место вытесненного значения в файле (политика SpillColdValues)
+    struct TierSlot {
+        AccessCounter hits;
+        uint64_t offset = 0;
+        uint32_t length = 0;
+        bool spilled = false; // value пуст, значение в файле
+    };
+
+    struct NoTierSlot {};
+
+    using Tier = std::conditional_t<kTiered, TierSlot, NoTierSlot>;
+
+    // Хеш записи для сводки MerkleDigest: считается при записи значения, поэтому удаление и перезапись не читают
+    // старое значение (в том числе вытесненное в файл)
+    struct DigestSlot {
+        uint64_t hash = 0;
+    };
+
+    struct NoDigestSlot {};
+
+    using EntryDigestSlot = std::conditional_t<kDigest, DigestSlot, NoDigestSlot>;
+
+    struct TtlEntry {
+        Value value; // sizeof(value);
         TimePoint expire_time; // ~8 байт;
+        [[no_unique_address]] Tier tier{};
+        [[no_unique_address]] EntryDigestSlot digest{};
+    };
+
+    struct PlainEntry {
+        Value value;
+        [[no_unique_address]] Tier tier{};
+        [[no_unique_address]] EntryDigestSlot digest{};
     };
 
+    using Entry = std::conditional_t<kHasTtl, TtlEntry, PlainEntry>;
+    static_assert(kHasTtl || kTiered || kDigest || sizeof(Entry) == sizeof(Value));
+
+    // Без TTL часы не читаются: момент времени не используется IsAlive и вырезается компилятором
+    TimePoint Now() const {
+        if constexpr (kHasTtl) {
+            return ttl_.clock->now();
+        } else {
+            return TimePoint{};
+        }
+    }
+
     bool IsExpired(const Entry& entry, TimePoint now) const noexcept {
         return entry.expire_time <= now;
     }
 
     bool IsAlive(const Entry& entry, TimePoint now) const noexcept {
-        return entry.expire_time > now;
+        if constexpr (kHasTtl) {
+            return entry.expire_time > now;
+        } else {
+            return true;
+        }
+    }
+
+    // Момент, начиная с которого запись можно удалять: expire_time плюс смещение ключа в окне выравнивания
+    TimePoint ReclaimTime(const KeyView key, TimePoint expire_time) const {
+        if (ttl_.reclaim_window == Duration::zero() || expire_time == TimePoint::max()) {
+            return expire_time;
+        }
+
+        const auto offset = Duration(index_.hashKey(key) % static_cast<uint64_t>(ttl_.reclaim_window.count()));
+        return expire_time > TimePoint::max() - offset ? TimePoint::max() : expire_time + offset;
+    }
+
+    // Запись протухла и её смещение в окне выравнивания (reclaim_window) уже прошло
+    bool IsReclaimable(const KeyView key, const Entry& entry, TimePoint now) const {
+        return IsExpired(entry, now) && ReclaimTime(key, entry.expire_time) <= now;
+    }
+
+    // Запись появилась в индексе или исчезла из него не через механизм удаления протухших записей
+    void OnInsert(const KeyView key, const Entry& entry) {
+        expiry_.onInsert(key, ReclaimTime(key, entry.expire_time));
+        TrackExpiry(entry.expire_time);
     }
 
-    // Компаратор для сравнения string_view и string, чтобы не создавать временные строки в методах мапы
-    struct TransparentLess {
-        using is_transparent = void;
+    void OnErase(const KeyView key, const Entry& entry) {
+        expiry_.onErase(key, ReclaimTime(key, entry.expire_time));
+        UntrackExpiry(entry.expire_time);
+    }
 
-        bool operator()(const std::string& lhs, const std::string& rhs) const noexcept { 
-            return lhs < rhs; 
+    Duration JitteredTtl(uint32_t ttl) noexcept {
+        const Duration full = std::chrono::seconds(ttl);
+        if (ttl_.jitter_percent == 0) {
+            return full;
         }
 
-        bool operator()(const std::string& lhs, std::string_view rhs) const noexcept {
-            return std::string_view(lhs) < rhs;
+        // full * percent / 100 без переполнения и без потери остатка при грубом тике часов (секунды)
+        const auto ticks = static_cast<uint64_t>(full.count());
+        const uint64_t spread = ticks / 100 * ttl_.jitter_percent + ticks % 100 * ttl_.jitter_percent / 100;
+        if (spread == 0) {
+            return full;
         }
 
-        bool operator()(std::string_view lhs, const std::string& rhs) const noexcept {
-            return lhs < std::string_view(rhs);
+        return full - Duration(NextRandom() % (spread + 1));
+    }
+
+    // Бакет - момент протухания, округлённый вверх до секунды: запись из бакета b протухает в (b - 1, b]
+    static int64_t ExpiryBucket(TimePoint time) noexcept {
+        return std::chrono::ceil<std::chrono::seconds>(time.time_since_epoch()).count();
+    }
+
+    static TimePoint BucketTime(int64_t bucket) noexcept {
+        return TimePoint(std::chrono::duration_cast<Duration>(std::chrono::seconds(bucket)));
+    }
+
+    void TrackExpiry(TimePoint expire_time) {
+        if constexpr (kCollectStats) {
+            if (expire_time == TimePoint::max()) {
+                ++stats_.counters.infinite_entries;
+            } else {
+                ++stats_.expiry_buckets[ExpiryBucket(expire_time)];
+            }
+        }
+    }
+
+    void UntrackExpiry(TimePoint expire_time) {
+        if constexpr (kCollectStats) {
+            if (expire_time == TimePoint::max()) {
+                --stats_.counters.infinite_entries;
+                return;
+            }
+
+            auto it = stats_.expiry_buckets.find(ExpiryBucket(expire_time));
+            if (--it->second == 0) {
+                stats_.expiry_buckets.erase(it);
+            }
+        }
+    }
+
+    void TrackReclaim(TimePoint expire_time, TimePoint now) {
+        if constexpr (kCollectStats) {
+            UntrackExpiry(expire_time);
+            ++stats_.counters.reclaimed;
+            stats_.counters.max_reclaim_lag = std::max<Duration>(stats_.counters.max_reclaim_lag, now - expire_time);
+        }
+    }
+
+    // Фильтр строится минимум на столько ключей, чтобы не перестраивать его на первых вставках
+    static constexpr size_t kMinFilterKeys = 1024;
+
+    // Обращение к ключу для профилировщика горячих ключей; вне выборки - только счётчик потока
+    void TrackAccess(const KeyView key) const {
+        if constexpr (kTrackHotKeys) {
+            if (HotKeyProfiler::shouldSample()) {
+                hot_keys_.sample(key, MixedHash(key));
+            }
+        }
+    }
+
+    // Ключа точно нет в индексе. Без политики фильтра - всегда true, проверка вырезается компилятором
+    bool MayContain(const KeyView key) const {
+        if constexpr (kUseFilter) {
+            return filter_.bloom.mayContain(MixedHash(key));
+        } else {
+            return true;
+        }
+    }
+
+    // Ключ уже вставлен в индекс
+    void FilterAdd(const KeyView key) {
+        if constexpr (kUseFilter) {
+            if (index_.size() > filter_.capacity) {
+                RebuildFilter();
+            } else {
+                filter_.bloom.add(MixedHash(key));
+            }
+        }
+    }
+
+    // count ключей удалены из индекса, их биты остаются в фильтре до перестроения
+    void FilterRemoved(size_t count) {
+        if constexpr (kUseFilter) {
+            filter_.stale += count;
+            if (filter_.stale > filter_.capacity / 2) {
+                RebuildFilter();
+            }
+        }
+    }
+
+    void ReserveFilter(size_t keys) {
+        if constexpr (kUseFilter) {
+            filter_.capacity = std::max(keys, kMinFilterKeys);
+            filter_.bloom = BlockedBloomFilter(filter_.capacity, Policies::filter::kBitsPerKey);
+        }
+    }
+
+    // O(n): фильтр вдвое больше текущего числа ключей, чтобы следующее перестроение было не раньше чем
+    // через n вставок или удалений
+    void RebuildFilter() {
+        if constexpr (kUseFilter) {
+            ReserveFilter(index_.size() * 2);
+            index_.forEach([&](const Key& key, const Entry&) { filter_.bloom.add(MixedHash(key)); });
+            filter_.stale = 0;
+        }
+    }
+
+    // Сводка MerkleDigest: на каждом уровне сумма хешей записей диапазона от ключа-границы до следующей границы
+    using KeyCompare = typename Policies::index::template CompareFor<Key>;
+
+    struct DigestLevel {
+        std::map<Key, uint64_t, KeyCompare> ranges;
+        uint64_t head = 0; // записи до первой границы уровня
+    };
+
+    struct DigestState {
+        std::array<DigestLevel, Policies::digest::kLevels> levels;
+    };
+
+    struct NoDigestState {};
+
+    using Digest = std::conditional_t<kDigest, DigestState, NoDigestState>;
+
+    // Кол-во уровней, на которых ключ - граница диапазона: граница уровня l - граница и всех уровней ниже
+    size_t BoundaryLevels(const KeyView key) const {
+        const uint64_t hash = MixedHash(key);
+        uint64_t span = Policies::digest::kRangeEvery;
+        size_t levels = 0;
+        while (levels < Policies::digest::kLevels && hash % span == 0) {
+            ++levels;
+            span *= Policies::digest::kRangeEvery;
+        }
+        return levels;
+    }
+
+    uint64_t EntryDigest(const KeyView key, const Value& value) const {
+        uint64_t z = MixedHash(key) ^ (ValueDigest(value) * 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // Сумма диапазона уровня, которому принадлежит ключ. O(log r) - r - кол-во диапазонов уровня
+    static uint64_t& RangeDigest(DigestLevel& level, const KeyView key) {
+        auto it = level.ranges.upper_bound(key);
+        return it == level.ranges.begin() ? level.head : std::prev(it)->second;
+    }
+
+    // Значение записи записано: хеш записи добавляется в сумму её диапазона на каждом уровне. Новый ключ-граница
+    // делит диапазоны, в которые попал, снизу вверх: сумма нового диапазона уровня 0 считается проходом по его
+    // записям в индексе (запись уже в индексе), уровня l - проходом по только что обновлённым диапазонам уровня l - 1
+    void DigestAdd(const KeyView key, Entry& entry, bool new_key) {
+        if constexpr (kDigest) {
+            entry.digest.hash = EntryDigest(key, entry.value);
+            const size_t boundary = new_key ? BoundaryLevels(key) : 0;
+
+            // span - RangeEvery^(l + 1): ключ - граница уровня l, если его хеш делится на span
+            uint64_t span = Policies::digest::kRangeEvery;
+            for (size_t l = 0; l < Policies::digest::kLevels; ++l, span *= Policies::digest::kRangeEvery) {
+                DigestLevel& level = digest_.levels[l];
+                if (l >= boundary) {
+                    RangeDigest(level, key) += entry.digest.hash;
+                    continue;
+                }
+
+                auto starts_range = [&](const auto& range_key) { return MixedHash(range_key) % span == 0; };
+                uint64_t sum = 0;
+
+                if (l == 0) {
+                    sum = entry.digest.hash;
+                    bool first = true;
+                    index_.forEachFrom(key, [&](const auto& entry_key, const Entry& range_entry) {
+                        if (std::exchange(first, false)) {
+                            return true;
+                        }
+                        if (starts_range(entry_key)) {
+                            return false;
+                        }
+                        sum += range_entry.digest.hash;
+                        return true;
+                    });
+                } else {
+                    const auto& lower = digest_.levels[l - 1].ranges;
+                    auto it = lower.find(key);
+                    for (sum = it->second, ++it; it != lower.end() && !starts_range(it->first); ++it) {
+                        sum += it->second;
+                    }
+                }
+
+                RangeDigest(level, key) -= sum - entry.digest.hash;
+                level.ranges.emplace(Key(key), sum);
+            }
+        }
+    }
+
+    // Значение записи перезаписывается (leaves == false) или запись покидает индекс. Удалённый ключ-граница
+    // возвращает свои диапазоны предыдущим. Индекс не читается: запись может быть уже извлечена
+    void DigestSubtract(const KeyView key, const Entry& entry, bool leaves) {
+        if constexpr (kDigest) {
+            const size_t boundary = leaves ? BoundaryLevels(key) : 0;
+
+            for (size_t l = 0; l < Policies::digest::kLevels; ++l) {
+                DigestLevel& level = digest_.levels[l];
+                RangeDigest(level, key) -= entry.digest.hash;
+
+                if (l < boundary) {
+                    auto it = level.ranges.find(key);
+                    const uint64_t sum = it->second;
+                    level.ranges.erase(it);
+                    RangeDigest(level, key) += sum;
+                }
+            }
+        }
+    }
+
+    // nullptr - начало индекса
+    using DigestRange = std::pair<const Key*, uint64_t>;
+
+    // Диапазоны уровня с границами из [from, until). from - граница уровня выше (или nullptr), поэтому и этого уровня
+    std::vector<DigestRange> RangesIn(size_t l, const Key* from, const Key* until) const {
+        const DigestLevel& level = digest_.levels[l];
+        const KeyCompare less{};
+        std::vector<DigestRange> ranges;
+
+        auto it = level.ranges.begin();
+        if (from == nullptr) {
+            ranges.emplace_back(nullptr, level.head);
+        } else {
+            it = level.ranges.find(*from);
+        }
+        for (; it != level.ranges.end() && (until == nullptr || less(it->first, *until)); ++it) {
+            ranges.emplace_back(&it->first, it->second);
+        }
+
+        return ranges;
+    }
+
+    // Спуск по дереву сводки: на уровне l диапазоны обоих хранилищ из [from, until) проходятся совместно, блок
+    // от общей границы до следующей общей границы пропускается, если в нём по одному диапазону с равными суммами,
+    // иначе сравнивается на уровне ниже (на нулевом - по записям). Границы - ключи, поэтому граница, которая есть
+    // только в одном хранилище, - ключ, которого нет в другом
+    void DiffRanges(const KVStorage& other, size_t l, const Key* from, const Key* until,
+                    StorageDiff<Key>& result) const
+        requires kDigest
+    {
+        const std::vector<DigestRange> ours = RangesIn(l, from, until);
+        const std::vector<DigestRange> theirs = other.RangesIn(l, from, until);
+        const KeyCompare less{};
+
+        size_t i = 0;
+        size_t j = 0;
+        while (i < ours.size()) {
+            bool same = ours[i].second == theirs[j].second;
+            size_t next_i = i + 1;
+            size_t next_j = j + 1;
+
+            while (next_i < ours.size() || next_j < theirs.size()) {
+                if (next_j == theirs.size() || (next_i < ours.size() && less(*ours[next_i].first, *theirs[next_j].first))) {
+                    ++next_i;
+                } else if (next_i == ours.size() || less(*theirs[next_j].first, *ours[next_i].first)) {
+                    ++next_j;
+                } else {
+                    break;
+                }
+                same = false;
+            }
+
+            if (!same) {
+                const Key* block_until = next_i < ours.size() ? ours[next_i].first : until;
+                if (l == 0) {
+                    DiffEntries(other, ours[i].first, block_until, result);
+                } else {
+                    DiffRanges(other, l - 1, ours[i].first, block_until, result);
+                }
+            }
+
+            i = next_i;
+            j = next_j;
+        }
+    }
+
+    // Записи индекса с ключами из [from, until); nullptr - без границы
+    std::vector<std::pair<KeyView, const Entry*>> EntriesInRange(const Key* from, const Key* until) const {
+        std::vector<std::pair<KeyView, const Entry*>> entries;
+        const KeyCompare less{};
+
+        auto visit = [&](const auto& key, const Entry& entry) {
+            if (until != nullptr && !less(key, *until)) {
+                return false;
+            }
+            entries.emplace_back(key, &entry);
+            return true;
+        };
+
+        if (from == nullptr) {
+            index_.forEachWhile(visit);
+        } else {
+            index_.forEachFrom(*from, visit);
+        }
+
+        return entries;
+    }
+
+    // Сравнивает записи обоих индексов с ключами из [from, until) совместным проходом по уже упорядоченным
+    // последовательностям. O(k)
+    void DiffEntries(const KVStorage& other, const Key* from, const Key* until, StorageDiff<Key>& result) const {
+        const auto ours = EntriesInRange(from, until);
+        const auto theirs = other.EntriesInRange(from, until);
+        const KeyCompare less{};
+
+        size_t i = 0;
+        size_t j = 0;
+        while (i < ours.size() || j < theirs.size()) {
+            if (j == theirs.size() || (i < ours.size() && less(ours[i].first, theirs[j].first))) {
+                result.removed.emplace_back(ours[i++].first);
+            } else if (i == ours.size() || less(theirs[j].first, ours[i].first)) {
+                result.added.emplace_back(theirs[j++].first);
+            } else {
+                if (!SameValue(*ours[i].second, other, *theirs[j].second)) {
+                    result.changed.emplace_back(ours[i].first);
+                }
+                ++i;
+                ++j;
+            }
+        }
+    }
+
+    // Значения записи этого хранилища и записи other равны. Обращение не учитывается (в отличие от ReadValue),
+    // вытесненные значения читаются из файлов
+    bool SameValue(const Entry& entry, const KVStorage& other, const Entry& other_entry) const {
+        if constexpr (kTiered) {
+            if (entry.tier.spilled || other_entry.tier.spilled) {
+                const Value value = entry.tier.spilled ? LoadSpilled(entry.tier) : entry.value;
+                const Value other_value = other_entry.tier.spilled ? other.LoadSpilled(other_entry.tier)
+                                                                   : other_entry.value;
+                return value == other_value;
+            }
+        }
+        return entry.value == other_entry.value;
+    }
+
+    // Хеш индекса дополнительно перемешивается финализатором splitmix64: std::hash для целых - тождественная
+    // функция, а фильтру и профилировщику горячих ключей нужны случайные старшие и младшие биты
+    uint64_t MixedHash(const KeyView key) const {
+        uint64_t z = index_.hashKey(key);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // Загрузка ключа, выполняющаяся в одном из потоков: остальные промахи по ключу ждут её результата
+    using PendingLoad = std::shared_future<Value>;
+    using PendingLoads = std::map<Key, PendingLoad, typename Policies::index::template CompareFor<Key>>;
+
+    template <typename Loader, typename Store>
+    Value GetOrLoad(const KeyView key, Loader& loader, Store&& store) {
+        if (auto value = get(key)) {
+            return std::move(*value);
         }
+
+        std::promise<Value> promise;
+        typename PendingLoads::iterator pending;
+        {
+            [[maybe_unused]] auto guard = loads_lock_.exclusive();
+
+            auto it = loads_.find(key);
+            if (it != loads_.end()) {
+                PendingLoad load = it->second;
+                guard = {};
+                return load.get();
+            }
+
+            pending = loads_.emplace(Key(key), promise.get_future().share()).first;
+        }
+
+        // Записи не было при первой проверке, но предыдущая загрузка могла завершиться до регистрации этой
+        std::optional<Value> value = get(key);
+
+        try {
+            if (!value) {
+                value.emplace(std::invoke(loader, key));
+                store(*value);
+            }
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+            FinishLoad(pending);
+            throw;
+        }
+
+        // Загрузка снимается после set: следующие промахи уже находят запись в хранилище
+        FinishLoad(pending);
+        promise.set_value(*value);
+        return std::move(*value);
+    }
+
+    void FinishLoad(typename PendingLoads::iterator pending) {
+        [[maybe_unused]] auto guard = loads_lock_.exclusive();
+        loads_.erase(pending);
+    }
+
+    // Индекс опустел (clear, mergeFrom в другое хранилище): сбрасывает состояние, посчитанное по его записям.
+    // Файл вытеснения остаётся, всё его содержимое - мусор
+    void OnIndexEmptied() {
+        if constexpr (kCollectStats) {
+            stats_.expiry_buckets.clear();
+            stats_.counters.infinite_entries = 0;
+        }
+        if constexpr (kUseFilter) {
+            ReserveFilter(kMinFilterKeys);
+            filter_.stale = 0;
+        }
+        if constexpr (kTiered) {
+            tier_.spilled_values = 0;
+            tier_.garbage_bytes = tier_.file.size();
+        }
+        if constexpr (kDigest) {
+            digest_ = {};
+        }
+    }
+
+    // Запись source из другого хранилища заменяет запись target при слиянии с политикой conflict
+    static bool Replaces(const Entry& source, const Entry& target, const MergeConflict conflict) noexcept {
+        switch (conflict) {
+            case MergeConflict::kSourceWins:
+                return true;
+            case MergeConflict::kTargetWins:
+                return false;
+            case MergeConflict::kNewestExpiry:
+                if constexpr (kHasTtl) {
+                    return source.expire_time > target.expire_time;
+                } else {
+                    return false;
+                }
+        }
+        return false;
+    }
+
+    // Запись переходит из этого хранилища в другое: вытесненное значение читается из файла этого хранилища
+    void Unspill(Entry& entry) const {
+        if constexpr (kTiered) {
+            if (entry.tier.spilled) {
+                entry.value = LoadSpilled(entry.tier);
+                entry.tier.spilled = false;
+            }
+        }
+    }
+
+    // Пустой файл вытеснения для clear; без SpillColdValues - пустая заглушка
+    auto NewSpillFile() const {
+        if constexpr (kTiered) {
+            return SpillFile(tier_.directory);
+        } else {
+            return NoTierSlot{};
+        }
+    }
+
+    // Вытесненные значения копятся в буфере и пишутся в файл одним вызовом на kSpillBatchBytes
+    static constexpr size_t kSpillBatchBytes = 1 << 20;
+    // Файл не переписывается, пока в нём меньше kMinCompactBytes неиспользуемых байт
+    static constexpr size_t kMinCompactBytes = 1 << 20;
+
+    // Копия значения для чтения. С SpillColdValues учитывает обращение и читает вытесненное значение из файла
+    Value ReadValue(const Entry& entry) const {
+        if constexpr (kTiered) {
+            entry.tier.hits.touch();
+            if (entry.tier.spilled) {
+                return LoadSpilled(entry.tier);
+            }
+        }
+        return entry.value;
+    }
+
+    // Значение записи, извлечённой из индекса
+    Value TakeValue(Entry& entry) {
+        if constexpr (kTiered) {
+            if (entry.tier.spilled) {
+                Value value = LoadSpilled(entry.tier);
+                ReleaseSpilled(entry);
+                return value;
+            }
+        }
+        return std::move(entry.value);
+    }
+
+    // Значение записи в файле больше не нужно (запись удалена, перезаписана или значение вернулось в память)
+    void ReleaseSpilled(Entry& entry) noexcept {
+        if constexpr (kTiered) {
+            if (entry.tier.spilled) {
+                entry.tier.spilled = false;
+                tier_.garbage_bytes += entry.tier.length;
+                --tier_.spilled_values;
+            }
+        }
+    }
+
+    // Байты значения, которые пишутся в файл: содержимое строки или представление тривиально копируемого объекта
+    static std::string_view ValueBytes(const Value& value) noexcept {
+        if constexpr (std::same_as<Value, std::string>) {
+            return value;
+        } else {
+            return {reinterpret_cast<const char*>(&value), sizeof(Value)};
+        }
+    }
+
+    Value LoadSpilled(const TierSlot& tier) const {
+        Value value{};
+        if constexpr (std::same_as<Value, std::string>) {
+            value.resize(tier.length);
+            tier_.file.read(tier.offset, value.data(), tier.length);
+        } else {
+            tier_.file.read(tier.offset, &value, sizeof(Value));
+        }
+        return value;
+    }
+
+    // Записи pending помечаются вытесненными, только когда их значения уже в файле: при ошибке записи
+    // значения остаются в памяти
+    void FlushSpilled(std::string& buffer, std::vector<Entry*>& pending) {
+        if (pending.empty()) {
+            return;
+        }
+
+        tier_.file.append(buffer.data(), buffer.size());
+        for (Entry* entry : pending) {
+            entry->tier.spilled = true;
+            // Перемещение из строки забирает её буфер: память значения освобождается сразу
+            [[maybe_unused]] Value released = std::exchange(entry->value, Value{});
+        }
+        tier_.spilled_values += pending.size();
+
+        buffer.clear();
+        pending.clear();
+    }
+
+    // Переписывает живые вытесненные значения в новый файл. O(s) - s - суммарный размер вытесненных значений
+    void CompactSpillFile() {
+        SpillFile compacted(tier_.directory);
+        std::vector<std::pair<TierSlot*, uint64_t /* offset */>> moved;
+        std::string buffer;
+
+        auto flush = [&] {
+            compacted.append(buffer.data(), buffer.size());
+            buffer.clear();
+        };
+
+        index_.forEach([&](const Key&, Entry& entry) {
+            if (!entry.tier.spilled) {
+                return;
+            }
+
+            const size_t start = buffer.size();
+            buffer.resize(start + entry.tier.length);
+            tier_.file.read(entry.tier.offset, buffer.data() + start, entry.tier.length);
+            moved.emplace_back(&entry.tier, compacted.size() + start);
+
+            if (buffer.size() >= kSpillBatchBytes) {
+                flush();
+            }
+        });
+        flush();
+
+        for (auto [tier, offset] : moved) {
+            tier->offset = offset;
+        }
+        tier_.file = std::move(compacted);
+        tier_.garbage_bytes = 0;
+    }
+
+    // splitmix64: быстрый генератор без состояния в куче, для разброса TTL криптостойкость не нужна
+    uint64_t NextRandom() noexcept {
+        uint64_t z = (ttl_.rng_state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    std::optional<Duration> RemainingTtl(const Entry& entry, TimePoint now) const noexcept {
+        if (entry.expire_time == TimePoint::max()) {
+            return std::nullopt;
+        }
+
+        return entry.expire_time - now;
+    }
+
+    struct StatsState {
+        ExpiryStats counters;
+        // Кол-во записей с конечным TTL по секунде протухания (см. ExpiryBucket)
+        std::map<int64_t /* bucket */, uint64_t /* count */> expiry_buckets;
+    };
+
+    struct NoStatsState {};
+
+    // Часы, слушатель протухших записей, разброс TTL и окно выравнивания удаления: хранилищу без TTL не нужны
+    struct TtlState {
+        TtlState(Clock& storage_clock, const ExpiryOptions& options)
+            : clock(&storage_clock),
+              jitter_percent(std::min<uint32_t>(options.ttl_jitter_percent, 100)),
+              reclaim_window(std::chrono::duration_cast<Duration>(options.reclaim_window)),
+              rng_state(options.jitter_seed) {
+        }
+
+        Clock* clock;
+        Listener* listener = nullptr;
+        uint32_t jitter_percent;
+        Duration reclaim_window;
+        uint64_t rng_state;
+    };
+
+    struct NoTtlState {};
+
+    struct FilterState {
+        BlockedBloomFilter bloom;
+        size_t capacity = 0; // кол-во ключей, под которое построен фильтр
+        size_t stale = 0;    // удалённые с последнего перестроения ключи, чьи биты остались в фильтре
+    };
+
+    struct NoFilterState {};
+
+    struct TierState {
+        explicit TierState(const TieringOptions& options) : directory(options.spill_directory), file(directory) {
+        }
+
+        std::string directory;
+        SpillFile file;
+        uint64_t spilled_values = 0;
+        uint64_t garbage_bytes = 0;
+    };
+
+    struct NoTierState {
+        explicit NoTierState(const TieringOptions&) noexcept {
+        }
+    };
+
+    using HotKeyProfiler = typename Policies::hot_keys::template Tracker<Key>;
+    using Disposer = typename Policies::disposal::template Disposer<Value>;
+
+    using Index = typename Policies::index::template type<Key, Entry>;
+    using ExpiryEngine = typename Policies::expiry::template Engine<KeyView, TimePoint>;
+
+    // Структуры, отданные clear на разрушение. Механизм удаления протухших объявлен после индекса и разрушается
+    // первым: он может хранить string_view на ключи в узлах индекса
+    struct Retired {
+        Index index;
+        ExpiryEngine expiry;
+        [[no_unique_address]] Digest digest;
     };
 
-    using StorageIterator = std::map<std::string, Entry>::iterator;
+    // Записей, начиная с которых clear разрушает старые структуры в фоновом потоке: меньшие разрушаются
+    // быстрее запуска потока
+    static constexpr size_t kMinBackgroundClear = 4096;
+
+    [[no_unique_address]] std::conditional_t<kHasTtl, TtlState, NoTtlState> ttl_;
+
+    [[no_unique_address]] typename Policies::lock lock_;
+    [[no_unique_address]] ExpiryEngine expiry_;
+
+    [[no_unique_address]] std::conditional_t<kCollectStats, StatsState, NoStatsState> stats_;
+    [[no_unique_address]] std::conditional_t<kUseFilter, FilterState, NoFilterState> filter_;
+    [[no_unique_address]] std::conditional_t<kTiered, TierState, NoTierState> tier_;
+    // Изменяется из get: у профилировщика своя синхронизация
+    [[no_unique_address]] mutable HotKeyProfiler hot_keys_;
+    // Очередь освобождения больших значений при перезаписи и удалении (политика DeferFreeLargeValues)
+    [[no_unique_address]] Disposer disposer_;
+    // Суммы хешей диапазонов индекса для diff (политика MerkleDigest)
+    [[no_unique_address]] Digest digest_;
 
-    Clock& clock_;
+    // Загрузки getOrLoad в процессе, со своей блокировкой: loader выполняется без блокировки хранилища
+    [[no_unique_address]] typename Policies::lock loads_lock_;
+    PendingLoads loads_;
 
-    // Использую map, так как читающих запросов 95% и сортировать каждый раз при вызове getManySorted повышает время
-    // отклика системы
-    std::map<std::string /* key */, Entry /* value, ttl*/, TransparentLess> storage_;
-    // Дополнительная хеш-таблица для доступа к элементам storage_ за O(1)*
-    // Требуется примерно 24 байта на запись: 16 байт под string_view (указатель + длина)
+    // Упорядоченный индекс с доступом по ключу (MapIndex или RadixIndex, см. политику индекса)
+    Index index_;
 
-    std::unordered_map<std::string, StorageIterator> key_to_storage_iter_;
+    // Фоновое разрушение структур после последнего clear. Деструктор future из std::async ждёт его завершения,
+    // поэтому хранилище не разрушается раньше
+    std::future<void> retired_;
 };
\ No newline at end of file
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define KVSTORAGE_HAS_NUMA 1
+#else
+#define KVSTORAGE_HAS_NUMA 0
+#endif
+
+// Топология NUMA и привязка потоков и памяти к узлам без libnuma: узлы и их процессоры читаются из sysfs,
+// политика памяти задаётся системными вызовами set_mempolicy и mbind. На системах без NUMA (и не на Linux)
+// узел один, а привязка ничего не делает и возвращает false.
+// Привязка памяти может быть запрещена в контейнере (seccomp): тогда методы возвращают false, а память
+// выделяется по политике по умолчанию - на узле потока, впервые её коснувшегося.
+class Numa {
+public:
+    // Кол-во узлов NUMA, не меньше 1
+    static size_t nodeCount() {
+        static const size_t count = DetectNodeCount();
+        return count;
+    }
+
+    // Процессоры узла node
+    static std::vector<int> cpusOfNode(size_t node) {
+#if KVSTORAGE_HAS_NUMA
+        std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (cpulist >> list) {
+            return ParseCpuList(list);
+        }
+#endif
+        // Без sysfs все процессоры считаются принадлежащими единственному узлу
+        std::vector<int> cpus;
+        if (node == 0) {
+#if KVSTORAGE_HAS_NUMA
+            const long count = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+            const long count = 1;
+#endif
+            for (long cpu = 0; cpu < count; ++cpu) {
+                cpus.push_back(static_cast<int>(cpu));
+            }
+        }
+        return cpus;
+    }
+
+    // Узел, на котором сейчас выполняется поток
+    static size_t currentNode() noexcept {
+#if KVSTORAGE_HAS_NUMA
+        unsigned cpu = 0;
+        unsigned node = 0;
+        if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0 && node < nodeCount()) {
+            return node;
+        }
+#endif
+        return 0;
+    }
+
+    // Привязывает текущий поток к процессорам узла node и делает node предпочтительным узлом для его
+    // новых выделений памяти (MPOL_PREFERRED). true - обе привязки удались
+    static bool bindThreadToNode(size_t node) {
+#if KVSTORAGE_HAS_NUMA
+        const std::vector<int> cpus = cpusOfNode(node);
+        if (cpus.empty()) {
+            return false;
+        }
+
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        for (const int cpu : cpus) {
+            CPU_SET(cpu, &cpu_set);
+        }
+        const bool affinity = sched_setaffinity(0, sizeof(cpu_set), &cpu_set) == 0;
+
+        const NodeMask mask = MakeMask(node);
+        const bool policy = syscall(SYS_set_mempolicy, kPreferred, mask.data(), kMaxNodes) == 0;
+
+        return affinity && policy;
+#else
+        (void)node;
+        return false;
+#endif
+    }
+
+    // Размещает страницы [addr, addr + len) на узле node (MPOL_BIND, уже выделенные страницы переносятся).
+    // addr должен быть выровнен по странице
+    static bool bindMemory(void* addr, size_t len, size_t node) noexcept {
+#if KVSTORAGE_HAS_NUMA
+        const NodeMask mask = MakeMask(node);
+        return syscall(SYS_mbind, addr, len, kBind, mask.data(), kMaxNodes, kMoveFlag) == 0;
+#else
+        (void)addr;
+        (void)len;
+        (void)node;
+        return false;
+#endif
+    }
+
+    static size_t pageSize() noexcept {
+#if KVSTORAGE_HAS_NUMA
+        return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+        return 4096;
+#endif
+    }
+
+private:
+    // Значения из <linux/mempolicy.h>: заголовок есть не во всех окружениях сборки
+    static constexpr int kPreferred = 1;      // MPOL_PREFERRED
+    static constexpr int kBind = 2;           // MPOL_BIND
+    static constexpr unsigned kMoveFlag = 2;  // MPOL_MF_MOVE
+    static constexpr unsigned long kMaxNodes = 1024;
+
+    using NodeMask = std::vector<unsigned long>;
+
+    static NodeMask MakeMask(size_t node) {
+        constexpr size_t kBitsPerWord = sizeof(unsigned long) * 8;
+        NodeMask mask(kMaxNodes / kBitsPerWord, 0);
+        mask[node / kBitsPerWord] |= 1UL << (node % kBitsPerWord);
+        return mask;
+    }
+
+    // "0-3,8-11" -> {0, 1, 2, 3, 8, 9, 10, 11}
+    static std::vector<int> ParseCpuList(const std::string& list) {
+        std::vector<int> cpus;
+        size_t pos = 0;
+
+        while (pos < list.size()) {
+            size_t end = list.find(',', pos);
+            if (end == std::string::npos) {
+                end = list.size();
+            }
+
+            const std::string range = list.substr(pos, end - pos);
+            const size_t dash = range.find('-');
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+
+            pos = end + 1;
+        }
+
+        return cpus;
+    }
+
+    static size_t DetectNodeCount() {
+        size_t count = 0;
+#if KVSTORAGE_HAS_NUMA
+        while (count < kMaxNodes && std::ifstream("/sys/devices/system/node/node" + std::to_string(count) + "/cpulist")) {
+            ++count;
+        }
+#endif
+        return count == 0 ? 1 : count;
+    }
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define KVSTORAGE_HAS_AVX2_DISPATCH 1
+#else
+#define KVSTORAGE_HAS_AVX2_DISPATCH 0
+#endif
+
+// Поиск протухших моментов в плотном массиве: блоками по 8 моментов, каждый блок даёт 8-битную маску.
+// С AVX2 блок - две инструкции сравнения по 4 64-битных момента, без AVX2 - скалярное сравнение без ветвлений.
+// AVX2-версия собирается атрибутом target и выбирается во время выполнения, поэтому флаги сборки не нужны.
+class ExpiredScanner {
+public:
+    // Записывает в positions до max_count позиций i, для которых ticks[i] <= now, по возрастанию. O(n / 8)
+    static void find(const int64_t* ticks, const size_t count, const int64_t now, const size_t max_count,
+                     std::vector<uint32_t>& positions) {
+        size_t i = 0;
+
+#if KVSTORAGE_HAS_AVX2_DISPATCH
+        if (HasAvx2()) {
+            for (; i + 8 <= count && positions.size() < max_count; i += 8) {
+                AppendPositions(Mask8Avx2(ticks + i, now), i, max_count, positions);
+            }
+        }
+#endif
+
+        for (; i + 8 <= count && positions.size() < max_count; i += 8) {
+            AppendPositions(Mask8Scalar(ticks + i, now), i, max_count, positions);
+        }
+
+        for (; i < count && positions.size() < max_count; ++i) {
+            if (ticks[i] <= now) {
+                positions.push_back(static_cast<uint32_t>(i));
+            }
+        }
+    }
+
+    static bool usesAvx2() noexcept {
+#if KVSTORAGE_HAS_AVX2_DISPATCH
+        return HasAvx2();
+#else
+        return false;
+#endif
+    }
+
+private:
+    static void AppendPositions(uint32_t mask, size_t base, size_t max_count, std::vector<uint32_t>& positions) {
+        while (mask != 0 && positions.size() < max_count) {
+            positions.push_back(static_cast<uint32_t>(base + std::countr_zero(mask)));
+            mask &= mask - 1;
+        }
+    }
+
+    static uint32_t Mask8Scalar(const int64_t* ticks, int64_t now) noexcept {
+        uint32_t mask = 0;
+        for (uint32_t j = 0; j < 8; ++j) {
+            mask |= static_cast<uint32_t>(ticks[j] <= now) << j;
+        }
+        return mask;
+    }
+
+#if KVSTORAGE_HAS_AVX2_DISPATCH
+    static bool HasAvx2() noexcept {
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        return has_avx2;
+    }
+
+    // ticks <= now эквивалентно !(ticks > now): в AVX2 есть только сравнение "больше" для 64-битных целых
+    __attribute__((target("avx2"))) static uint32_t Mask8Avx2(const int64_t* ticks, int64_t now) noexcept {
+        const __m256i now_vec = _mm256_set1_epi64x(now);
+        const __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ticks));
+        const __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ticks + 4));
+
+        const __m256d low_later = _mm256_castsi256_pd(_mm256_cmpgt_epi64(low, now_vec));
+        const __m256d high_later = _mm256_castsi256_pd(_mm256_cmpgt_epi64(high, now_vec));
+        const auto low_mask = static_cast<uint32_t>(_mm256_movemask_pd(low_later));
+        const auto high_mask = static_cast<uint32_t>(_mm256_movemask_pd(high_later));
+
+        return ~(low_mask | high_mask << 4) & 0xFF;
+    }
+#endif
+};
+
+// Механизм удаления протухших записей на плотном массиве моментов удаления (см. KVPolicies, kv_policies.hpp).
+// Моменты удаления записей с конечным TTL лежат подряд в одном векторе, ключи - в параллельном векторе,
+// позиция ключа - в хеш-таблице. Поиск протухших - последовательный проход по массиву без обхода узлов
+// индекса и без вызова pred: O(n / 8) сравнений блоками плюс O(1)* на удалённую запись.
+// Память: 8 байт момента, KeyView и узел хеш-таблицы на запись с конечным TTL. Записи отдаются не по порядку.
+struct PackedExpiry {
+    static constexpr bool kByReclaimTime = true;
+
+    template <typename KeyView, typename TimePoint>
+    class Engine {
+        static_assert(std::is_integral_v<typename TimePoint::rep> && sizeof(typename TimePoint::rep) <= sizeof(int64_t),
+                      "PackedExpiry needs a clock with an integral tick count of at most 64 bits");
+
+    public:
+        void onInsert(const KeyView key, TimePoint reclaim_at) {
+            if (reclaim_at == TimePoint::max()) {
+                return;
+            }
+
+            positions_.emplace(key, static_cast<uint32_t>(keys_.size()));
+            keys_.push_back(key);
+            reclaim_ticks_.push_back(static_cast<int64_t>(reclaim_at.time_since_epoch().count()));
+        }
+
+        void onErase(const KeyView key, TimePoint reclaim_at) {
+            if (reclaim_at == TimePoint::max()) {
+                return;
+            }
+
+            auto it = positions_.find(key);
+            const uint32_t pos = it->second;
+            positions_.erase(it);
+            RemoveAt(pos);
+        }
+
+        template <typename Index, typename Pred, typename Sink>
+        size_t reclaim(Index& index, TimePoint now, const size_t max_count, Pred&&, Sink&& sink) {
+            positions_buffer_.clear();
+            ExpiredScanner::find(reclaim_ticks_.data(), reclaim_ticks_.size(),
+                                 static_cast<int64_t>(now.time_since_epoch().count()), max_count, positions_buffer_);
+
+            // С конца: удаление переносит на место записи последний элемент массива, а все найденные позиции
+            // правее текущей к этому моменту уже обработаны
+            for (auto it = positions_buffer_.rbegin(); it != positions_buffer_.rend(); ++it) {
+                // Для строк KeyView ссылается на ключ в узле индекса: поиск завершается до того, как ключ
+                // перемещается из узла
+                const KeyView key = keys_[*it];
+                positions_.erase(key);
+                RemoveAt(*it);
+
+                auto extracted = index.extract(key);
+                sink(std::move(extracted->first), std::move(extracted->second));
+            }
+
+            return positions_buffer_.size();
+        }
+
+    private:
+        // O(1): на место удалённого элемента переносится последний
+        void RemoveAt(const uint32_t pos) {
+            const uint32_t last = static_cast<uint32_t>(keys_.size() - 1);
+            if (pos != last) {
+                keys_[pos] = keys_[last];
+                reclaim_ticks_[pos] = reclaim_ticks_[last];
+                positions_[keys_[pos]] = pos;
+            }
+
+            keys_.pop_back();
+            reclaim_ticks_.pop_back();
+        }
+
+        std::vector<int64_t> reclaim_ticks_;
+        std::vector<KeyView> keys_;
+        std::unordered_map<KeyView, uint32_t> positions_;
+        // Переиспользуемый буфер найденных позиций, чтобы не выделять память на каждый вызов reclaim
+        std::vector<uint32_t> positions_buffer_;
+    };
+};
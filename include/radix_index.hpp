@@ -0,0 +1,544 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "kv_index.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define KVSTORAGE_HAS_SSE2 1
+#else
+#define KVSTORAGE_HAS_SSE2 0
+#endif
+
+// Поиск байта среди count отсортированных байтов узла на 16 потомков (буфер bytes - ровно 16 байт):
+// equalMask - маска позиций i < count, где bytes[i] == byte, lowerBound - кол-во байтов меньше byte
+struct ScalarByteSearch {
+    static uint32_t equalMask(const uint8_t* bytes, uint16_t count, uint8_t byte) noexcept {
+        uint32_t mask = 0;
+        for (uint16_t i = 0; i < count; ++i) {
+            mask |= static_cast<uint32_t>(bytes[i] == byte) << i;
+        }
+        return mask;
+    }
+
+    static uint16_t lowerBound(const uint8_t* bytes, uint16_t count, uint8_t byte) noexcept {
+        uint16_t pos = 0;
+        while (pos < count && bytes[pos] < byte) {
+            ++pos;
+        }
+        return pos;
+    }
+};
+
+#if KVSTORAGE_HAS_SSE2
+// Все 16 байтов сравниваются с искомым одной инструкцией
+struct Sse2ByteSearch {
+    static uint32_t equalMask(const uint8_t* bytes, uint16_t count, uint8_t byte) noexcept {
+        const __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes));
+        const __m128i equal = _mm_cmpeq_epi8(raw, _mm_set1_epi8(static_cast<char>(byte)));
+        return static_cast<uint32_t>(_mm_movemask_epi8(equal)) & ((uint32_t{1} << count) - 1);
+    }
+
+    static uint16_t lowerBound(const uint8_t* bytes, uint16_t count, uint8_t byte) noexcept {
+        // В SSE2 есть только знаковое сравнение байтов: смещение на 0x80 сохраняет беззнаковый порядок
+        const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80));
+        const __m128i raw = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes)), bias);
+        const __m128i target = _mm_xor_si128(_mm_set1_epi8(static_cast<char>(byte)), bias);
+        const auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmplt_epi8(raw, target)));
+        return static_cast<uint16_t>(std::popcount(mask & ((uint32_t{1} << count) - 1)));
+    }
+};
+
+using DefaultByteSearch = Sse2ByteSearch;
+#else
+using DefaultByteSearch = ScalarByteSearch;
+#endif
+
+// Упорядоченный индекс для беззнаковых целых ключей: адаптивное radix-дерево по байтам ключа со сжатием путей
+// (по мотивам ART). Внутренний узел ветвится по одному байту ключа и хранит общий префикс всех ключей поддерева,
+// поэтому цепочек из узлов с единственным потомком нет, а глубина не превышает sizeof(Key) узлов.
+// Узел на 16 потомков растёт до узла на 256 прямо адресуемых потомков. Байты узла на 16 потомков сравниваются
+// с искомым ByteSearch - по умолчанию одной SSE2-инструкцией (скалярный цикл без SSE2): и при поиске по ключу,
+// и при поиске первого потомка не меньше ключа в начале getManySorted.
+//
+// Поиск по ключу - спуск без сравнения строк и без хеширования: O(sizeof(Key)).
+// Обход по возрастанию ключа - обход дерева в глубину, то есть getManySorted идёт в числовом порядке.
+// Реализует тот же интерфейс, что и MapIndex (см. kv_index.hpp).
+template <std::unsigned_integral Key, typename Mapped, typename ByteSearch = DefaultByteSearch>
+class RadixIndex {
+public:
+    using KeyView = Key;
+
+    RadixIndex() = default;
+
+    RadixIndex(RadixIndex&& other) noexcept
+        : root_(std::exchange(other.root_, nullptr)), size_(std::exchange(other.size_, 0)) {
+    }
+
+    RadixIndex& operator=(RadixIndex&& other) noexcept {
+        if (this != &other) {
+            Destroy(root_);
+            root_ = std::exchange(other.root_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+        }
+        return *this;
+    }
+
+    RadixIndex(const RadixIndex&) = delete;
+    RadixIndex& operator=(const RadixIndex&) = delete;
+
+    ~RadixIndex() {
+        Destroy(root_);
+    }
+
+    Mapped* find(const Key key) noexcept {
+        Leaf* leaf = FindLeaf(key);
+        return leaf == nullptr ? nullptr : &leaf->mapped;
+    }
+
+    const Mapped* find(const Key key) const noexcept {
+        const Leaf* leaf = FindLeaf(key);
+        return leaf == nullptr ? nullptr : &leaf->mapped;
+    }
+
+    IndexEntry<Key, Mapped> findEntry(const Key key) noexcept {
+        return {key, find(key)};
+    }
+
+    // O(sizeof(Key)): спуск по дереву и, при расхождении префиксов, один новый внутренний узел
+    EmplaceResult<Key, Mapped> tryEmplace(Key&& key, Mapped&& mapped) {
+        const uint64_t bits = key;
+        Node** slot = &root_;
+
+        while (*slot != nullptr) {
+            Node* node = *slot;
+
+            if (node->kind == Kind::kLeaf) {
+                Leaf* leaf = static_cast<Leaf*>(node);
+                if (leaf->key == bits) {
+                    return {key, &leaf->mapped, false};
+                }
+                return {key, SplitAndInsert(slot, leaf->key, bits, std::move(mapped)), true};
+            }
+
+            Inner* inner = static_cast<Inner*>(node);
+            if ((bits & PrefixMask(inner->shift)) != inner->prefix) {
+                return {key, SplitAndInsert(slot, inner->prefix, bits, std::move(mapped)), true};
+            }
+
+            Node** child = FindChildSlot(inner, ByteAt(bits, inner->shift));
+            if (child == nullptr) {
+                Leaf* leaf = new Leaf(bits, std::move(mapped));
+                AddChild(slot, ByteAt(bits, inner->shift), leaf);
+                ++size_;
+                return {key, &leaf->mapped, true};
+            }
+
+            slot = child;
+        }
+
+        Leaf* leaf = new Leaf(bits, std::move(mapped));
+        *slot = leaf;
+        ++size_;
+        return {key, &leaf->mapped, true};
+    }
+
+    // O(sizeof(Key)). Узел, у которого остался один потомок, заменяется этим потомком
+    std::optional<std::pair<Key, Mapped>> extract(const Key key) {
+        const uint64_t bits = key;
+        Node** parent_slot = nullptr;
+        Node** slot = &root_;
+
+        while (*slot != nullptr && (*slot)->kind != Kind::kLeaf) {
+            Inner* inner = static_cast<Inner*>(*slot);
+            if ((bits & PrefixMask(inner->shift)) != inner->prefix) {
+                return std::nullopt;
+            }
+
+            Node** child = FindChildSlot(inner, ByteAt(bits, inner->shift));
+            if (child == nullptr) {
+                return std::nullopt;
+            }
+
+            parent_slot = slot;
+            slot = child;
+        }
+
+        if (*slot == nullptr || static_cast<Leaf*>(*slot)->key != bits) {
+            return std::nullopt;
+        }
+
+        Leaf* leaf = static_cast<Leaf*>(*slot);
+        if (parent_slot == nullptr) {
+            root_ = nullptr;
+        } else {
+            RemoveChild(parent_slot, ByteAt(bits, static_cast<Inner*>(*parent_slot)->shift));
+        }
+
+        --size_;
+        std::pair<Key, Mapped> result(static_cast<Key>(leaf->key), std::move(leaf->mapped));
+        delete leaf;
+        return result;
+    }
+
+    // O(sizeof(Key) + k): поддеревья целиком меньше key отсекаются по префиксу
+    template <typename F>
+    void forEachFrom(const Key key, F&& fn) const {
+        if (root_ != nullptr) {
+            VisitFrom(root_, key, true, fn);
+        }
+    }
+
+    // O(sizeof(Key) + k)
+    template <typename F>
+    void forEachWhile(F&& fn) const {
+        forEachFrom(Key{0}, fn);
+    }
+
+    // O(n)
+    template <typename F>
+    void forEach(F&& fn) const {
+        forEachFrom(Key{0}, [&](const Key key, const Mapped& mapped) {
+            fn(key, mapped);
+            return true;
+        });
+    }
+
+    // Обход общий с константным: листья принадлежат дереву и сами не константны
+    template <typename F>
+    void forEach(F&& fn) {
+        std::as_const(*this).forEach([&](const Key key, const Mapped& mapped) { fn(key, const_cast<Mapped&>(mapped)); });
+    }
+
+    // Обход по возрастанию ключа собирает подходящие ключи, затем каждый извлекается спуском - O(n + k * sizeof(Key))
+    template <typename Pred, typename Sink>
+    size_t extractIf(const size_t max_count, Pred&& pred, Sink&& sink) {
+        if (max_count == 0) {
+            return 0;
+        }
+
+        std::vector<Key> keys;
+        forEachFrom(Key{0}, [&](const Key key, const Mapped& mapped) {
+            if (pred(key, mapped)) {
+                keys.push_back(key);
+            }
+            return keys.size() < max_count;
+        });
+
+        for (const Key key : keys) {
+            auto extracted = extract(key);
+            sink(std::move(extracted->first), std::move(extracted->second));
+        }
+
+        return keys.size();
+    }
+
+    // Записи other переносятся по возрастанию ключа спуском по дереву; значения перемещаются, а не копируются.
+    // other остаётся пустым. O(m * sizeof(Key)) - m - кол-во записей other
+    template <typename OnInsert, typename OnConflict>
+    void mergeFrom(RadixIndex&& other, OnInsert&& on_insert, OnConflict&& on_conflict) {
+        other.forEach([&](const Key key, Mapped& mapped) {
+            auto [stored_key, slot, inserted] = tryEmplace(Key(key), std::move(mapped));
+            if (inserted) {
+                on_insert(stored_key, *slot);
+            } else {
+                on_conflict(stored_key, *slot, mapped);
+            }
+        });
+
+        other = RadixIndex{};
+    }
+
+    size_t size() const noexcept {
+        return size_;
+    }
+
+    // Финализатор splitmix64: соседние целые ключи дают далёкие друг от друга хеши
+    size_t hashKey(const Key key) const noexcept {
+        uint64_t z = key;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return static_cast<size_t>(z ^ (z >> 31));
+    }
+
+private:
+    enum class Kind : uint8_t { kLeaf, kInner16, kInner256 };
+
+    struct Node {
+        explicit Node(Kind node_kind) noexcept : kind(node_kind) {
+        }
+
+        Kind kind;
+    };
+
+    struct Leaf : Node {
+        Leaf(uint64_t leaf_key, Mapped&& leaf_mapped) : Node(Kind::kLeaf), key(leaf_key), mapped(std::move(leaf_mapped)) {
+        }
+
+        uint64_t key;
+        Mapped mapped;
+    };
+
+    // Ветвится по байту (key >> shift) & 0xFF; prefix - биты ключа выше этого байта, общие для всего поддерева
+    struct Inner : Node {
+        Inner(Kind node_kind, uint8_t node_shift, uint64_t node_prefix) noexcept
+            : Node(node_kind), shift(node_shift), prefix(node_prefix) {
+        }
+
+        uint8_t shift;
+        uint16_t count = 0;
+        uint64_t prefix;
+    };
+
+    // Потомки отсортированы по байту, чтобы обход шёл по возрастанию ключа
+    struct Inner16 : Inner {
+        static constexpr uint16_t kCapacity = 16;
+
+        Inner16(uint8_t node_shift, uint64_t node_prefix) noexcept : Inner(Kind::kInner16, node_shift, node_prefix) {
+        }
+
+        std::array<uint8_t, kCapacity> bytes{};
+        std::array<Node*, kCapacity> children{};
+    };
+
+    struct Inner256 : Inner {
+        // При уменьшении до этого кол-ва потомков узел снова сжимается до Inner16
+        static constexpr uint16_t kShrinkThreshold = 8;
+
+        Inner256(uint8_t node_shift, uint64_t node_prefix) noexcept : Inner(Kind::kInner256, node_shift, node_prefix) {
+        }
+
+        std::array<Node*, 256> children{};
+    };
+
+    static uint8_t ByteAt(uint64_t bits, uint8_t shift) noexcept {
+        return static_cast<uint8_t>(bits >> shift);
+    }
+
+    // Маска битов выше байта ветвления
+    static uint64_t PrefixMask(uint8_t shift) noexcept {
+        return shift + 8 >= 64 ? 0 : ~uint64_t{0} << (shift + 8);
+    }
+
+    Leaf* FindLeaf(uint64_t bits) const noexcept {
+        Node* node = root_;
+
+        while (node != nullptr && node->kind != Kind::kLeaf) {
+            const Inner* inner = static_cast<const Inner*>(node);
+            if ((bits & PrefixMask(inner->shift)) != inner->prefix) {
+                return nullptr;
+            }
+
+            Node** child = FindChildSlot(const_cast<Inner*>(inner), ByteAt(bits, inner->shift));
+            node = child == nullptr ? nullptr : *child;
+        }
+
+        Leaf* leaf = static_cast<Leaf*>(node);
+        return leaf != nullptr && leaf->key == bits ? leaf : nullptr;
+    }
+
+    static Node** FindChildSlot(Inner* inner, uint8_t byte) noexcept {
+        if (inner->kind == Kind::kInner256) {
+            Node** child = &static_cast<Inner256*>(inner)->children[byte];
+            return *child == nullptr ? nullptr : child;
+        }
+
+        Inner16* node = static_cast<Inner16*>(inner);
+        const uint32_t match = EqualMask(node, byte);
+        return match == 0 ? nullptr : &node->children[std::countr_zero(match)];
+    }
+
+    // Маска позиций i < count, где bytes[i] == byte
+    static uint32_t EqualMask(const Inner16* node, uint8_t byte) noexcept {
+        return ByteSearch::equalMask(node->bytes.data(), node->count, byte);
+    }
+
+    // Позиция первого потомка с байтом >= byte: байты отсортированы, поэтому это кол-во байтов меньше byte
+    static uint16_t LowerBound(const Inner16* node, uint8_t byte) noexcept {
+        return ByteSearch::lowerBound(node->bytes.data(), node->count, byte);
+    }
+
+    // Ключи existing_bits (ключ листа или префикс узла *slot) и bits расходятся выше уровня *slot:
+    // новый узел ветвится по старшему различающемуся байту
+    Mapped* SplitAndInsert(Node** slot, uint64_t existing_bits, uint64_t bits, Mapped&& mapped) {
+        const int highest_diff_bit = 63 - std::countl_zero(existing_bits ^ bits);
+        const auto shift = static_cast<uint8_t>(highest_diff_bit / 8 * 8);
+
+        Inner16* inner = new Inner16(shift, bits & PrefixMask(shift));
+        Leaf* leaf = new Leaf(bits, std::move(mapped));
+
+        const uint8_t existing_byte = ByteAt(existing_bits, shift);
+        const uint8_t new_byte = ByteAt(bits, shift);
+        const bool new_first = new_byte < existing_byte;
+
+        inner->bytes[0] = new_first ? new_byte : existing_byte;
+        inner->children[0] = new_first ? static_cast<Node*>(leaf) : *slot;
+        inner->bytes[1] = new_first ? existing_byte : new_byte;
+        inner->children[1] = new_first ? *slot : static_cast<Node*>(leaf);
+        inner->count = 2;
+
+        *slot = inner;
+        ++size_;
+        return &leaf->mapped;
+    }
+
+    static void AddChild(Node** slot, uint8_t byte, Node* child) {
+        Inner* inner = static_cast<Inner*>(*slot);
+
+        if (inner->kind == Kind::kInner16 && inner->count == Inner16::kCapacity) {
+            Inner16* small = static_cast<Inner16*>(inner);
+            Inner256* big = new Inner256(small->shift, small->prefix);
+            for (uint16_t i = 0; i < small->count; ++i) {
+                big->children[small->bytes[i]] = small->children[i];
+            }
+            big->count = small->count;
+            delete small;
+
+            *slot = big;
+            inner = big;
+        }
+
+        if (inner->kind == Kind::kInner256) {
+            static_cast<Inner256*>(inner)->children[byte] = child;
+            ++inner->count;
+            return;
+        }
+
+        Inner16* node = static_cast<Inner16*>(inner);
+        const uint16_t pos = LowerBound(node, byte);
+        for (uint16_t i = node->count; i > pos; --i) {
+            node->bytes[i] = node->bytes[i - 1];
+            node->children[i] = node->children[i - 1];
+        }
+        node->bytes[pos] = byte;
+        node->children[pos] = child;
+        ++node->count;
+    }
+
+    static void RemoveChild(Node** slot, uint8_t byte) {
+        Inner* inner = static_cast<Inner*>(*slot);
+
+        if (inner->kind == Kind::kInner256) {
+            Inner256* big = static_cast<Inner256*>(inner);
+            big->children[byte] = nullptr;
+            --big->count;
+
+            if (big->count <= Inner256::kShrinkThreshold) {
+                Inner16* small = new Inner16(big->shift, big->prefix);
+                for (int b = 0; b < 256; ++b) {
+                    if (big->children[b] != nullptr) {
+                        small->bytes[small->count] = static_cast<uint8_t>(b);
+                        small->children[small->count] = big->children[b];
+                        ++small->count;
+                    }
+                }
+                delete big;
+
+                *slot = small;
+            }
+            return;
+        }
+
+        Inner16* node = static_cast<Inner16*>(inner);
+        const auto pos = static_cast<uint16_t>(std::countr_zero(EqualMask(node, byte)));
+        for (uint16_t i = pos + 1; i < node->count; ++i) {
+            node->bytes[i - 1] = node->bytes[i];
+            node->children[i - 1] = node->children[i];
+        }
+        --node->count;
+
+        // Префикс потомка хранит все биты выше его уровня, поэтому узел с одним потомком просто заменяется им
+        if (node->count == 1) {
+            *slot = node->children[0];
+            delete node;
+        }
+    }
+
+    // bounded - в поддереве могут быть ключи меньше key, и их нужно пропустить
+    template <typename F>
+    static bool VisitFrom(const Node* node, const Key key, bool bounded, F& fn) {
+        if (node->kind == Kind::kLeaf) {
+            const Leaf* leaf = static_cast<const Leaf*>(node);
+            if (bounded && leaf->key < key) {
+                return true;
+            }
+            return fn(static_cast<Key>(leaf->key), leaf->mapped);
+        }
+
+        const Inner* inner = static_cast<const Inner*>(node);
+        uint8_t first_byte = 0;
+
+        if (bounded) {
+            const uint64_t key_prefix = key & PrefixMask(inner->shift);
+            if (key_prefix > inner->prefix) {
+                return true;
+            }
+            if (key_prefix < inner->prefix) {
+                bounded = false;
+            } else {
+                first_byte = ByteAt(key, inner->shift);
+            }
+        }
+
+        auto visit_child = [&](uint8_t byte, const Node* child) {
+            return VisitFrom(child, key, bounded && byte == first_byte, fn);
+        };
+
+        if (inner->kind == Kind::kInner256) {
+            const Inner256* big = static_cast<const Inner256*>(inner);
+            for (int b = first_byte; b < 256; ++b) {
+                if (big->children[b] != nullptr && !visit_child(static_cast<uint8_t>(b), big->children[b])) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        const Inner16* small = static_cast<const Inner16*>(inner);
+        for (uint16_t i = LowerBound(small, first_byte); i < small->count; ++i) {
+            if (!visit_child(small->bytes[i], small->children[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void Destroy(Node* node) noexcept {
+        if (node == nullptr) {
+            return;
+        }
+
+        switch (node->kind) {
+            case Kind::kLeaf:
+                delete static_cast<Leaf*>(node);
+                return;
+            case Kind::kInner16: {
+                Inner16* small = static_cast<Inner16*>(node);
+                for (uint16_t i = 0; i < small->count; ++i) {
+                    Destroy(small->children[i]);
+                }
+                delete small;
+                return;
+            }
+            case Kind::kInner256: {
+                Inner256* big = static_cast<Inner256*>(node);
+                for (Node* child : big->children) {
+                    Destroy(child);
+                }
+                delete big;
+                return;
+            }
+        }
+    }
+
+    Node* root_ = nullptr;
+    size_t size_ = 0;
+};
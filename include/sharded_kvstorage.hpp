@@ -0,0 +1,371 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <span>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "kvstorage.hpp"
+#include "numa.hpp"
+
+struct ShardingOptions {
+    // Кол-во шардов на узел NUMA: больше шардов - меньше конкуренции за блокировку шарда
+    size_t shards_per_node = 4;
+    // false - один логический узел: шарды и потоки без привязки к узлам
+    bool numa_aware = true;
+    // Потоки узла, выполняющие запросы execute к шардам этого узла
+    size_t workers_per_node = 1;
+};
+
+// Потоки одного узла NUMA с общей очередью задач. Потоки привязаны к процессорам узла, а их выделения памяти -
+// к самому узлу, поэтому всё, что создаёт или вставляет задача, размещается в локальной памяти узла.
+class NodeWorkers {
+public:
+    NodeWorkers(size_t node, size_t workers, bool bind) {
+        for (size_t i = 0; i < std::max<size_t>(workers, 1); ++i) {
+            threads_.emplace_back([this, node, bind] {
+                if (bind) {
+                    Numa::bindThreadToNode(node);
+                }
+                Current() = this;
+                Run();
+            });
+        }
+    }
+
+    NodeWorkers(const NodeWorkers&) = delete;
+    NodeWorkers& operator=(const NodeWorkers&) = delete;
+
+    ~NodeWorkers() {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    template <typename F>
+    auto submit(F&& fn) -> std::future<std::invoke_result_t<F>> {
+        auto task = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::forward<F>(fn));
+        auto result = task->get_future();
+
+        {
+            std::lock_guard lock(mutex_);
+            tasks_.emplace_back([task] { (*task)(); });
+        }
+        cv_.notify_one();
+
+        return result;
+    }
+
+    // Вызывающий поток - один из потоков этого узла
+    bool runsOnThisNode() const noexcept {
+        return Current() == this;
+    }
+
+private:
+    static const NodeWorkers*& Current() noexcept {
+        thread_local const NodeWorkers* current = nullptr;
+        return current;
+    }
+
+    void Run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock lock(mutex_);
+                cv_.wait(lock, [&] { return stopping_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+};
+
+// Потокобезопасное хранилище из независимых шардов KVStorage с SharedMutexLock: запросы к разным шардам
+// не конкурируют за одну блокировку. Ключ попадает в шард по хешу.
+//
+// В режиме NUMA (ShardingOptions::numa_aware) шарды распределены по узлам: шард создаётся потоком своего
+// узла, а объект шарда размещается на узле через mbind, поэтому внутренние структуры шарда лежат в памяти
+// узла. Чтобы новые записи тоже размещались локально, а чтения не ходили в память другого процессора,
+// запросы выполняются на потоках узла-владельца: get/set/remove передаются потоку узла ключа и ждут результата
+// (с потока самого узла - выполняются сразу), execute(key, fn) выполняет на потоке узла произвольный fn,
+// nodeOf(key) - для собственной диспетчеризации. Без режима NUMA get/set/remove выполняются на вызывающем потоке.
+template <typename Clock, typename Key = std::string, typename Value = std::string,
+          typename Policies = KVPolicies<AutoIndexPolicy, ScanExpiry, SharedMutexLock>>
+class ShardedKVStorage {
+public:
+    using Shard = KVStorage<Clock, Key, Value, Policies>;
+    using KeyView = typename Shard::KeyView;
+
+    static_assert(!std::same_as<typename Policies::lock, NoLock>,
+                  "Shards are shared between threads: use a lock policy such as SharedMutexLock");
+
+    ShardedKVStorage(std::span<std::tuple<Key, Value, uint32_t>> entries, Clock& clock,
+                     const ShardingOptions& sharding = {}, const ExpiryOptions& options = {})
+        : numa_(sharding.numa_aware && Numa::nodeCount() > 1),
+          node_count_(numa_ ? Numa::nodeCount() : 1),
+          shards_per_node_(std::max<size_t>(sharding.shards_per_node, 1)) {
+        for (size_t node = 0; node < node_count_; ++node) {
+            workers_.push_back(std::make_unique<NodeWorkers>(node, sharding.workers_per_node, numa_));
+        }
+
+        const size_t shard_count = node_count_ * shards_per_node_;
+        shards_.resize(shard_count);
+
+        // Пустые шарды создаются на потоках своих узлов, затем уже они раскладывают начальные записи
+        std::vector<std::future<void>> created;
+        for (size_t shard = 0; shard < shard_count; ++shard) {
+            created.push_back(workers_[NodeOfShard(shard)]->submit([&, shard] {
+                shards_[shard] = MakeShard(shard, clock, options);
+            }));
+        }
+        WaitAll(created);
+
+        std::vector<std::vector<std::tuple<Key, Value, uint32_t>>> per_shard(shard_count);
+        for (auto& entry : entries) {
+            per_shard[ShardOf(std::get<0>(entry))].push_back(entry);
+        }
+
+        std::vector<std::future<void>> filled;
+        for (size_t shard = 0; shard < shard_count; ++shard) {
+            filled.push_back(workers_[NodeOfShard(shard)]->submit([&, shard] {
+                for (auto& [key, value, ttl] : per_shard[shard]) {
+                    shards_[shard]->set(std::move(key), std::move(value), ttl);
+                }
+            }));
+        }
+        WaitAll(filled);
+    }
+
+    ShardedKVStorage(const ShardedKVStorage&) = delete;
+    ShardedKVStorage& operator=(const ShardedKVStorage&) = delete;
+
+    // Сначала останавливаются потоки: задачи в очереди могут обращаться к шардам
+    ~ShardedKVStorage() {
+        workers_.clear();
+    }
+
+    // В режиме NUMA значение создаётся и вставляется потоком узла шарда
+    void set(Key key, Value value, uint32_t ttl) {
+        const size_t shard = ShardOf(key);
+        RunOnNode(shard, [&] { shards_[shard]->set(std::move(key), std::move(value), ttl); });
+    }
+
+    bool remove(const KeyView key) {
+        const size_t shard = ShardOf(key);
+        return RunOnNode(shard, [&] { return shards_[shard]->remove(key); });
+    }
+
+    std::optional<Value> get(const KeyView key) const {
+        const size_t shard = ShardOf(key);
+        return RunOnNode(shard, [&] { return shards_[shard]->get(key); });
+    }
+
+    // Слияние первых count записей каждого шарда. O(s * (log n + count) + count * log s), s - кол-во шардов
+    std::vector<std::pair<Key, Value>> getManySorted(const KeyView key, const uint32_t count) const {
+        std::vector<std::vector<std::pair<Key, Value>>> parts;
+        parts.reserve(shards_.size());
+        for (const auto& shard : shards_) {
+            parts.push_back(shard->getManySorted(key, count));
+        }
+
+        using Compare = typename Policies::index::template CompareFor<Key>;
+        Compare compare;
+
+        // Куча курсоров (шард, позиция), на вершине - наименьший по Compare ключ
+        std::vector<std::pair<size_t, size_t>> heap;
+        auto greater = [&](const auto& lhs, const auto& rhs) {
+            return compare(parts[rhs.first][rhs.second].first, parts[lhs.first][lhs.second].first);
+        };
+        for (size_t part = 0; part < parts.size(); ++part) {
+            if (!parts[part].empty()) {
+                heap.emplace_back(part, 0);
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), greater);
+
+        std::vector<std::pair<Key, Value>> result;
+        result.reserve(count);
+
+        while (!heap.empty() && result.size() < count) {
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            auto [part, pos] = heap.back();
+            heap.pop_back();
+
+            result.push_back(std::move(parts[part][pos]));
+            if (pos + 1 < parts[part].size()) {
+                heap.emplace_back(part, pos + 1);
+                std::push_heap(heap.begin(), heap.end(), greater);
+            }
+        }
+
+        return result;
+    }
+
+    std::optional<std::pair<Key, Value>> removeOneExpiredEntry() {
+        for (auto& shard : shards_) {
+            if (auto expired = shard->removeOneExpiredEntry()) {
+                return expired;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // До max_count записей суммарно по всем шардам. Слушатель вызывается отдельно для каждого шарда
+    size_t removeExpiredEntries(const size_t max_count) {
+        size_t removed = 0;
+        for (auto& shard : shards_) {
+            if (removed == max_count) {
+                break;
+            }
+            removed += shard->removeExpiredEntries(max_count - removed);
+        }
+        return removed;
+    }
+
+    // Очищает шарды по очереди, см. KVStorage::clear
+    void clear() {
+        for (auto& shard : shards_) {
+            shard->clear();
+        }
+    }
+
+    void setExpiryListener(typename Shard::Listener* listener) {
+        for (auto& shard : shards_) {
+            shard->setExpiryListener(listener);
+        }
+    }
+
+    // Выполняет fn(shard) на потоке узла, которому принадлежит шард ключа key
+    template <typename F>
+    auto execute(const KeyView key, F&& fn) -> std::future<std::invoke_result_t<F, Shard&>> {
+        const size_t shard = ShardOf(key);
+        return workers_[NodeOfShard(shard)]->submit(
+            [this, shard, fn = std::forward<F>(fn)]() mutable { return fn(*shards_[shard]); });
+    }
+
+    // Узел NUMA, которому принадлежит ключ (0 без режима NUMA)
+    size_t nodeOf(const KeyView key) const {
+        return NodeOfShard(ShardOf(key));
+    }
+
+    size_t nodeCount() const noexcept {
+        return node_count_;
+    }
+
+    size_t shardCount() const noexcept {
+        return shards_.size();
+    }
+
+    bool numaAware() const noexcept {
+        return numa_;
+    }
+
+private:
+    // Шард в памяти, выделенной по страницам и привязанной к узлу шарда
+    struct ShardDeleter {
+        size_t bytes;
+
+        void operator()(Shard* shard) const {
+            shard->~Shard();
+            ::operator delete(shard, bytes, std::align_val_t{Numa::pageSize()});
+        }
+    };
+
+    using ShardPtr = std::unique_ptr<Shard, ShardDeleter>;
+
+    ShardPtr MakeShard(size_t shard, Clock& clock, const ExpiryOptions& options) {
+        const size_t page = Numa::pageSize();
+        const size_t bytes = (sizeof(Shard) + page - 1) / page * page;
+
+        void* memory = ::operator new(bytes, std::align_val_t{page});
+        if (numa_) {
+            Numa::bindMemory(memory, bytes, NodeOfShard(shard));
+        }
+
+        try {
+            return ShardPtr(new (memory) Shard(std::span<std::tuple<Key, Value, uint32_t>>{}, clock, options),
+                            ShardDeleter{bytes});
+        } catch (...) {
+            ::operator delete(memory, bytes, std::align_val_t{page});
+            throw;
+        }
+    }
+
+    // Выполняет fn на потоке узла шарда и ждёт результата. Без режима NUMA и с потока самого узла - сразу.
+    // Задачи в очереди ссылаются на аргументы вызывающего, поэтому ожидание обязательно
+    template <typename F>
+    std::invoke_result_t<F> RunOnNode(size_t shard, F&& fn) const {
+        NodeWorkers& workers = *workers_[NodeOfShard(shard)];
+        if (!numa_ || workers.runsOnThisNode()) {
+            return fn();
+        }
+        return workers.submit(std::forward<F>(fn)).get();
+    }
+
+    // Задачи ссылаются на локальные переменные конструктора: исключение пробрасывается только после того,
+    // как завершились все задачи
+    static void WaitAll(std::vector<std::future<void>>& futures) {
+        for (auto& future : futures) {
+            future.wait();
+        }
+        for (auto& future : futures) {
+            future.get();
+        }
+    }
+
+    // Старшие биты перемешанного хеша: младшие биты хеша использует хеш-таблица внутри шарда
+    size_t ShardOf(const KeyView key) const {
+        uint64_t z = shards_[0]->keyHash(key);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+#if defined(__SIZEOF_INT128__)
+        return static_cast<size_t>((static_cast<unsigned __int128>(z) * shards_.size()) >> 64);
+#else
+        // Старшие 64 бита произведения z * size, size < 2^32
+        const uint64_t size = shards_.size();
+        const uint64_t low = (z & 0xFFFFFFFFULL) * size;
+        return static_cast<size_t>(((z >> 32) * size + (low >> 32)) >> 32);
+#endif
+    }
+
+    // Шарды узла идут подряд
+    size_t NodeOfShard(size_t shard) const noexcept {
+        return shard / shards_per_node_;
+    }
+
+    bool numa_;
+    size_t node_count_;
+    size_t shards_per_node_;
+    std::vector<ShardPtr> shards_;
+    std::vector<std::unique_ptr<NodeWorkers>> workers_;
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cerrno>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#define KVSTORAGE_HAS_PREAD 1
+#else
+#include <cstdio>
+#include <mutex>
+#define KVSTORAGE_HAS_PREAD 0
+#endif
+
+// Значения, которые можно вытеснить в файл: байты строки или объектное представление тривиально копируемого типа
+template <typename Value>
+concept SpillableValue = std::same_as<Value, std::string> || std::is_trivially_copyable_v<Value>;
+
+// Файл для вытесненных холодных значений: только дозапись в конец и чтение по смещению. Файл создаётся во временном
+// каталоге и сразу удаляется из него, поэтому существует, пока открыт, и не остаётся после завершения процесса.
+// Чтения (pread) не меняют позицию файла и могут идти из нескольких потоков одновременно с другими чтениями.
+// Ошибки ввода-вывода - исключения std::system_error.
+class SpillFile {
+public:
+    // directory - каталог для файла, пустой - $TMPDIR или /tmp
+    explicit SpillFile(const std::string& directory = {}) {
+        std::string dir = directory;
+        if (dir.empty()) {
+            const char* tmpdir = std::getenv("TMPDIR");
+            dir = tmpdir != nullptr && *tmpdir != '\0' ? tmpdir : "/tmp";
+        }
+
+#if KVSTORAGE_HAS_PREAD
+        std::string path = dir + "/kvstorage-spill-XXXXXX";
+        fd_ = mkstemp(path.data());
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot create spill file in " + dir);
+        }
+        unlink(path.c_str());
+#else
+        file_ = std::tmpfile();
+        if (file_ == nullptr) {
+            throw std::system_error(errno, std::generic_category(), "cannot create spill file");
+        }
+#endif
+    }
+
+    SpillFile(SpillFile&& other) noexcept
+        : size_(std::exchange(other.size_, 0)),
+#if KVSTORAGE_HAS_PREAD
+          fd_(std::exchange(other.fd_, -1)) {
+#else
+          file_(std::exchange(other.file_, nullptr)) {
+#endif
+    }
+
+    SpillFile& operator=(SpillFile&& other) noexcept {
+        if (this != &other) {
+            Close();
+            size_ = std::exchange(other.size_, 0);
+#if KVSTORAGE_HAS_PREAD
+            fd_ = std::exchange(other.fd_, -1);
+#else
+            file_ = std::exchange(other.file_, nullptr);
+#endif
+        }
+        return *this;
+    }
+
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    ~SpillFile() {
+        Close();
+    }
+
+    // Дописывает len байт в конец файла и возвращает их смещение. Один системный вызов на вызов append
+    uint64_t append(const void* data, size_t len) {
+        const uint64_t offset = size_;
+        const auto* p = static_cast<const char*>(data);
+
+#if KVSTORAGE_HAS_PREAD
+        for (size_t written = 0; written < len;) {
+            const ssize_t n = pwrite(fd_, p + written, len - written, static_cast<off_t>(offset + written));
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "spill file write failed");
+            }
+            written += static_cast<size_t>(n);
+        }
+#else
+        std::lock_guard lock(mutex_);
+        if (std::fseek(file_, static_cast<long>(offset), SEEK_SET) != 0 || std::fwrite(p, 1, len, file_) != len) {
+            throw std::system_error(errno, std::generic_category(), "spill file write failed");
+        }
+#endif
+
+        size_ += len;
+        return offset;
+    }
+
+    // Читает len байт со смещения offset. Один системный вызов на вызов read
+    void read(uint64_t offset, void* data, size_t len) const {
+        auto* p = static_cast<char*>(data);
+
+#if KVSTORAGE_HAS_PREAD
+        for (size_t done = 0; done < len;) {
+            const ssize_t n = pread(fd_, p + done, len - done, static_cast<off_t>(offset + done));
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(n < 0 ? errno : EIO, std::generic_category(), "spill file read failed");
+            }
+            done += static_cast<size_t>(n);
+        }
+#else
+        std::lock_guard lock(mutex_);
+        if (std::fseek(file_, static_cast<long>(offset), SEEK_SET) != 0 || std::fread(p, 1, len, file_) != len) {
+            throw std::system_error(errno, std::generic_category(), "spill file read failed");
+        }
+#endif
+    }
+
+    // Байт записано в файл, включая значения, которые уже не используются
+    uint64_t size() const noexcept {
+        return size_;
+    }
+
+private:
+    void Close() noexcept {
+#if KVSTORAGE_HAS_PREAD
+        if (fd_ >= 0) {
+            close(fd_);
+            fd_ = -1;
+        }
+#else
+        if (file_ != nullptr) {
+            std::fclose(file_);
+            file_ = nullptr;
+        }
+#endif
+    }
+
+    uint64_t size_ = 0;
+#if KVSTORAGE_HAS_PREAD
+    int fd_ = -1;
+#else
+    std::FILE* file_ = nullptr;
+    mutable std::mutex mutex_;
+#endif
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#include "clock.hpp"
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <x86intrin.h>
+#define KVSTORAGE_HAS_TSC 1
+#else
+#define KVSTORAGE_HAS_TSC 0
+#endif
+
+// Часы на счётчике тактов процессора (rdtsc) для замеров в бенчмарках и инструментировании:
+// чтение стоит несколько наносекунд против десятков у clock_gettime.
+// Используются только при инвариантном TSC (частота не зависит от P/C-состояний ядра), иначе и не на Linux/x86
+// часы прозрачно работают через std::chrono::steady_clock. Частота калибруется по steady_clock один раз
+// при первом обращении.
+class TscClock {
+public:
+    using rep = int64_t;
+    using period = std::nano;
+    using duration = std::chrono::nanoseconds;
+    using time_point = std::chrono::time_point<TscClock, duration>;
+
+    static constexpr bool is_steady = true;
+
+    static time_point now() noexcept {
+        const Calibration& calibration = GetCalibration();
+
+#if KVSTORAGE_HAS_TSC
+        if (calibration.uses_tsc) {
+            const uint64_t ticks = __rdtsc() - calibration.base_ticks;
+            const auto nanos = static_cast<rep>((static_cast<unsigned __int128>(ticks) * calibration.mult) >> kShift);
+            return time_point(duration(calibration.base_nanos + nanos));
+        }
+#endif
+
+        return time_point(std::chrono::duration_cast<duration>(std::chrono::steady_clock::now().time_since_epoch()));
+    }
+
+    // true - если now() читает TSC, false - если используется steady_clock
+    static bool usesTsc() noexcept {
+        return GetCalibration().uses_tsc;
+    }
+
+    // Откалиброванная частота TSC в тактах за секунду, 0 при работе через steady_clock
+    static double ticksPerSecond() noexcept {
+        const Calibration& calibration = GetCalibration();
+        return calibration.uses_tsc ? 1e9 * static_cast<double>(uint64_t{1} << kShift) / calibration.mult : 0.0;
+    }
+
+    // Инвариантный TSC: CPUID.80000007H:EDX[8]
+    static bool hasInvariantTsc() noexcept {
+#if KVSTORAGE_HAS_TSC
+        unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+        if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007) {
+            return false;
+        }
+
+        __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        return (edx & (1u << 8)) != 0;
+#else
+        return false;
+#endif
+    }
+
+private:
+    // Наносекунды = (такты * mult) >> kShift, без деления и плавающей точки на горячем пути
+    static constexpr int kShift = 32;
+
+    struct Calibration {
+        bool uses_tsc = false;
+        uint64_t base_ticks = 0;
+        rep base_nanos = 0;
+        uint64_t mult = 0;
+    };
+
+    static const Calibration& GetCalibration() noexcept {
+        static const Calibration calibration = Calibrate();
+        return calibration;
+    }
+
+    static Calibration Calibrate() noexcept {
+        Calibration result;
+
+#if KVSTORAGE_HAS_TSC
+        if (!hasInvariantTsc()) {
+            return result;
+        }
+
+        using std::chrono::steady_clock;
+
+        const auto start_time = steady_clock::now();
+        const uint64_t start_ticks = __rdtsc();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        const auto end_time = steady_clock::now();
+        const uint64_t end_ticks = __rdtsc();
+
+        const auto elapsed = std::chrono::duration_cast<duration>(end_time - start_time).count();
+        if (elapsed <= 0 || end_ticks <= start_ticks) {
+            return result;
+        }
+
+        result.uses_tsc = true;
+        result.base_ticks = end_ticks;
+        result.base_nanos = std::chrono::duration_cast<duration>(end_time.time_since_epoch()).count();
+        result.mult = static_cast<uint64_t>((static_cast<unsigned __int128>(elapsed) << kShift) / (end_ticks - start_ticks));
+#endif
+
+        return result;
+    }
+};
+
+static_assert(StorageClock<TscClock>);
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "kvstorage.hpp"
+
+// Изменение одного ключа для медленного хранилища: value == std::nullopt - ключ удалён
+template <typename Key = std::string, typename Value = std::string>
+struct WriteBehindOp {
+    Key key;
+    std::optional<Value> value;
+    uint32_t ttl = 0;
+
+    bool operator==(const WriteBehindOp&) const = default;
+};
+
+// Получатель пачек изменений (медленное хранилище). Вызывается из потока WriteBehindBuffer, по одной пачке
+// за раз, поэтому изменения одного ключа приходят в порядке записи. Исключение из write - пачка не записана:
+// её изменения будут отправлены повторно, если ключ не изменили заново. Поэтому пачка передаётся по константной
+// ссылке и остаётся у буфера до успешной записи.
+template <typename Key = std::string, typename Value = std::string>
+class WriteBehindSink {
+public:
+    virtual ~WriteBehindSink() = default;
+
+    virtual void write(const std::vector<WriteBehindOp<Key, Value>>& batch) = 0;
+};
+
+struct WriteBehindOptions {
+    // Граница памяти: set/remove нового ключа ждут, пока в буфере не меньше max_dirty_keys ключей, считая пачку
+    // в отправке (backpressure). Повторные изменения уже записанного в буфер ключа объединяются и не ждут
+    size_t max_dirty_keys = 100'000;
+    // Наибольший размер пачки; пачка отправляется сразу, как только набралась
+    size_t max_batch = 1'000;
+    // Неполная пачка отправляется не позже чем через flush_interval; с тем же интервалом повторяется
+    // отправка после ошибки получателя
+    std::chrono::milliseconds flush_interval{100};
+};
+
+struct WriteBehindStats {
+    uint64_t writes = 0;         // вызовов set/remove, включая удаления протухших записей
+    uint64_t coalesced = 0;      // из них заменили ещё не отправленное изменение того же ключа
+    uint64_t flushed = 0;        // изменений принято получателем
+    uint64_t batches = 0;        // пачек принято получателем
+    uint64_t failed_batches = 0; // пачек, на которых получатель бросил исключение
+    uint64_t dropped = 0;        // изменений, не доставленных к моменту разрушения буфера
+    uint64_t blocked = 0;        // вызовов set/remove, ждавших места в буфере
+};
+
+// Отложенная запись (write-behind) изменений KVStorage в медленное хранилище: set/remove записывают ключ в буфер
+// "грязных" ключей, фоновый поток отправляет их пачками получателю WriteBehindSink. Несколько изменений ключа
+// до отправки объединяются в одно - последнее. Буфер также реализует ExpiryListener: удалённые протухшие записи
+// становятся удалениями в медленном хранилище (KVStorage::setExpiryListener).
+// Ключи отправляются в порядке первого изменения после предыдущей отправки.
+// Потокобезопасен. Деструктор отправляет оставшиеся изменения; если получатель продолжает бросать исключения,
+// они отбрасываются (WriteBehindStats::dropped).
+template <typename Key = std::string, typename Value = std::string>
+class WriteBehindBuffer : public ExpiryListener<Key, Value> {
+public:
+    using KeyView = typename KeyTraits<Key>::view_type;
+    using Op = WriteBehindOp<Key, Value>;
+    using Sink = WriteBehindSink<Key, Value>;
+
+    // Буфер не владеет получателем: получатель должен жить дольше буфера
+    explicit WriteBehindBuffer(Sink& sink, const WriteBehindOptions& options = {})
+        : sink_(&sink),
+          max_dirty_keys_(std::max<size_t>(options.max_dirty_keys, 1)),
+          max_batch_(std::max<size_t>(options.max_batch, 1)),
+          flush_interval_(options.flush_interval),
+          flusher_([this] { Run(); }) {
+    }
+
+    WriteBehindBuffer(const WriteBehindBuffer&) = delete;
+    WriteBehindBuffer& operator=(const WriteBehindBuffer&) = delete;
+
+    ~WriteBehindBuffer() override {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+        work_cv_.notify_one();
+        flusher_.join();
+    }
+
+    // O(1)*, плюс ожидание места в буфере
+    void set(Key key, Value value, uint32_t ttl = 0) {
+        Record(Op{std::move(key), std::move(value), ttl});
+    }
+
+    void remove(Key key) {
+        Record(Op{std::move(key), std::nullopt, 0});
+    }
+
+    void onExpired(std::vector<std::pair<Key, Value>>&& batch) override {
+        for (auto& [key, value] : batch) {
+            remove(std::move(key));
+        }
+    }
+
+    // Ждёт, пока получатель примет все изменения, записанные до вызова; изменения, записанные после, не ждёт.
+    // false - получатель бросил исключение, часть изменений осталась в буфере для повторной отправки
+    bool flush() {
+        std::unique_lock lock(mutex_);
+        const uint64_t failures = stats_.failed_batches;
+
+        flush_target_ = std::max(flush_target_, last_seq_);
+        const uint64_t target = last_seq_;
+        work_cv_.notify_one();
+        idle_cv_.wait(lock, [&] { return UnsentSeq() > target || stats_.failed_batches != failures; });
+
+        return stats_.failed_batches == failures;
+    }
+
+    size_t dirtyCount() const {
+        std::lock_guard lock(mutex_);
+        return dirty_.size();
+    }
+
+    WriteBehindStats stats() const {
+        std::lock_guard lock(mutex_);
+        return stats_;
+    }
+
+private:
+    // Изменение ключа, ещё не принятое получателем. seq - номер самого раннего неотправленного изменения ключа:
+    // при объединении он не меняется, поэтому номера в dirty_ возрастают от начала к концу
+    struct DirtyOp {
+        Op op;
+        uint64_t seq;
+    };
+
+    using DirtyIterator = typename std::list<DirtyOp>::iterator;
+
+    void Record(Op&& op) {
+        std::unique_lock lock(mutex_);
+        ++stats_.writes;
+
+        if (Coalesce(op)) {
+            return;
+        }
+
+        if (dirty_.size() + in_flight_ >= max_dirty_keys_) {
+            ++stats_.blocked;
+            work_cv_.notify_one();
+            space_cv_.wait(lock, [&] { return dirty_.size() + in_flight_ < max_dirty_keys_; });
+
+            // Пока поток ждал, ключ мог попасть в буфер снова
+            if (Coalesce(op)) {
+                return;
+            }
+        }
+
+        // Номер выдаётся после ожидания, чтобы номера в dirty_ возрастали; объединённое изменение покрыто номером
+        // записи, в которую попало
+        Push(dirty_.end(), DirtyOp{std::move(op), ++last_seq_});
+        if (dirty_.size() >= max_batch_) {
+            work_cv_.notify_one();
+        }
+    }
+
+    // Заменяет неотправленное изменение того же ключа
+    bool Coalesce(Op& op) {
+        auto it = positions_.find(KeyView(op.key));
+        if (it == positions_.end()) {
+            return false;
+        }
+
+        it->second->op.value = std::move(op.value);
+        it->second->op.ttl = op.ttl;
+        ++stats_.coalesced;
+        return true;
+    }
+
+    // string_view в positions_ ссылается на ключ в узле dirty_: узлы списка не перемещаются
+    void Push(DirtyIterator before, DirtyOp&& op) {
+        auto node = dirty_.insert(before, std::move(op));
+        positions_.emplace(KeyView(node->op.key), node);
+    }
+
+    // Номер самого раннего изменения, не принятого получателем: все изменения с меньшими номерами приняты
+    uint64_t UnsentSeq() const noexcept {
+        if (in_flight_ > 0) {
+            return in_flight_seq_;
+        }
+        return dirty_.empty() ? last_seq_ + 1 : dirty_.front().seq;
+    }
+
+    void Run() {
+        std::unique_lock lock(mutex_);
+
+        while (true) {
+            work_cv_.wait_for(lock, flush_interval_, [&] {
+                return stopping_ || UnsentSeq() <= flush_target_ || dirty_.size() >= max_batch_;
+            });
+
+            if (dirty_.empty()) {
+                if (stopping_) {
+                    return;
+                }
+                continue;
+            }
+
+            std::vector<Op> batch;
+            std::vector<uint64_t> seqs;
+            batch.reserve(std::min(dirty_.size(), max_batch_));
+            seqs.reserve(batch.capacity());
+            while (!dirty_.empty() && batch.size() < max_batch_) {
+                positions_.erase(KeyView(dirty_.front().op.key));
+                batch.push_back(std::move(dirty_.front().op));
+                seqs.push_back(dirty_.front().seq);
+                dirty_.pop_front();
+            }
+
+            // Пачка до конца отправки занимает место в буфере: при ошибке она вернётся в dirty_
+            in_flight_ = batch.size();
+            in_flight_seq_ = seqs.front();
+            lock.unlock();
+
+            bool written = true;
+            try {
+                sink_->write(batch);
+            } catch (...) {
+                written = false;
+            }
+
+            lock.lock();
+            in_flight_ = 0;
+
+            if (written) {
+                ++stats_.batches;
+                stats_.flushed += batch.size();
+            } else {
+                ++stats_.failed_batches;
+                Requeue(std::move(batch), seqs);
+            }
+            idle_cv_.notify_all();
+            space_cv_.notify_all();
+
+            if (!written) {
+                if (stopping_) {
+                    stats_.dropped += dirty_.size();
+                    positions_.clear();
+                    dirty_.clear();
+                    idle_cv_.notify_all();
+                    space_cv_.notify_all();
+                    return;
+                }
+
+                // Пауза перед повтором, пока не пришла остановка
+                work_cv_.wait_for(lock, flush_interval_, [&] { return stopping_; });
+            }
+        }
+    }
+
+    // Неотправленная пачка возвращается в начало очереди. Ключи, изменённые за время отправки, уже содержат
+    // более новое значение: оно переносится в начало с номером неотправленного изменения. Места в буфере хватает
+    // без ожидания: пачка учитывалась в границе max_dirty_keys, пока отправлялась
+    void Requeue(std::vector<Op>&& batch, const std::vector<uint64_t>& seqs) {
+        auto front = dirty_.begin();
+        for (size_t i = 0; i < batch.size(); ++i) {
+            auto it = positions_.find(KeyView(batch[i].key));
+            if (it == positions_.end()) {
+                Push(front, DirtyOp{std::move(batch[i]), seqs[i]});
+                continue;
+            }
+
+            if (it->second == front) {
+                ++front;
+            }
+            dirty_.splice(front, dirty_, it->second);
+            it->second->seq = seqs[i];
+        }
+    }
+
+    Sink* sink_;
+    size_t max_dirty_keys_;
+    size_t max_batch_;
+    std::chrono::milliseconds flush_interval_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable work_cv_;  // есть работа для потока отправки
+    std::condition_variable space_cv_; // в буфере освободилось место
+    std::condition_variable idle_cv_;  // пачка отправлена или не отправлена
+
+    // Грязные ключи в порядке первого изменения и доступ к ним по ключу
+    std::list<DirtyOp> dirty_;
+    std::unordered_map<KeyView, DirtyIterator> positions_;
+
+    // Номер последнего ключа, добавленного в dirty_, и наибольший номер, до которого ждёт flush
+    uint64_t last_seq_ = 0;
+    uint64_t flush_target_ = 0;
+    // Кол-во ключей в отправляемой пачке и номер её самого раннего изменения
+    size_t in_flight_ = 0;
+    uint64_t in_flight_seq_ = 0;
+    bool stopping_ = false;
+    WriteBehindStats stats_;
+
+    // Последним: поток запускается, когда остальные поля уже созданы
+    std::thread flusher_;
+};
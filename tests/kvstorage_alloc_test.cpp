@@ -0,0 +1,74 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <span>
+#include <string>
+#include <tuple>
+
+#include "gtest/gtest.h"
+#include "key_order.hpp"
+#include "kvstorage.hpp"
+
+using namespace std;
+using namespace chrono;
+
+// Глобальные operator new/delete заменены на считающие: замена действует на весь исполняемый файл, поэтому
+// тесты аллокаций вынесены из kvstorage_tests
+
+class MockClock {
+public:
+    using time_point = steady_clock::time_point;
+
+    time_point now() const { return current_time_; }
+
+private:
+    time_point current_time_ = steady_clock::now();
+};
+
+namespace {
+atomic<size_t> allocation_count = 0;
+}
+
+void* operator new(size_t size) {
+    ++allocation_count;
+    if (void* ptr = malloc(size)) {
+        return ptr;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+template <typename Policies>
+void ExpectAllocationFreeLookups() {
+    MockClock clock;
+    KVStorage<MockClock, string, string, Policies> storage(span<tuple<string, string, uint32_t>>{}, clock);
+
+    // Ключи длиннее SSO: временная строка из string_view потребовала бы аллокации
+    const string long_key = "a rather long key that does not fit into SSO buffer";
+    storage.set(long_key, "val", 0);
+    storage.set("z", "val", 0);
+
+    const string range_start = "m rather long range start that does not fit into SSO";
+    const size_t before = allocation_count;
+
+    EXPECT_EQ(storage.get(string_view{long_key}), "val");
+    auto sorted = storage.getManySorted(string_view{range_start}, 1);
+
+    // Единственная аллокация - буфер результата getManySorted, ключи и значения короче SSO
+    EXPECT_EQ(allocation_count - before, 1);
+    EXPECT_EQ(sorted.size(), 1);
+}
+
+TEST(KVStorageAllocationTest, StringViewLookupsDoNotAllocate) {
+    ExpectAllocationFreeLookups<KVPolicies<>>();
+    ExpectAllocationFreeLookups<KVPolicies<CaseInsensitiveIndexPolicy>>();
+    ExpectAllocationFreeLookups<KVPolicies<NaturalOrderIndexPolicy>>();
+}
@@ -1,5 +1,19 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <shared_mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "gtest/gtest.h"
+#include "crc32c.hpp"
+#include "double_buffered_kvstorage.hpp"
 #include "kvstorage.hpp"
+#include "sharded_kvstorage.hpp"
+#include "tsc_clock.hpp"
+#include "write_behind.hpp"
 
 using namespace std;
 using namespace chrono;
@@ -58,4 +72,881 @@ TEST_F(KVStoragePerfTest, ReadRandomEntries) {
     auto end = steady_clock::now();
     auto diff = end - start;
     cout << "[ReadRandomEntries] Duration: " << duration_cast<milliseconds>(diff) << '\n';
-}
\ No newline at end of file
+}
+
+TEST_F(KVStoragePerfTest, GetLatencyPercentiles) {
+    const int N = 100'000;
+    for (int i = 0; i < N; ++i) {
+        storage->set("key" + ::to_string(i), "val" + ::to_string(i), 3600);
+    }
+
+    vector<string> keys;
+    for (int i = 0; i < 10'000; ++i) {
+        keys.push_back("key" + ::to_string(rand() % N));
+    }
+
+    // TscClock позволяет замерять каждую операцию отдельно: чтение часов стоит единицы наносекунд
+    vector<TscClock::duration> latencies;
+    latencies.reserve(keys.size());
+
+    for (const auto& key : keys) {
+        auto start = TscClock::now();
+        auto val = storage->get(key);
+        latencies.push_back(TscClock::now() - start);
+        ASSERT_TRUE(val.has_value());
+    }
+
+    sort(latencies.begin(), latencies.end());
+    cout << "[GetLatencyPercentiles] tsc: " << (TscClock::usesTsc() ? "yes" : "no")
+         << ", p50: " << latencies[latencies.size() / 2]
+         << ", p99: " << latencies[latencies.size() * 99 / 100] << '\n';
+}
+
+TEST(KVStorageKeyTypesPerfTest, IntegerVsStringKeys) {
+    struct Payload {
+        uint64_t id;
+        uint64_t version;
+    };
+
+    const int N = 200'000;
+    MockClock clock;
+
+    KVStorage<MockClock> string_storage(span<tuple<string, string, uint32_t>>{}, clock);
+    KVStorage<MockClock, uint64_t, Payload> int_storage(span<tuple<uint64_t, Payload, uint32_t>>{}, clock);
+
+    vector<string> string_keys;
+    vector<uint64_t> int_keys;
+    for (int i = 0; i < N; ++i) {
+        string_keys.push_back("key" + ::to_string(i));
+        int_keys.push_back(static_cast<uint64_t>(i) * 2654435761ULL);
+    }
+
+    auto start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        string_storage.set(string_keys[i], "payload_" + ::to_string(i), 3600);
+    }
+    auto string_insert = steady_clock::now() - start;
+
+    start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        int_storage.set(int_keys[i], Payload{static_cast<uint64_t>(i), 1}, 3600);
+    }
+    auto int_insert = steady_clock::now() - start;
+
+    size_t found = 0;
+    start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        found += string_storage.get(string_keys[(i * 7919) % N]).has_value();
+    }
+    auto string_get = steady_clock::now() - start;
+
+    start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        found += int_storage.get(int_keys[(i * 7919) % N]).has_value();
+    }
+    auto int_get = steady_clock::now() - start;
+
+    EXPECT_EQ(found, 2 * N);
+    cout << "[IntegerVsStringKeys] insert string: " << duration_cast<milliseconds>(string_insert)
+         << ", insert uint64: " << duration_cast<milliseconds>(int_insert)
+         << ", get string: " << duration_cast<milliseconds>(string_get)
+         << ", get uint64: " << duration_cast<milliseconds>(int_get) << '\n';
+}
+
+TEST(KVStorageKeyTypesPerfTest, RadixVsMapIndexForIntegerKeys) {
+    struct Payload {
+        uint64_t id;
+        uint64_t version;
+    };
+
+    const int N = 200'000;
+    MockClock clock;
+
+    KVStorage<MockClock, uint64_t, Payload> radix_storage(span<tuple<uint64_t, Payload, uint32_t>>{}, clock);
+    KVStorage<MockClock, uint64_t, Payload, KVPolicies<MapIndexPolicy<>>> map_storage(
+        span<tuple<uint64_t, Payload, uint32_t>>{}, clock);
+
+    vector<uint64_t> keys;
+    for (int i = 0; i < N; ++i) {
+        keys.push_back(static_cast<uint64_t>(i) * 2654435761ULL);
+    }
+
+    auto measure = [&](auto& storage, const char* name) {
+        auto start = steady_clock::now();
+        for (int i = 0; i < N; ++i) {
+            storage.set(keys[i], Payload{static_cast<uint64_t>(i), 1}, 3600);
+        }
+        auto insert = steady_clock::now() - start;
+
+        size_t found = 0;
+        start = steady_clock::now();
+        for (int i = 0; i < N; ++i) {
+            found += storage.get(keys[(i * 7919) % N]).has_value();
+        }
+        auto get = steady_clock::now() - start;
+
+        size_t scanned = 0;
+        start = steady_clock::now();
+        for (int i = 0; i < 1000; ++i) {
+            scanned += storage.getManySorted(keys[(i * 7919) % N], 100).size();
+        }
+        auto range = steady_clock::now() - start;
+
+        EXPECT_EQ(found, N);
+        EXPECT_GT(scanned, 0);
+        cout << "[RadixVsMapIndexForIntegerKeys] " << name << " insert: " << duration_cast<milliseconds>(insert)
+             << ", get: " << duration_cast<milliseconds>(get) << ", getManySorted x1000: "
+             << duration_cast<milliseconds>(range) << '\n';
+    };
+
+    measure(radix_storage, "radix");
+    measure(map_storage, "map");
+}
+
+// Поиск в узлах radix-дерева на 16 потомков: SSE2 (EqualMask/LowerBound) против скалярного цикла.
+// Каждый из 5 младших байтов ключа принимает 16 значений, поэтому все внутренние узлы - полные Inner16
+template <typename ByteSearch>
+pair<double, double> MeasureRadixByteSearch(const vector<uint64_t>& keys, const vector<uint64_t>& probes,
+                                            size_t& sink) {
+    RadixIndex<uint64_t, uint64_t, ByteSearch> index;
+    for (uint64_t key : keys) {
+        index.tryEmplace(uint64_t{key}, uint64_t{key});
+    }
+
+    auto start = steady_clock::now();
+    for (uint64_t key : probes) {
+        const uint64_t* mapped = index.find(key);
+        sink += mapped == nullptr ? 0 : *mapped;
+    }
+    const double find_ns = duration<double, nano>(steady_clock::now() - start).count() / probes.size();
+
+    // Начало getManySorted: спуск к первой записи не меньше ключа, ключи probes + 1 отсутствуют в индексе
+    start = steady_clock::now();
+    for (uint64_t key : probes) {
+        index.forEachFrom(key + 1, [&](uint64_t found, uint64_t) {
+            sink += found;
+            return false;
+        });
+    }
+    const double lower_bound_ns = duration<double, nano>(steady_clock::now() - start).count() / probes.size();
+
+    return {find_ns, lower_bound_ns};
+}
+
+TEST(KVStorageKeyTypesPerfTest, RadixInner16Sse2VsScalar) {
+    mt19937_64 rng(21);
+    size_t sink = 0;
+
+    // 3 уровня (4096 ключей) помещаются в кэш и показывают стоимость поиска в узле, 5 уровней (1M ключей) -
+    // с промахами кэша на каждом уровне
+    for (int levels : {3, 5}) {
+        // Значения байтов разбросаны по 0..255, ключи вставляются в случайном порядке
+        vector<uint64_t> keys;
+        for (uint64_t i = 0; i < (uint64_t{1} << (4 * levels)); ++i) {
+            uint64_t key = 0;
+            for (int level = 0; level < levels; ++level) {
+                const uint64_t nibble = (i >> (4 * level)) & 0xF;
+                key |= (nibble * 16 + 7) << (8 * level);
+            }
+            keys.push_back(key);
+        }
+        shuffle(keys.begin(), keys.end(), rng);
+
+        vector<uint64_t> probes(2'000'000);
+        for (auto& probe : probes) {
+            probe = keys[rng() % keys.size()];
+        }
+
+        auto [scalar_find, scalar_lower_bound] = MeasureRadixByteSearch<ScalarByteSearch>(keys, probes, sink);
+        cout << "[RadixInner16Sse2VsScalar] " << keys.size() << " keys, scalar: find " << scalar_find
+             << " ns, lower bound " << scalar_lower_bound << " ns\n";
+
+#if KVSTORAGE_HAS_SSE2
+        auto [sse2_find, sse2_lower_bound] = MeasureRadixByteSearch<Sse2ByteSearch>(keys, probes, sink);
+        cout << "[RadixInner16Sse2VsScalar] " << keys.size() << " keys, SSE2: find " << sse2_find
+             << " ns, lower bound " << sse2_lower_bound << " ns\n";
+#else
+        cout << "[RadixInner16Sse2VsScalar] SSE2 is not available, only the scalar loop is measured\n";
+#endif
+    }
+
+    EXPECT_NE(sink, 0);
+}
+
+template <typename Policies>
+void RunPolicyBenchmark(const char* name) {
+    const int N = 100'000;
+    MockClock clock;
+    KVStorage<MockClock, uint64_t, uint64_t, Policies> storage(span<tuple<uint64_t, uint64_t, uint32_t>>{}, clock);
+
+    auto start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        storage.set(static_cast<uint64_t>(i) * 2654435761ULL, i, 1 + i % 60);
+    }
+    auto insert = steady_clock::now() - start;
+
+    size_t found = 0;
+    start = steady_clock::now();
+    for (int i = 0; i < N; ++i) {
+        found += storage.get(static_cast<uint64_t>((i * 7919) % N) * 2654435761ULL).has_value();
+    }
+    auto get = steady_clock::now() - start;
+
+    // Протухает по 1/60 записей в секунду: удаление небольшими порциями, как у фонового сборщика
+    size_t reclaimed = 0;
+    start = steady_clock::now();
+    for (int second = 0; second < 60; ++second) {
+        clock.advance(1s);
+        while (size_t removed = storage.removeExpiredEntries(256)) {
+            reclaimed += removed;
+        }
+    }
+    auto reap = steady_clock::now() - start;
+
+    EXPECT_EQ(found, N);
+    EXPECT_EQ(reclaimed, N);
+    cout << "[PolicyMatrix] " << name << " insert: " << duration_cast<milliseconds>(insert)
+         << ", get: " << duration_cast<milliseconds>(get) << ", reap: " << duration_cast<milliseconds>(reap) << '\n';
+}
+
+TEST(KVStoragePolicyPerfTest, PolicyMatrix) {
+    RunPolicyBenchmark<KVPolicies<MapIndexPolicy<>, ScanExpiry, NoLock, NoStats>>("map   scan  nolock nostats");
+    RunPolicyBenchmark<KVPolicies<MapIndexPolicy<>, QueueExpiry, NoLock, NoStats>>("map   queue nolock nostats");
+    RunPolicyBenchmark<KVPolicies<RadixIndexPolicy, ScanExpiry, NoLock, NoStats>>("radix scan  nolock nostats");
+    RunPolicyBenchmark<KVPolicies<MapIndexPolicy<>, PackedExpiry, NoLock, NoStats>>("map   packed nolock nostats");
+    RunPolicyBenchmark<KVPolicies<RadixIndexPolicy, QueueExpiry, NoLock, NoStats>>("radix queue nolock nostats");
+    RunPolicyBenchmark<KVPolicies<RadixIndexPolicy, PackedExpiry, NoLock, NoStats>>("radix packed nolock nostats");
+    RunPolicyBenchmark<KVPolicies<RadixIndexPolicy, QueueExpiry, SharedMutexLock, NoStats>>("radix queue shared nostats");
+    RunPolicyBenchmark<KVPolicies<RadixIndexPolicy, QueueExpiry, NoLock, CollectStats>>("radix queue nolock stats");
+    RunPolicyBenchmark<KVPolicies<RadixIndexPolicy, QueueExpiry, SharedMutexLock, CollectStats>>("radix queue shared stats");
+}
+
+template <typename Hash>
+duration<double, nano> MeasureHash(const vector<string>& keys, size_t& sink) {
+    Hash hash;
+    const int rounds = 20;
+
+    auto start = steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        for (const auto& key : keys) {
+            sink += hash(string_view(key));
+        }
+    }
+    return duration<double, nano>(steady_clock::now() - start) / (rounds * keys.size());
+}
+
+TEST(KVStorageHashPerfTest, StringHashVsStdHash) {
+    mt19937_64 rng(1);
+    size_t sink = 0;
+
+    for (size_t len : {8, 16, 32, 64, 128, 256}) {
+        vector<string> keys(10'000);
+        for (auto& key : keys) {
+            key.resize(len);
+            for (auto& c : key) {
+                c = static_cast<char>('a' + rng() % 26);
+            }
+        }
+
+        auto std_time = MeasureHash<hash<string_view>>(keys, sink);
+        auto fast_time = MeasureHash<StringHash>(keys, sink);
+        cout << "[StringHashVsStdHash] len " << len << ": std::hash " << std_time.count() << " ns, StringHash "
+             << fast_time.count() << " ns\n";
+
+        // get по индексу с каждым из хешей
+        MockClock clock;
+        KVStorage<MockClock, string, uint64_t> fast_storage(span<tuple<string, uint64_t, uint32_t>>{}, clock);
+        KVStorage<MockClock, string, uint64_t, KVPolicies<MapIndexPolicy<less<>, hash<string_view>>>> std_storage(
+            span<tuple<string, uint64_t, uint32_t>>{}, clock);
+
+        for (const auto& key : keys) {
+            fast_storage.set(key, 1, 0);
+            std_storage.set(key, 1, 0);
+        }
+
+        auto measure_get = [&](auto& storage) {
+            auto start = steady_clock::now();
+            for (int round = 0; round < 20; ++round) {
+                for (const auto& key : keys) {
+                    sink += *storage.get(key);
+                }
+            }
+            return duration<double, nano>(steady_clock::now() - start) / (20 * keys.size());
+        };
+
+        auto std_get = measure_get(std_storage);
+        auto fast_get = measure_get(fast_storage);
+        cout << "[StringHashVsStdHash] len " << len << ": get std::hash " << std_get.count() << " ns, get StringHash "
+             << fast_get.count() << " ns\n";
+    }
+
+    EXPECT_NE(sink, 0);
+}
+
+// 40% чтений - промахи: фильтр отвечает на них без поиска в хеш-таблице индекса
+TEST(KVStorageFilterPerfTest, GetWithMisses) {
+    const int N = 200'000;
+    MockClock clock;
+
+    KVStorage<MockClock> plain(span<tuple<string, string, uint32_t>>{}, clock);
+    KVStorage<MockClock, string, string, KVPolicies<AutoIndexPolicy, ScanExpiry, NoLock, NoStats, BloomFilter<>>>
+        filtered(span<tuple<string, string, uint32_t>>{}, clock);
+
+    for (int i = 0; i < N; ++i) {
+        plain.set("key" + to_string(i), "val", 0);
+        filtered.set("key" + to_string(i), "val", 0);
+    }
+
+    vector<string> lookups;
+    for (int i = 0; i < N; ++i) {
+        lookups.push_back(i % 5 < 2 ? "missing" + to_string(i) : "key" + to_string((i * 7919) % N));
+    }
+
+    vector<string> misses;
+    for (int i = 0; i < N; ++i) {
+        misses.push_back("missing" + to_string(i));
+    }
+
+    auto measure = [&](auto& storage, const vector<string>& keys) {
+        size_t found = 0;
+        auto start = steady_clock::now();
+        for (const auto& key : keys) {
+            found += storage.get(key).has_value();
+        }
+        EXPECT_EQ(found, &keys == &misses ? 0 : N - N / 5 * 2);
+        return duration_cast<milliseconds>(steady_clock::now() - start);
+    };
+
+    auto plain_mixed = measure(plain, lookups);
+    auto filtered_mixed = measure(filtered, lookups);
+    auto plain_misses = measure(plain, misses);
+    auto filtered_misses = measure(filtered, misses);
+    cout << "[GetWithMisses] 40% misses - no filter: " << plain_mixed << ", bloom filter: " << filtered_mixed << '\n';
+    cout << "[GetWithMisses] only misses - no filter: " << plain_misses << ", bloom filter: " << filtered_misses
+         << '\n';
+}
+
+// Контрольная сумма ключа и значения на каждую запись относительно стоимости set той же записи
+TEST(KVStorageCrcPerfTest, ChecksumVsWritePath) {
+    const int N = 100'000;
+    uint32_t sink = 0;
+
+    cout << "[ChecksumVsWritePath] crc32c " << (Crc32c::usesHardware() ? "sse4.2" : "slicing-by-8") << '\n';
+
+    for (size_t value_size : {16, 128, 1024, 4096}) {
+        vector<string> keys;
+        for (int i = 0; i < N; ++i) {
+            keys.push_back("key" + to_string(i));
+        }
+        const string value(value_size, 'v');
+
+        MockClock clock;
+        KVStorage<MockClock> storage(span<tuple<string, string, uint32_t>>{}, clock);
+
+        auto start = steady_clock::now();
+        for (const auto& key : keys) {
+            storage.set(key, value, 0);
+        }
+        auto set_time = duration<double, milli>(steady_clock::now() - start);
+
+        auto measure_crc = [&](auto extend) {
+            auto crc_start = steady_clock::now();
+            for (const auto& key : keys) {
+                sink += extend(extend(0, key.data(), key.size()), value.data(), value.size());
+            }
+            return duration<double, milli>(steady_clock::now() - crc_start);
+        };
+
+        auto crc_time = measure_crc([](uint32_t crc, const void* data, size_t len) {
+            return Crc32c::extend(crc, data, len);
+        });
+        auto software_time = measure_crc([](uint32_t crc, const void* data, size_t len) {
+            return Crc32c::extendSoftware(crc, data, len);
+        });
+
+        cout << "[ChecksumVsWritePath] value " << value_size << " B: set " << set_time.count() << " ms, crc32c "
+             << crc_time.count() << " ms (" << 100 * crc_time / set_time << "%), slicing-by-8 "
+             << software_time.count() << " ms (" << 100 * software_time / set_time << "%)\n";
+    }
+
+    EXPECT_NE(sink, 0);
+}
+
+// Чтения с потока узла 0 из шардов своего узла (сразу) и из шардов чужих узлов (через поток узла-владельца).
+// На машине с одним узлом NUMA сравнивать нечего: измеряются прямое чтение с вызывающего потока и чтение
+// через execute на потоке узла
+TEST(KVStorageNumaPerfTest, LocalVsRemoteNodeGets) {
+    const int N = 200'000;
+    MockClock clock;
+
+    vector<tuple<string, string, uint32_t>> entries;
+    for (int i = 0; i < N; ++i) {
+        entries.emplace_back("key" + to_string(i), string(64, 'v'), 0);
+    }
+    ShardedKVStorage<MockClock> storage(entries, clock);
+
+    cout << "[LocalVsRemoteNodeGets] numa nodes: " << Numa::nodeCount() << ", shards: " << storage.shardCount()
+         << '\n';
+
+    vector<string> local;
+    vector<string> remote;
+    for (const auto& entry : entries) {
+        (storage.nodeOf(get<0>(entry)) == 0 ? local : remote).push_back(get<0>(entry));
+    }
+    mt19937 rng(13);
+    shuffle(local.begin(), local.end(), rng);
+    shuffle(remote.begin(), remote.end(), rng);
+
+    auto measure = [&](const vector<string>& keys) {
+        size_t found = 0;
+        auto start = steady_clock::now();
+        for (const auto& key : keys) {
+            found += storage.get(key).has_value();
+        }
+        EXPECT_EQ(found, keys.size());
+        return duration<double, nano>(steady_clock::now() - start).count() / max<size_t>(keys.size(), 1);
+    };
+
+    if (storage.numaAware()) {
+        thread reader([&] {
+            Numa::bindThreadToNode(0);
+            const double local_ns = measure(local);
+            const double remote_ns = measure(remote);
+            cout << "[LocalVsRemoteNodeGets] node-local get: " << local_ns << " ns, get routed to remote node: "
+                 << remote_ns << " ns\n";
+        });
+        reader.join();
+        return;
+    }
+
+    const double direct_ns = measure(local);
+
+    const size_t batch = 1'000;
+    size_t found = 0;
+    auto start = steady_clock::now();
+    for (size_t from = 0; from < local.size(); from += batch) {
+        const size_t to = min(local.size(), from + batch);
+        found += storage.execute(local[from], [&, from, to](auto&) {
+            size_t hits = 0;
+            for (size_t i = from; i < to; ++i) {
+                hits += storage.get(local[i]).has_value();
+            }
+            return hits;
+        }).get();
+    }
+    EXPECT_EQ(found, local.size());
+    const double routed_ns = duration<double, nano>(steady_clock::now() - start).count() / local.size();
+
+    cout << "[LocalVsRemoteNodeGets] single node: direct get " << direct_ns << " ns, get via node worker "
+         << routed_ns << " ns (batches of " << batch << ")\n";
+}
+
+// Холодные значения в файле: стоимость get горячего и вытесненного ключа и getManySorted по вытесненным записям
+TEST(KVStorageTieringPerfTest, HotVsSpilledGets) {
+    const int N = 100'000;
+    const int Hot = N / 10;
+    MockClock clock;
+    KVStorage<MockClock, string, string, KVPolicies<MapIndexPolicy<>, ScanExpiry, NoLock, NoStats, NoFilter, SpillColdValues<>>>
+        storage(span<tuple<string, string, uint32_t>>{}, clock);
+
+    vector<string> keys;
+    for (int i = 0; i < N; ++i) {
+        keys.push_back("key" + to_string(i));
+        storage.set(keys.back(), string(512, static_cast<char>('a' + i % 26)), 0);
+    }
+
+    // Первые 10% ключей читаются между проходами и остаются в памяти
+    auto start = steady_clock::now();
+    storage.spillColdValues(N);
+    for (int i = 0; i < Hot; ++i) {
+        storage.get(keys[i]);
+    }
+    const size_t spilled = storage.spillColdValues(N);
+    auto spill_time = duration_cast<milliseconds>(steady_clock::now() - start);
+    EXPECT_EQ(spilled, N - Hot);
+
+    vector<string> hot(keys.begin(), keys.begin() + Hot);
+    vector<string> cold(keys.begin() + Hot, keys.begin() + 2 * Hot);
+    mt19937 rng(17);
+    shuffle(hot.begin(), hot.end(), rng);
+    shuffle(cold.begin(), cold.end(), rng);
+
+    auto measure = [&](const vector<string>& lookups) {
+        size_t bytes = 0;
+        auto lookup_start = steady_clock::now();
+        for (const auto& key : lookups) {
+            bytes += storage.get(key)->size();
+        }
+        EXPECT_EQ(bytes, lookups.size() * 512);
+        return duration<double, nano>(steady_clock::now() - lookup_start).count() / lookups.size();
+    };
+
+    const double hot_ns = measure(hot);
+    const double cold_ns = measure(cold);
+
+    auto scan_start = steady_clock::now();
+    auto sorted = storage.getManySorted("key5", 10'000);
+    auto scan_time = duration_cast<milliseconds>(steady_clock::now() - scan_start);
+    EXPECT_EQ(sorted.size(), 10'000U);
+
+    auto stats = storage.tieringStats();
+    cout << "[HotVsSpilledGets] spilled " << stats.spilled_values << " values (" << stats.spill_file_bytes / 1024
+         << " KiB) in " << spill_time << '\n';
+    cout << "[HotVsSpilledGets] get in memory: " << hot_ns << " ns, get spilled: " << cold_ns
+         << " ns, getManySorted over 10000 mostly spilled entries: " << scan_time << '\n';
+}
+
+// Наплыв промахов: потоки одновременно запрашивают одни и те же отсутствующие ключи у медленного источника.
+// Без объединения каждый промах идёт в источник, с getOrLoad - одна загрузка на ключ
+TEST(KVStorageLoadPerfTest, ThunderingHerd) {
+    const int Threads = 8;
+    const int Keys = 200;
+    using Storage = KVStorage<MockClock, uint64_t, string, KVPolicies<AutoIndexPolicy, ScanExpiry, SharedMutexLock>>;
+
+    auto run = [&](bool coalesce) {
+        MockClock clock;
+        Storage storage(span<tuple<uint64_t, string, uint32_t>>{}, clock);
+        atomic<int> backend_calls = 0;
+
+        auto backend = [&](uint64_t key) {
+            ++backend_calls;
+            this_thread::sleep_for(200us);
+            return to_string(key);
+        };
+
+        auto start = steady_clock::now();
+        vector<thread> threads;
+        for (int t = 0; t < Threads; ++t) {
+            threads.emplace_back([&] {
+                for (uint64_t key = 0; key < Keys; ++key) {
+                    if (coalesce) {
+                        storage.getOrLoad(key, backend, 0);
+                    } else if (!storage.get(key)) {
+                        storage.set(key, backend(key), 0);
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        return make_pair(backend_calls.load(), duration_cast<milliseconds>(steady_clock::now() - start));
+    };
+
+    auto [naive_calls, naive_time] = run(false);
+    auto [coalesced_calls, coalesced_time] = run(true);
+    EXPECT_EQ(coalesced_calls, Keys);
+
+    cout << "[ThunderingHerd] " << Threads << " threads x " << Keys << " keys - get + set: " << naive_calls
+         << " backend calls, " << naive_time << "; getOrLoad: " << coalesced_calls << " backend calls, "
+         << coalesced_time << '\n';
+}
+
+// Зеркалирование записей в медленное хранилище: синхронная запись каждого set против write-behind с объединением
+// повторных записей одного ключа. Медленное хранилище тратит 50 мкс на вызов
+TEST(KVStorageWriteBehindPerfTest, WriteThroughVsWriteBehind) {
+    const int N = 10'000;
+    const int Keys = 1'000;
+
+    class SlowSink : public WriteBehindSink<> {
+    public:
+        void write(const vector<WriteBehindOp<>>& batch) override {
+            this_thread::sleep_for(50us);
+            ops += batch.size();
+            ++calls;
+        }
+
+        atomic<size_t> ops = 0;
+        atomic<size_t> calls = 0;
+    };
+
+    mt19937 rng(21);
+    vector<string> keys;
+    for (int i = 0; i < N; ++i) {
+        keys.push_back("key" + to_string(rng() % Keys));
+    }
+    const string value(100, 'v');
+
+    MockClock clock;
+    KVStorage<MockClock> through_storage(span<tuple<string, string, uint32_t>>{}, clock);
+    SlowSink through_sink;
+    auto start = steady_clock::now();
+    for (const auto& key : keys) {
+        through_storage.set(key, value, 0);
+        through_sink.write({{key, value, 0}});
+    }
+    auto through_time = duration_cast<milliseconds>(steady_clock::now() - start);
+
+    KVStorage<MockClock> behind_storage(span<tuple<string, string, uint32_t>>{}, clock);
+    SlowSink behind_sink;
+    milliseconds behind_time;
+    milliseconds drain_time;
+    {
+        WriteBehindBuffer<> buffer(behind_sink, {.max_batch = 500, .flush_interval = 10ms});
+        start = steady_clock::now();
+        for (const auto& key : keys) {
+            behind_storage.set(key, value, 0);
+            buffer.set(key, value);
+        }
+        behind_time = duration_cast<milliseconds>(steady_clock::now() - start);
+        EXPECT_TRUE(buffer.flush());
+        drain_time = duration_cast<milliseconds>(steady_clock::now() - start);
+    }
+
+    cout << "[WriteThroughVsWriteBehind] " << N << " sets over " << Keys << " keys - write-through: " << through_time
+         << ", " << through_sink.calls << " store calls; write-behind: " << behind_time << " (" << drain_time
+         << " until flushed), " << behind_sink.calls << " store calls with " << behind_sink.ops << " ops\n";
+}
+
+// Стоимость профилировщика горячих ключей в get: выборка 1 из 64 обращений против хранилища без профилировщика
+TEST(KVStorageHotKeysPerfTest, GetWithHotKeyTracking) {
+    const int N = 100'000;
+    const int Lookups = 1'000'000;
+    MockClock clock;
+
+    KVStorage<MockClock> plain(span<tuple<string, string, uint32_t>>{}, clock);
+    KVStorage<MockClock, string, string, KVPolicies<AutoIndexPolicy, ScanExpiry, NoLock, NoStats, NoFilter, NoTiering, TrackHotKeys<>>>
+        tracked(span<tuple<string, string, uint32_t>>{}, clock);
+
+    vector<string> keys;
+    for (int i = 0; i < N; ++i) {
+        keys.push_back("key" + to_string(i));
+        plain.set(keys.back(), "value", 0);
+        tracked.set(keys.back(), "value", 0);
+    }
+
+    // Степенное распределение: ключ с номером r выбирается с вероятностью ~ 1 / r
+    mt19937 rng(29);
+    vector<const string*> lookups;
+    lookups.reserve(Lookups);
+    for (int i = 0; i < Lookups; ++i) {
+        const double u = uniform_real_distribution<double>(0, 1)(rng);
+        lookups.push_back(&keys[static_cast<size_t>(pow(N, u)) - 1]);
+    }
+
+    auto measure = [&](auto& storage) {
+        size_t found = 0;
+        auto start = steady_clock::now();
+        for (const string* key : lookups) {
+            found += storage.get(*key).has_value();
+        }
+        EXPECT_EQ(found, Lookups);
+        return duration<double, nano>(steady_clock::now() - start).count() / Lookups;
+    };
+
+    const double plain_ns = measure(plain);
+    const double tracked_ns = measure(tracked);
+
+    auto hot = tracked.hotKeys();
+    ASSERT_FALSE(hot.empty());
+    EXPECT_EQ(hot[0].key, "key0");
+
+    cout << "[GetWithHotKeyTracking] get: " << plain_ns << " ns, with hot key tracking: " << tracked_ns << " ns\n";
+    cout << "[GetWithHotKeyTracking] hottest:";
+    for (size_t i = 0; i < min<size_t>(hot.size(), 5); ++i) {
+        cout << ' ' << hot[i].key << " (~" << hot[i].accesses << ", " << static_cast<uint64_t>(hot[i].per_second)
+             << "/s)";
+    }
+    cout << '\n';
+}
+
+// Задержка set и remove, заменяющих значения по 8 МиБ: освобождение внутри операции против фонового потока
+TEST(KVStorageDeferredFreePerfTest, LargeValueOverwriteLatency) {
+    const int N = 64;
+    const size_t ValueSize = size_t{8} << 20;
+    MockClock clock;
+
+    auto run = [&](auto& storage) {
+        vector<string> values;
+        for (int i = 0; i < 2 * N; ++i) {
+            values.emplace_back(ValueSize, static_cast<char>('a' + i % 26));
+        }
+        for (int i = 0; i < N; ++i) {
+            storage.set("key" + to_string(i), std::move(values[i]), 0);
+        }
+
+        vector<double> latencies;
+        for (int i = 0; i < N; ++i) {
+            const string key = "key" + to_string(i);
+            auto start = steady_clock::now();
+            if (i % 2 == 0) {
+                storage.set(key, std::move(values[N + i]), 0);
+            } else {
+                storage.remove(key);
+            }
+            latencies.push_back(duration<double, micro>(steady_clock::now() - start).count());
+        }
+
+        sort(latencies.begin(), latencies.end());
+        return make_pair(latencies[N / 2], latencies.back());
+    };
+
+    KVStorage<MockClock> in_place(span<tuple<string, string, uint32_t>>{}, clock);
+    KVStorage<MockClock, string, string,
+              KVPolicies<AutoIndexPolicy, ScanExpiry, NoLock, NoStats, NoFilter, NoTiering, NoHotKeys, DeferFreeLargeValues<>>>
+        deferred(span<tuple<string, string, uint32_t>>{}, clock);
+
+    auto [in_place_median, in_place_max] = run(in_place);
+    auto [deferred_median, deferred_max] = run(deferred);
+
+    cout << "[LargeValueOverwriteLatency] 8 MiB values, set/remove - free in place: median " << in_place_median
+         << " us, max " << in_place_max << " us; deferred free: median " << deferred_median << " us, max "
+         << deferred_max << " us\n";
+}
+
+// Сброс хранилища на миллион записей: разрушение на месте против clear с разрушением в фоновом потоке
+TEST(KVStorageClearPerfTest, ClearMillionEntries) {
+    const int N = 1'000'000;
+    MockClock clock;
+    using Storage = KVStorage<MockClock, string, string, KVPolicies<MapIndexPolicy<>, QueueExpiry>>;
+
+    auto fill = [&](Storage& storage) {
+        for (int i = 0; i < N; ++i) {
+            storage.set("key" + to_string(i), "value" + to_string(i), i % 2 == 0 ? 60 : 0);
+        }
+    };
+
+    auto destroyed = make_unique<Storage>(span<tuple<string, string, uint32_t>>{}, clock);
+    fill(*destroyed);
+    auto start = steady_clock::now();
+    destroyed.reset();
+    const double destroy_ms = duration<double, milli>(steady_clock::now() - start).count();
+
+    Storage storage(span<tuple<string, string, uint32_t>>{}, clock);
+    fill(storage);
+    start = steady_clock::now();
+    storage.clear();
+    const double clear_ms = duration<double, milli>(steady_clock::now() - start).count();
+
+    EXPECT_FALSE(storage.get("key1").has_value());
+    storage.set("key1", "value1", 0);
+    EXPECT_EQ(storage.get("key1"), "value1");
+
+    cout << "[ClearMillionEntries] 1M entries - destroy in place: " << destroy_ms << " ms, clear(): " << clear_ms
+         << " ms\n";
+}
+
+// Перезагрузка набора из 200 тыс. записей: сколько читатели не могут читать. При замене указателя под shared_mutex
+// это разрушение старого экземпляра под исключительной блокировкой, у DoubleBufferedKVStorage - publish
+TEST(KVStorageDoubleBufferedPerfTest, ReaderPauseDuringRebuilds) {
+    using Storage = KVStorage<NoTtl, uint64_t, string>;
+    const uint64_t N = 200'000;
+    const int Rebuilds = 5;
+
+    vector<tuple<uint64_t, string>> entries;
+    for (uint64_t i = 0; i < N; ++i) {
+        entries.emplace_back(i, "value" + to_string(i));
+    }
+
+    shared_mutex mutex;
+    auto locked = make_unique<Storage>(entries);
+    double locked_max_us = 0;
+    for (int i = 0; i < Rebuilds; ++i) {
+        auto next = make_unique<Storage>(entries);
+        auto start = steady_clock::now();
+        {
+            unique_lock lock(mutex);
+            locked = std::move(next);
+        }
+        locked_max_us = max(locked_max_us, duration<double, micro>(steady_clock::now() - start).count());
+        shared_lock lock(mutex);
+        EXPECT_TRUE(locked->get(i).has_value());
+    }
+
+    DoubleBufferedKVStorage<Storage> buffered(make_unique<Storage>(entries));
+    double buffered_max_us = 0;
+    for (int i = 0; i < Rebuilds; ++i) {
+        auto next = make_unique<Storage>(entries);
+        buffered.synchronize();
+        auto start = steady_clock::now();
+        buffered.publish(std::move(next));
+        buffered_max_us = max(buffered_max_us, duration<double, micro>(steady_clock::now() - start).count());
+        EXPECT_TRUE(buffered.get(i).has_value());
+    }
+
+    cout << "[ReaderPauseDuringRebuilds] " << Rebuilds << " rebuilds of " << N
+         << " entries, max reader pause - swap under lock: " << locked_max_us << " us, double-buffered publish: "
+         << buffered_max_us << " us\n";
+}
+
+// Объединение двух независимо загруженных половин по 500 тыс. записей со значениями по 64+ байт:
+// копирование и set каждой записи с разрушением источника против mergeFrom
+TEST(KVStorageMergePerfTest, MergePartitions) {
+    const int N = 500'000;
+    MockClock clock;
+    using Storage = KVStorage<MockClock, string, string, KVPolicies<MapIndexPolicy<>, QueueExpiry>>;
+
+    // Ключи половин чередуются: слияние проходит по всему целевому индексу
+    auto load = [&](int part) {
+        auto storage = make_unique<Storage>(span<tuple<string, string, uint32_t>>{}, clock);
+        for (int i = part; i < 2 * N; i += 2) {
+            storage->set("key" + to_string(i), string(64, 'v') + to_string(i), i % 3 == 0 ? 60 : 0);
+        }
+        return storage;
+    };
+
+    auto target = load(0);
+    auto source = load(1);
+    auto start = steady_clock::now();
+    for (auto& [key, value] : source->getManySortedWithTtl("", 2 * N)) {
+        target->set(key, value.value, value.ttl ? duration_cast<seconds>(*value.ttl).count() : 0);
+    }
+    source.reset();
+    const double set_ms = duration<double, milli>(steady_clock::now() - start).count();
+
+    target = load(0);
+    source = load(1);
+    start = steady_clock::now();
+    EXPECT_EQ(target->mergeFrom(std::move(*source), MergeConflict::kNewestExpiry), static_cast<size_t>(N));
+    source.reset();
+    const double merge_ms = duration<double, milli>(steady_clock::now() - start).count();
+    EXPECT_EQ(target->get("key1"), string(64, 'v') + "1");
+
+    cout << "[MergePartitions] 2 x " << N << " entries - copy and set: " << set_ms << " ms, mergeFrom: " << merge_ms
+         << " ms\n";
+}
+
+// Сравнение двух реплик по миллиону записей, различающихся в 10 ключах: совместный проход по индексам против
+// пропуска совпадающих диапазонов по сводке MerkleDigest
+TEST(KVStorageDiffPerfTest, DiffMillionEntryReplicas) {
+    const int N = 1'000'000;
+    MockClock clock;
+
+    auto run = [&](auto tag) {
+        using Storage = typename decltype(tag)::type;
+        Storage first(span<tuple<string, string, uint32_t>>{}, clock);
+        Storage second(span<tuple<string, string, uint32_t>>{}, clock);
+
+        auto start = steady_clock::now();
+        for (int i = 0; i < N; ++i) {
+            first.set("key" + to_string(i), "value" + to_string(i), 0);
+        }
+        const double load_ms = duration<double, milli>(steady_clock::now() - start).count();
+
+        for (int i = 0; i < N; ++i) {
+            second.set("key" + to_string(i), "value" + to_string(i), 0);
+        }
+        for (int i = 0; i < 10; ++i) {
+            second.set("key" + to_string(i * 99'991), "changed", 0);
+        }
+
+        start = steady_clock::now();
+        auto diff = first.diff(second);
+        const double diff_ms = duration<double, milli>(steady_clock::now() - start).count();
+        EXPECT_EQ(diff.changed.size(), 10U);
+
+        return make_pair(load_ms, diff_ms);
+    };
+
+    auto [plain_load, plain_diff] =
+        run(type_identity<KVStorage<MockClock, string, string, KVPolicies<MapIndexPolicy<>>>>{});
+    auto [digest_load, digest_diff] = run(type_identity<KVStorage<
+        MockClock, string, string,
+        KVPolicies<MapIndexPolicy<>, ScanExpiry, NoLock, NoStats, NoFilter, NoTiering, NoHotKeys, FreeInPlace,
+                   MerkleDigest<>>>>{});
+
+    cout << "[DiffMillionEntryReplicas] 1M entries, 10 changed - lockstep walk: " << plain_diff
+         << " ms, MerkleDigest: " << digest_diff << " ms; load " << plain_load << " ms vs " << digest_load
+         << " ms with digest\n";
+}
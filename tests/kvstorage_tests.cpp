@@ -1,7 +1,21 @@
+#include <array>
+#include <atomic>
+#include <limits>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <thread>
 #include <vector>
 
 #include "gtest/gtest.h"
+#include "crc32c.hpp"
+#include "key_order.hpp"
 #include "kvstorage.hpp"
+#include "double_buffered_kvstorage.hpp"
+#include "sharded_kvstorage.hpp"
+#include "tsc_clock.hpp"
+#include "write_behind.hpp"
 
 using namespace std;
 using namespace chrono;
@@ -12,12 +26,15 @@ public:
 
     time_point now() const { return current_time_; }
 
-    void advance(seconds sec) { current_time_ += sec; }
+    void advance(time_point::duration delta) { current_time_ += delta; }
 
 private:
     time_point current_time_ = steady_clock::now();
 };
 
+static_assert(StorageClock<MockClock>);
+static_assert(!StorageClock<int>);
+
 class KVStorageTest : public testing::Test {
 protected:
     void SetUp() override { storage = make_unique<Storage>(span<tuple<string, string, uint32_t>>{}, clock); }
@@ -224,3 +241,1819 @@ TEST_F(KVStorageTest, SortedRangeQuery) {
     EXPECT_EQ(result[0].first, "m");
     EXPECT_EQ(result[4].first, "q");
 }
+
+class CollectingListener : public ExpiryListener<> {
+public:
+    void onExpired(vector<pair<string, string>>&& batch) override {
+        ++batches;
+        for (auto& entry : batch) {
+            expired.push_back(std::move(entry));
+        }
+    }
+
+    int batches = 0;
+    vector<pair<string, string>> expired;
+};
+
+TEST_F(KVStorageTest, RemoveExpiredEntriesNotifiesListenerInBatch) {
+    CollectingListener listener;
+    storage->setExpiryListener(&listener);
+
+    storage->set("a", "val_a", 1);
+    storage->set("b", "val_b", 10);
+    storage->set("c", "val_c", 1);
+    storage->set("d", "val_d", 0);
+
+    clock.advance(2s);
+
+    EXPECT_EQ(storage->removeExpiredEntries(100), 2);
+    EXPECT_EQ(listener.batches, 1);
+
+    vector<pair<string, string>> expected = {{"a", "val_a"}, {"c", "val_c"}};
+    EXPECT_EQ(listener.expired, expected);
+
+    EXPECT_FALSE(storage->get("a").has_value());
+    EXPECT_TRUE(storage->get("b").has_value());
+    EXPECT_TRUE(storage->get("d").has_value());
+
+    EXPECT_EQ(storage->removeExpiredEntries(100), 0);
+    EXPECT_EQ(listener.batches, 1);
+}
+
+TEST_F(KVStorageTest, RemoveExpiredEntriesRespectsMaxCount) {
+    CollectingListener listener;
+    storage->setExpiryListener(&listener);
+
+    for (int i = 0; i < 10; ++i) {
+        storage->set("k" + to_string(i), "v" + to_string(i), 1);
+    }
+
+    clock.advance(2s);
+
+    EXPECT_EQ(storage->removeExpiredEntries(4), 4);
+    EXPECT_EQ(storage->removeExpiredEntries(4), 4);
+    EXPECT_EQ(storage->removeExpiredEntries(4), 2);
+    EXPECT_EQ(listener.batches, 3);
+    EXPECT_EQ(listener.expired.size(), 10);
+    EXPECT_TRUE(storage->getManySorted("", 100).empty());
+}
+
+TEST_F(KVStorageTest, RemoveExpiredEntriesWithoutListener) {
+    storage->set("a", "val_a", 1);
+    clock.advance(2s);
+
+    EXPECT_EQ(storage->removeExpiredEntries(10), 1);
+    EXPECT_FALSE(storage->removeOneExpiredEntry().has_value());
+}
+
+TEST_F(KVStorageTest, GetWithTtl) {
+    storage->set("key1", "value1", 10);
+    storage->set("key2", "value2", 0);
+
+    clock.advance(3s);
+
+    auto val = storage->getWithTtl("key1");
+    ASSERT_TRUE(val.has_value());
+    EXPECT_EQ(val->value, "value1");
+    ASSERT_TRUE(val->ttl.has_value());
+    EXPECT_EQ(duration_cast<seconds>(*val->ttl), 7s);
+
+    val = storage->getWithTtl("key2");
+    ASSERT_TRUE(val.has_value());
+    EXPECT_EQ(val->value, "value2");
+    EXPECT_FALSE(val->ttl.has_value());
+
+    clock.advance(10s);
+    EXPECT_FALSE(storage->getWithTtl("key1").has_value());
+    EXPECT_FALSE(storage->getWithTtl("missing").has_value());
+}
+
+TEST_F(KVStorageTest, GetManySortedWithTtl) {
+    storage->set("a", "val_a", 5);
+    storage->set("b", "val_b", 20);
+    storage->set("c", "val_c", 0);
+    storage->set("d", "val_d", 30);
+
+    clock.advance(10s);
+
+    auto result = storage->getManySortedWithTtl("", 2);
+    ASSERT_EQ(result.size(), 2);
+    EXPECT_EQ(result[0].first, "b");
+    EXPECT_EQ(result[0].second.value, "val_b");
+    EXPECT_EQ(result[0].second.ttl, MockClock::time_point::duration(10s));
+    EXPECT_EQ(result[1].first, "c");
+    EXPECT_EQ(result[1].second.value, "val_c");
+    EXPECT_FALSE(result[1].second.ttl.has_value());
+
+    EXPECT_TRUE(storage->getManySortedWithTtl("a", 0).empty());
+}
+
+TEST_F(KVStorageTest, TtlJitterSpreadsExpiry) {
+    ExpiryOptions options;
+    options.ttl_jitter_percent = 50;
+
+    vector<tuple<string, string, uint32_t>> entries;
+    for (int i = 0; i < 1000; ++i) {
+        entries.emplace_back("key" + to_string(i), "val", 100);
+    }
+
+    KVStorage<MockClock> jittered(entries, clock, options);
+
+    // Все записи живут не дольше запрошенного ttl и не меньше половины от него
+    clock.advance(49s);
+    EXPECT_EQ(jittered.getManySorted("", 2000).size(), 1000);
+
+    clock.advance(26s);
+    const auto alive = jittered.getManySorted("", 2000).size();
+    EXPECT_GT(alive, 0);
+    EXPECT_LT(alive, 1000);
+
+    clock.advance(25s);
+    EXPECT_TRUE(jittered.getManySorted("", 2000).empty());
+}
+
+// Часы с тиком в секунду
+class SecondsClock {
+public:
+    using time_point = chrono::time_point<steady_clock, seconds>;
+
+    time_point now() const { return current_time_; }
+
+    void advance(seconds sec) { current_time_ += sec; }
+
+private:
+    time_point current_time_{1000s};
+};
+
+static_assert(StorageClock<SecondsClock>);
+
+TEST(TtlJitterTest, SpreadsExpiryWithSecondsClock) {
+    SecondsClock clock;
+    ExpiryOptions options;
+    options.ttl_jitter_percent = 50;
+
+    vector<tuple<string, string, uint32_t>> entries;
+    for (int i = 0; i < 1000; ++i) {
+        entries.emplace_back("key" + to_string(i), "val", 10);
+    }
+
+    KVStorage<SecondsClock> jittered(entries, clock, options);
+
+    // ttl 10 с и 50%: время жизни от 5 до 10 с
+    clock.advance(4s);
+    EXPECT_EQ(jittered.getManySorted("", 2000).size(), 1000);
+
+    clock.advance(3s);
+    const auto alive = jittered.getManySorted("", 2000).size();
+    EXPECT_GT(alive, 0);
+    EXPECT_LT(alive, 1000);
+
+    clock.advance(3s);
+    EXPECT_TRUE(jittered.getManySorted("", 2000).empty());
+}
+
+TEST_F(KVStorageTest, TtlJitterKeepsInfiniteTtl) {
+    ExpiryOptions options;
+    options.ttl_jitter_percent = 100;
+
+    KVStorage<MockClock> jittered(span<tuple<string, string, uint32_t>>{}, clock, options);
+    jittered.set("key", "value", 0);
+
+    clock.advance(1000h);
+    auto val = jittered.getWithTtl("key");
+    ASSERT_TRUE(val.has_value());
+    EXPECT_FALSE(val->ttl.has_value());
+}
+
+TEST_F(KVStorageTest, ReclaimWindowSpreadsRemoval) {
+    ExpiryOptions options;
+    options.reclaim_window = 10s;
+
+    KVStorage<MockClock> leveled(span<tuple<string, string, uint32_t>>{}, clock, options);
+
+    const int N = 1000;
+    for (int i = 0; i < N; ++i) {
+        leveled.set("key" + to_string(i), "val", 1);
+    }
+
+    clock.advance(1s);
+
+    // Записи уже недоступны, но удаляются постепенно в течение окна
+    EXPECT_TRUE(leveled.getManySorted("", N).empty());
+
+    size_t removed = 0;
+    for (int step = 0; step < 10; ++step) {
+        clock.advance(1s);
+        const size_t now_removed = leveled.removeExpiredEntries(N);
+        EXPECT_LT(now_removed, N / 2);
+        removed += now_removed;
+    }
+
+    removed += leveled.removeExpiredEntries(N);
+    EXPECT_EQ(removed, N);
+}
+
+TEST_F(KVStorageTest, ExpiryStats) {
+    using TrackedStorage = KVStorage<MockClock, string, string, KVPolicies<AutoIndexPolicy, ScanExpiry, NoLock, CollectStats>>;
+    TrackedStorage tracked(span<tuple<string, string, uint32_t>>{}, clock);
+
+    tracked.set("a", "val", 1);
+    tracked.set("b", "val", 1);
+    tracked.set("c", "val", 3);
+    tracked.set("d", "val", 100);
+    tracked.set("e", "val", 0);
+    tracked.set("e", "val", 0);
+    tracked.set("f", "val", 100);
+    EXPECT_TRUE(tracked.remove("f"));
+
+    auto stats = tracked.expiryStats();
+    EXPECT_EQ(stats.sets, 7);
+    EXPECT_EQ(stats.removes, 1);
+    EXPECT_EQ(stats.infinite_entries, 1);
+    EXPECT_EQ(stats.expired_not_reclaimed, 0);
+
+    uint64_t finite = 0;
+    for (auto count : stats.remaining_ttl_histogram) {
+        finite += count;
+    }
+    EXPECT_EQ(finite, 4);
+
+    clock.advance(5s);
+
+    stats = tracked.expiryStats();
+    EXPECT_EQ(stats.expired_not_reclaimed, 3);
+    EXPECT_GE(stats.oldest_unreclaimed_lag, 3s);
+    EXPECT_LE(stats.oldest_unreclaimed_lag, 4s);
+
+    EXPECT_EQ(tracked.removeExpiredEntries(10), 3);
+
+    stats = tracked.expiryStats();
+    EXPECT_EQ(stats.expired_not_reclaimed, 0);
+    EXPECT_EQ(stats.reclaimed, 3);
+    EXPECT_EQ(stats.max_reclaim_lag, MockClock::time_point::duration(4s));
+    EXPECT_EQ(stats.remaining_ttl_histogram[7], 1); // 95 секунд: (64, 128]
+}
+
+TEST_F(KVStorageTest, ExpiryStatsSubsecondClock) {
+    using TrackedStorage = KVStorage<MockClock, string, string, KVPolicies<AutoIndexPolicy, ScanExpiry, NoLock, CollectStats>>;
+    TrackedStorage tracked(span<tuple<string, string, uint32_t>>{}, clock);
+
+    // Часы стоят на 900 мс после начала секунды
+    const auto offset = clock.now().time_since_epoch();
+    clock.advance(ceil<seconds>(offset) - offset + 900ms);
+
+    tracked.set("a", "val", 1);
+    clock.advance(200ms);
+
+    ASSERT_TRUE(tracked.get("a").has_value());
+    auto stats = tracked.expiryStats();
+    EXPECT_EQ(stats.expired_not_reclaimed, 0);
+    EXPECT_EQ(stats.oldest_unreclaimed_lag, MockClock::time_point::duration::zero());
+    EXPECT_EQ(stats.remaining_ttl_histogram[0], 1);
+
+    clock.advance(900ms);
+
+    EXPECT_FALSE(tracked.get("a").has_value());
+    stats = tracked.expiryStats();
+    EXPECT_EQ(stats.expired_not_reclaimed, 1);
+    EXPECT_EQ(stats.oldest_unreclaimed_lag, MockClock::time_point::duration::zero());
+}
+
+template <typename Storage>
+concept HasExpiryStats = requires(Storage& storage) { storage.expiryStats(); };
+
+// Без политики CollectStats телеметрия не компилируется вовсе
+static_assert(!HasExpiryStats<KVStorage<MockClock>>);
+
+TEST(TscClockTest, MonotonicAndCalibrated) {
+    // Первое обращение калибрует часы
+    TscClock::now();
+
+    auto steady_start = steady_clock::now();
+    auto tsc_start = TscClock::now();
+
+    TscClock::time_point prev = tsc_start;
+    for (int i = 0; i < 1000; ++i) {
+        auto current = TscClock::now();
+        EXPECT_GE(current, prev);
+        prev = current;
+    }
+
+    this_thread::sleep_for(20ms);
+
+    auto tsc_elapsed = TscClock::now() - tsc_start;
+    auto steady_elapsed = steady_clock::now() - steady_start;
+
+    // Калибровка по steady_clock: расхождение за 20 мс не больше пары миллисекунд
+    EXPECT_NEAR(duration_cast<microseconds>(tsc_elapsed).count(), duration_cast<microseconds>(steady_elapsed).count(),
+                2000);
+
+    if (TscClock::usesTsc()) {
+        EXPECT_GT(TscClock::ticksPerSecond(), 0.0);
+    }
+}
+
+TEST(TscClockTest, DrivesStorage) {
+    TscClock clock;
+    KVStorage<TscClock> storage(span<tuple<string, string, uint32_t>>{}, clock);
+
+    storage.set("key", "value", 10);
+    auto val = storage.getWithTtl("key");
+    ASSERT_TRUE(val.has_value());
+    ASSERT_TRUE(val->ttl.has_value());
+    EXPECT_LE(*val->ttl, 10s);
+    EXPECT_GT(*val->ttl, 9s);
+}
+
+struct Payload {
+    uint64_t id = 0;
+    double score = 0;
+
+    bool operator==(const Payload&) const = default;
+};
+
+TEST_F(KVStorageTest, IntegerKeysAndStructValues) {
+    using IntStorage = KVStorage<MockClock, uint64_t, Payload>;
+    static_assert(is_same_v<IntStorage::KeyView, uint64_t>);
+
+    vector<tuple<uint64_t, Payload, uint32_t>> entries = {
+        {30, {3, 0.3}, 0},
+        {10, {1, 0.1}, 5},
+        {20, {2, 0.2}, 0},
+    };
+
+    IntStorage int_storage(entries, clock);
+    int_storage.set(100, {100, 1.0}, 0);
+    int_storage.set(5, {5, 0.5}, 0);
+
+    auto val = int_storage.get(20);
+    ASSERT_TRUE(val.has_value());
+    EXPECT_EQ(*val, (Payload{2, 0.2}));
+    EXPECT_FALSE(int_storage.get(21).has_value());
+
+    // Порядок числовой, а не лексикографический: 100 после 30
+    auto result = int_storage.getManySorted(10, 10);
+    vector<pair<uint64_t, Payload>> expected = {
+        {10, {1, 0.1}},
+        {20, {2, 0.2}},
+        {30, {3, 0.3}},
+        {100, {100, 1.0}},
+    };
+    EXPECT_EQ(result, expected);
+
+    clock.advance(10s);
+    auto expired = int_storage.removeOneExpiredEntry();
+    ASSERT_TRUE(expired.has_value());
+    EXPECT_EQ(expired->first, 10);
+
+    EXPECT_TRUE(int_storage.remove(5));
+    EXPECT_FALSE(int_storage.remove(5));
+    EXPECT_EQ(int_storage.getManySorted(0, 10).size(), 3);
+}
+
+TEST_F(KVStorageTest, CustomComparatorAndHash) {
+    struct IdentityHash {
+        size_t operator()(uint32_t key) const noexcept { return key; }
+    };
+
+    KVStorage<MockClock, uint32_t, string, KVPolicies<MapIndexPolicy<greater<>, IdentityHash>>> reversed(
+        span<tuple<uint32_t, string, uint32_t>>{}, clock);
+
+    for (uint32_t i = 1; i <= 5; ++i) {
+        reversed.set(i, "v" + to_string(i), 0);
+    }
+
+    auto result = reversed.getManySorted(3, 10);
+    vector<pair<uint32_t, string>> expected = {{3, "v3"}, {2, "v2"}, {1, "v1"}};
+    EXPECT_EQ(result, expected);
+    EXPECT_EQ(reversed.get(4), "v4");
+}
+
+TEST(RadixIndexTest, MatchesStdMap) {
+    RadixIndex<uint64_t, int> index;
+    map<uint64_t, int> reference;
+    mt19937_64 rng(42);
+
+    // Ключи из узкого и широкого диапазонов: и плотные узлы на 256 потомков, и длинные сжатые пути
+    auto random_key = [&]() -> uint64_t {
+        switch (rng() % 3) {
+            case 0:
+                return rng() % 512;
+            case 1:
+                return 0xFFFF'0000'0000'0000ULL + rng() % 4096;
+            default:
+                return rng();
+        }
+    };
+
+    for (int i = 0; i < 20'000; ++i) {
+        const uint64_t key = random_key();
+
+        if (rng() % 3 == 0) {
+            auto extracted = index.extract(key);
+            auto it = reference.find(key);
+            ASSERT_EQ(extracted.has_value(), it != reference.end());
+            if (extracted) {
+                EXPECT_EQ(extracted->first, key);
+                EXPECT_EQ(extracted->second, it->second);
+                reference.erase(it);
+            }
+        } else {
+            int value = i;
+            auto [stored_key, slot, inserted] = index.tryEmplace(uint64_t{key}, std::move(value));
+            auto [it, ref_inserted] = reference.try_emplace(key, i);
+            ASSERT_EQ(inserted, ref_inserted);
+            EXPECT_EQ(*slot, it->second);
+            EXPECT_EQ(stored_key, key);
+        }
+
+        ASSERT_EQ(index.size(), reference.size());
+    }
+
+    for (int i = 0; i < 200; ++i) {
+        const uint64_t from = random_key();
+
+        vector<pair<uint64_t, int>> actual;
+        index.forEachFrom(from, [&](uint64_t key, int value) {
+            actual.emplace_back(key, value);
+            return actual.size() < 50;
+        });
+
+        vector<pair<uint64_t, int>> expected;
+        for (auto it = reference.lower_bound(from); it != reference.end() && expected.size() < 50; ++it) {
+            expected.emplace_back(*it);
+        }
+
+        ASSERT_EQ(actual, expected);
+    }
+
+    for (const auto& [key, value] : reference) {
+        const int* found = index.find(key);
+        ASSERT_NE(found, nullptr);
+        EXPECT_EQ(*found, value);
+    }
+    EXPECT_EQ(index.find(0xDEAD'BEEF'0000'0001ULL), nullptr);
+
+    size_t removed = index.extractIf(reference.size(), [](uint64_t, int value) { return value % 2 == 0; },
+                                     [](uint64_t, int value) { EXPECT_EQ(value % 2, 0); });
+    size_t expected_removed = 0;
+    for (const auto& [key, value] : reference) {
+        expected_removed += value % 2 == 0;
+    }
+    EXPECT_EQ(removed, expected_removed);
+    EXPECT_EQ(index.size(), reference.size() - expected_removed);
+}
+
+// Поиск в узле на 16 потомков по байтам по обе стороны от 0x80 (SIMD-сравнение беззнаковое) и при росте до 256
+TEST(RadixIndexTest, NodeSearchAcrossByteRange) {
+    RadixIndex<uint64_t, int> index;
+    set<uint64_t> reference;
+
+    auto check = [&] {
+        for (uint64_t low = 0; low < 256; ++low) {
+            const uint64_t from = 0xAB00 | low;
+
+            optional<uint64_t> first;
+            index.forEachFrom(from, [&](uint64_t key, int) {
+                first = key;
+                return false;
+            });
+
+            auto it = reference.lower_bound(from);
+            ASSERT_EQ(first, it == reference.end() ? nullopt : optional<uint64_t>(*it)) << "from " << from;
+            ASSERT_EQ(index.find(from) != nullptr, reference.contains(from)) << "key " << from;
+        }
+    };
+
+    for (uint64_t low : {0x00, 0x01, 0x7F, 0x80, 0x81, 0xFE, 0xFF, 0x40, 0xC0, 0x10, 0xF0, 0x55, 0xAA, 0x90, 0x70, 0x08}) {
+        index.tryEmplace(0xAB00 | low, 0);
+        reference.insert(0xAB00 | low);
+        check();
+    }
+
+    for (uint64_t low = 0; low < 256; low += 3) {
+        index.tryEmplace(0xAB00 | low, 0);
+        reference.insert(0xAB00 | low);
+    }
+    check();
+
+    for (uint64_t low = 0; low < 256; low += 2) {
+        index.extract(0xAB00 | low);
+        reference.erase(0xAB00 | low);
+    }
+    check();
+}
+
+template <typename Storage>
+concept HasExpiryApi = requires(Storage& storage) {
+    storage.set("key", "value", 1u);
+    storage.removeOneExpiredEntry();
+    storage.removeExpiredEntries(1);
+    storage.getWithTtl("key");
+};
+
+static_assert(HasExpiryApi<KVStorage<MockClock>>);
+static_assert(!HasExpiryApi<KVStorage<NoTtl>>);
+// Хранилище без TTL не хранит часы, слушателя и настройки разброса TTL
+static_assert(sizeof(KVStorage<NoTtl, uint64_t, uint64_t>) < sizeof(KVStorage<MockClock, uint64_t, uint64_t>));
+
+TEST(KVStorageNoTtlTest, SetGetRemove) {
+    vector<tuple<string, string>> entries = {{"b", "val_b"}, {"a", "val_a"}, {"c", "val_c"}};
+    KVStorage<NoTtl> storage(entries);
+
+    storage.set("d", "val_d");
+    storage.set("a", "val_a2");
+
+    EXPECT_EQ(storage.get("a"), "val_a2");
+    EXPECT_FALSE(storage.get("z").has_value());
+
+    EXPECT_TRUE(storage.remove("b"));
+    EXPECT_FALSE(storage.remove("b"));
+
+    vector<pair<string, string>> expected = {{"a", "val_a2"}, {"c", "val_c"}, {"d", "val_d"}};
+    EXPECT_EQ(storage.getManySorted("", 10), expected);
+}
+
+TEST(KVStorageNoTtlTest, IntegerKeys) {
+    KVStorage<NoTtl, uint64_t, uint64_t> storage(span<tuple<uint64_t, uint64_t>>{});
+
+    for (uint64_t i = 0; i < 1000; ++i) {
+        storage.set(i * 1000, i);
+    }
+
+    EXPECT_EQ(storage.get(5000), 5u);
+    auto result = storage.getManySorted(1500, 2);
+    vector<pair<uint64_t, uint64_t>> expected = {{2000, 2}, {3000, 3}};
+    EXPECT_EQ(result, expected);
+}
+
+// Недопустимые комбинации политик отсекаются static_assert в KVStorage
+static_assert(RadixIndexPolicy::kSupportsKey<uint64_t>);
+static_assert(!RadixIndexPolicy::kSupportsKey<string>);
+static_assert(!RadixIndexPolicy::kSupportsKey<int64_t>);
+static_assert(MapIndexPolicy<>::kSupportsKey<string>);
+static_assert(!MapIndexPolicy<less<string>>::kSupportsKey<string>); // непрозрачный компаратор: поиск по string_view
+static_assert(AutoIndexPolicy::kSupportsKey<string>);
+
+template <typename Policies>
+class KVStoragePoliciesTest : public testing::Test {
+protected:
+    MockClock clock;
+};
+
+using PolicyCombinations = testing::Types<
+    KVPolicies<>,
+    KVPolicies<MapIndexPolicy<>, QueueExpiry>,
+    KVPolicies<MapIndexPolicy<>, PackedExpiry, NoLock, CollectStats>,
+    KVPolicies<RadixIndexPolicy, PackedExpiry>,
+    KVPolicies<AutoIndexPolicy, ScanExpiry, NoLock, NoStats, BloomFilter<>>,
+    KVPolicies<MapIndexPolicy<>, PackedExpiry, SharedMutexLock, CollectStats, BloomFilter<8>>,
+    KVPolicies<RadixIndexPolicy, QueueExpiry, SharedMutexLock, CollectStats>,
+    KVPolicies<MapIndexPolicy<>, QueueExpiry, SharedMutexLock, CollectStats, BloomFilter<>, SpillColdValues<1>>,
+    KVPolicies<RadixIndexPolicy, QueueExpiry, NoLock, NoStats, NoFilter, SpillColdValues<1>, NoHotKeys, FreeInPlace,
+               MerkleDigest<4>>,
+    KVPolicies<AutoIndexPolicy, ScanExpiry, SharedMutexLock>>;
+
+TYPED_TEST_SUITE(KVStoragePoliciesTest, PolicyCombinations);
+
+TYPED_TEST(KVStoragePoliciesTest, SameBehaviourForEveryCombination) {
+    KVStorage<MockClock, uint64_t, string, TypeParam> storage(span<tuple<uint64_t, string, uint32_t>>{}, this->clock);
+
+    for (uint64_t i = 0; i < 100; ++i) {
+        storage.set(i, "v" + to_string(i), i % 2 == 0 ? 1 : 0);
+    }
+    if constexpr (TypeParam::tiering::kEnabled) {
+        storage.spillColdValues(100);
+        EXPECT_EQ(storage.spillColdValues(100), 100);
+    }
+    storage.set(10, "v10", 0); // перезапись переводит запись в бессрочные
+    EXPECT_TRUE(storage.remove(99));
+
+    this->clock.advance(2s);
+
+    EXPECT_EQ(storage.get(10), "v10");
+    EXPECT_FALSE(storage.get(12).has_value());
+    EXPECT_EQ(storage.getManySorted(0, 100).size(), 50);
+
+    auto expired = storage.removeOneExpiredEntry();
+    ASSERT_TRUE(expired.has_value());
+    EXPECT_EQ(expired->first % 2, 0);
+
+    EXPECT_EQ(storage.removeExpiredEntries(100), 48);
+    EXPECT_EQ(storage.removeExpiredEntries(100), 0);
+    EXPECT_FALSE(storage.removeOneExpiredEntry().has_value());
+
+    // Те же записи, вставленные заново, не отличаются
+    KVStorage<MockClock, uint64_t, string, TypeParam> copy(span<tuple<uint64_t, string, uint32_t>>{}, this->clock);
+    for (auto& [key, value] : storage.getManySorted(0, 100)) {
+        copy.set(key, value, 0);
+    }
+    EXPECT_TRUE(storage.diff(copy).empty());
+    copy.set(1'000, "new", 0);
+    EXPECT_EQ(storage.diff(copy).added, vector<uint64_t>{1'000});
+
+    storage.clear();
+    EXPECT_FALSE(storage.get(10).has_value());
+    EXPECT_TRUE(storage.getManySorted(0, 100).empty());
+    storage.set(5, "v5", 1);
+    EXPECT_EQ(storage.get(5), "v5");
+    this->clock.advance(2s);
+    EXPECT_EQ(storage.removeExpiredEntries(100), 1);
+}
+
+TEST_F(KVStorageTest, QueueExpiryReclaimsInExpiryOrder) {
+    KVStorage<MockClock, string, string, KVPolicies<AutoIndexPolicy, QueueExpiry>> queued(
+        span<tuple<string, string, uint32_t>>{}, clock);
+
+    queued.set("a", "val_a", 3);
+    queued.set("b", "val_b", 1);
+    queued.set("c", "val_c", 2);
+    queued.set("d", "val_d", 0);
+    queued.set("c", "val_c2", 10);
+
+    CollectingListener listener;
+    queued.setExpiryListener(&listener);
+
+    clock.advance(5s);
+    EXPECT_EQ(queued.removeExpiredEntries(10), 2);
+
+    vector<pair<string, string>> expected = {{"b", "val_b"}, {"a", "val_a"}};
+    EXPECT_EQ(listener.expired, expected);
+    EXPECT_EQ(queued.get("c"), "val_c2");
+
+    clock.advance(10s);
+    auto expired = queued.removeOneExpiredEntry();
+    ASSERT_TRUE(expired.has_value());
+    EXPECT_EQ(expired->first, "c");
+    EXPECT_FALSE(queued.removeOneExpiredEntry().has_value());
+}
+
+template <typename Expiry>
+void ExpectReclaimWindowRespected(MockClock& clock) {
+    ExpiryOptions options;
+    options.reclaim_window = 10s;
+
+    KVStorage<MockClock, string, string, KVPolicies<AutoIndexPolicy, Expiry>> queued(
+        span<tuple<string, string, uint32_t>>{}, clock, options);
+
+    const int N = 200;
+    for (int i = 0; i < N; ++i) {
+        queued.set("key" + to_string(i), "val", 1);
+    }
+
+    clock.advance(1s);
+
+    // removeOneExpiredEntry не ждёт окна выравнивания
+    EXPECT_TRUE(queued.removeOneExpiredEntry().has_value());
+
+    size_t removed = 1;
+    for (int step = 0; step < 11; ++step) {
+        clock.advance(1s);
+        removed += queued.removeExpiredEntries(N);
+    }
+    EXPECT_EQ(removed, N);
+}
+
+TEST_F(KVStorageTest, ReclaimWindowWithQueueAndPackedExpiry) {
+    ExpectReclaimWindowRespected<QueueExpiry>(clock);
+    ExpectReclaimWindowRespected<PackedExpiry>(clock);
+}
+
+TEST(ExpiredScannerTest, MatchesScalarScan) {
+    mt19937_64 rng(7);
+    vector<int64_t> ticks(1003);
+    for (auto& tick : ticks) {
+        tick = static_cast<int64_t>(rng() % 2000) - 1000;
+    }
+    ticks[0] = numeric_limits<int64_t>::min();
+    ticks[1] = numeric_limits<int64_t>::max();
+
+    for (int64_t now : {numeric_limits<int64_t>::min(), int64_t{-1}, int64_t{0}, int64_t{500}, numeric_limits<int64_t>::max()}) {
+        for (size_t max_count : {size_t{1}, size_t{13}, ticks.size()}) {
+            vector<uint32_t> expected;
+            for (size_t i = 0; i < ticks.size() && expected.size() < max_count; ++i) {
+                if (ticks[i] <= now) {
+                    expected.push_back(static_cast<uint32_t>(i));
+                }
+            }
+
+            vector<uint32_t> actual;
+            ExpiredScanner::find(ticks.data(), ticks.size(), now, max_count, actual);
+            EXPECT_EQ(actual, expected) << "now " << now << ", max_count " << max_count;
+        }
+    }
+}
+
+TEST(KVStorageConcurrencyTest, SharedMutexLockReadersAndWriters) {
+    MockClock clock;
+    KVStorage<MockClock, uint64_t, uint64_t, KVPolicies<AutoIndexPolicy, ScanExpiry, SharedMutexLock>> storage(
+        span<tuple<uint64_t, uint64_t, uint32_t>>{}, clock);
+
+    const uint64_t N = 10'000;
+    vector<thread> threads;
+
+    for (uint64_t t = 0; t < 2; ++t) {
+        threads.emplace_back([&, t] {
+            for (uint64_t i = t; i < N; i += 2) {
+                storage.set(i, i * 10, 0);
+            }
+        });
+    }
+
+    atomic<uint64_t> mismatches = 0;
+    for (int t = 0; t < 2; ++t) {
+        threads.emplace_back([&] {
+            for (uint64_t i = 0; i < N; ++i) {
+                if (auto val = storage.get(i); val && *val != i * 10) {
+                    ++mismatches;
+                }
+                storage.getManySorted(i, 4);
+            }
+        });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(mismatches, 0);
+    EXPECT_EQ(storage.getManySorted(0, N + 1).size(), N);
+}
+
+TEST(KeyOrderTest, NaturalLess) {
+    NaturalLess less;
+
+    EXPECT_TRUE(less("key2", "key10"));
+    EXPECT_FALSE(less("key10", "key2"));
+    EXPECT_TRUE(less("key10", "key10a"));
+    EXPECT_TRUE(less("key9a", "key10"));
+    EXPECT_TRUE(less("a", "a1"));
+    EXPECT_TRUE(less("a1b", "ab"));
+    EXPECT_TRUE(less("v99999999999999999999999", "v100000000000000000000000"));
+
+    // Равные как числа ключи различаются побайтово: эквивалентность совпадает с равенством строк
+    EXPECT_TRUE(less("key01", "key1"));
+    EXPECT_FALSE(less("key1", "key01"));
+    EXPECT_FALSE(less("key1", "key1"));
+}
+
+TEST(KeyOrderTest, CaseInsensitiveHashMatchesEquality) {
+    EXPECT_TRUE(CaseInsensitiveEqual{}("Hello", "hELLO"));
+    EXPECT_FALSE(CaseInsensitiveEqual{}("Hello", "Hell"));
+    EXPECT_EQ(CaseInsensitiveHash{}("Hello"), CaseInsensitiveHash{}("hELLO"));
+    EXPECT_FALSE(CaseInsensitiveLess{}("b", "A"));
+    EXPECT_TRUE(CaseInsensitiveLess{}("a", "B"));
+}
+
+TEST_F(KVStorageTest, CaseInsensitiveKeys) {
+    KVStorage<MockClock, string, string, KVPolicies<CaseInsensitiveIndexPolicy>> storage(
+        span<tuple<string, string, uint32_t>>{}, clock);
+
+    storage.set("banana", "val_b", 0);
+    storage.set("Apple", "val_a", 0);
+    storage.set("cherry", "val_c", 0);
+    storage.set("APPLE", "val_a2", 0);
+
+    EXPECT_EQ(storage.get("apple"), "val_a2");
+    EXPECT_EQ(storage.get("BANANA"), "val_b");
+
+    // Перезапись сохраняет ключ в исходном написании
+    vector<pair<string, string>> expected = {{"Apple", "val_a2"}, {"banana", "val_b"}, {"cherry", "val_c"}};
+    EXPECT_EQ(storage.getManySorted("a", 10), expected);
+
+    expected = {{"banana", "val_b"}, {"cherry", "val_c"}};
+    EXPECT_EQ(storage.getManySorted("B", 10), expected);
+
+    EXPECT_TRUE(storage.remove("CHERRY"));
+    EXPECT_FALSE(storage.get("cherry").has_value());
+}
+
+TEST_F(KVStorageTest, NaturalOrderKeys) {
+    KVStorage<MockClock, string, string, KVPolicies<NaturalOrderIndexPolicy>> storage(
+        span<tuple<string, string, uint32_t>>{}, clock);
+
+    for (const char* key : {"item10", "item2", "item1", "item20", "item3"}) {
+        storage.set(key, "val", 0);
+    }
+
+    auto sorted = storage.getManySorted("item2", 3);
+    ASSERT_EQ(sorted.size(), 3);
+    EXPECT_EQ(sorted[0].first, "item2");
+    EXPECT_EQ(sorted[1].first, "item3");
+    EXPECT_EQ(sorted[2].first, "item10");
+}
+
+TEST(StringHashTest, DeterministicAndSeeded) {
+    EXPECT_EQ(StringHash{}("key"), StringHash{}(string("key")));
+    EXPECT_NE(StringHash{}("key"), StringHash{}("kez"));
+    EXPECT_NE(StringHash{1}("key"), StringHash{2}("key"));
+    EXPECT_EQ(SeededStringHash{}("key"), SeededStringHash{}("key"));
+    EXPECT_EQ(SeededStringHash{}("key"), StringHash{SeededStringHash::processSeed()}("key"));
+}
+
+// Все ветви по длине (0..3, 4..16, 17..47, от 48) читают ровно len байт и зависят от каждого байта
+TEST(StringHashTest, EveryByteAffectsHashForAllLengths) {
+    for (size_t len = 0; len <= 200; ++len) {
+        // Буфер ровно нужной длины: выход за его границы поймает AddressSanitizer
+        auto buffer = make_unique<char[]>(len + 1);
+        for (size_t i = 0; i < len; ++i) {
+            buffer[i] = static_cast<char>('a' + i % 26);
+        }
+
+        const uint64_t base = StringHash::hash(buffer.get(), len, 0);
+        EXPECT_NE(base, StringHash::hash(buffer.get(), len + 1, 0)) << "len " << len;
+
+        for (size_t i = 0; i < len; ++i) {
+            buffer[i] ^= 1;
+            ASSERT_NE(base, StringHash::hash(buffer.get(), len, 0)) << "len " << len << ", byte " << i;
+            buffer[i] ^= 1;
+        }
+    }
+}
+
+TEST(StringHashTest, NoCollisionsOnSimilarKeys) {
+    set<size_t> hashes;
+    for (int i = 0; i < 100'000; ++i) {
+        hashes.insert(StringHash{}("user:" + to_string(i)));
+    }
+    EXPECT_EQ(hashes.size(), 100'000);
+}
+
+TEST(BloomFilterTest, NoFalseNegativesAndLowFalsePositiveRate) {
+    const size_t N = 100'000;
+    BlockedBloomFilter filter(N, 10);
+
+    for (size_t i = 0; i < N; ++i) {
+        filter.add(StringHash{}("present" + to_string(i)));
+    }
+    for (size_t i = 0; i < N; ++i) {
+        ASSERT_TRUE(filter.mayContain(StringHash{}("present" + to_string(i))));
+    }
+
+    size_t false_positives = 0;
+    for (size_t i = 0; i < N; ++i) {
+        false_positives += filter.mayContain(StringHash{}("absent" + to_string(i)));
+    }
+    EXPECT_LT(false_positives, N / 50);
+}
+
+// Перестроения фильтра при росте и удалениях не теряют ключи
+TEST_F(KVStorageTest, BloomFilterSurvivesChurn) {
+    KVStorage<MockClock, string, int, KVPolicies<AutoIndexPolicy, ScanExpiry, NoLock, NoStats, BloomFilter<>>> storage(
+        span<tuple<string, int, uint32_t>>{}, clock);
+    map<string, int> reference;
+    mt19937 rng(3);
+
+    for (int i = 0; i < 50'000; ++i) {
+        const string key = "key" + to_string(rng() % 5'000);
+
+        if (rng() % 2 == 0) {
+            storage.set(key, i, 0);
+            reference[key] = i;
+        } else {
+            EXPECT_EQ(storage.remove(key), reference.erase(key) == 1);
+        }
+
+        if (i % 1'000 == 0) {
+            for (const auto& [ref_key, value] : reference) {
+                ASSERT_EQ(storage.get(ref_key), value) << ref_key;
+            }
+        }
+    }
+
+    for (int i = 0; i < 5'000; ++i) {
+        const string key = "key" + to_string(i);
+        ASSERT_EQ(storage.get(key).has_value(), reference.contains(key));
+    }
+
+    // Протухшие записи тоже учитываются как удалённые из фильтра
+    for (int i = 0; i < 3'000; ++i) {
+        storage.set("ttl" + to_string(i), i, 1);
+    }
+    clock.advance(2s);
+    EXPECT_EQ(storage.removeExpiredEntries(10'000), 3'000);
+    EXPECT_FALSE(storage.get("ttl0").has_value());
+    EXPECT_EQ(storage.getManySorted("", 100'000).size(), reference.size());
+}
+
+// remove по ключу в другом регистре снимает запись с учёта механизма удаления протухших
+TEST_F(KVStorageTest, CaseInsensitiveRemoveWithOrderedExpiry) {
+    KVStorage<MockClock, string, string, KVPolicies<CaseInsensitiveIndexPolicy, QueueExpiry>> queued(
+        span<tuple<string, string, uint32_t>>{}, clock);
+    KVStorage<MockClock, string, string, KVPolicies<CaseInsensitiveIndexPolicy, PackedExpiry>> packed(
+        span<tuple<string, string, uint32_t>>{}, clock);
+
+    queued.set("Key", "val", 1);
+    packed.set("Key", "val", 1);
+    EXPECT_TRUE(queued.remove("KEY"));
+    EXPECT_TRUE(packed.remove("KEY"));
+
+    clock.advance(2s);
+    EXPECT_EQ(queued.removeExpiredEntries(10), 0);
+    EXPECT_EQ(packed.removeExpiredEntries(10), 0);
+}
+
+// Контрольные значения из RFC 3720 (iSCSI), B.4
+TEST(Crc32cTest, KnownVectors) {
+    array<unsigned char, 32> data{};
+    EXPECT_EQ(Crc32c::compute(data.data(), data.size()), 0x8A9136AAU);
+
+    data.fill(0xFF);
+    EXPECT_EQ(Crc32c::compute(data.data(), data.size()), 0x62A8AB43U);
+
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<unsigned char>(i);
+    }
+    EXPECT_EQ(Crc32c::compute(data.data(), data.size()), 0x46DD794EU);
+
+    EXPECT_EQ(Crc32c::compute("123456789"), 0xE3069283U);
+    EXPECT_EQ(Crc32c::compute(""), 0U);
+}
+
+TEST(Crc32cTest, HardwareMatchesSoftwareAndExtends) {
+    mt19937 rng(5);
+    string data(1'000, '\0');
+    for (auto& c : data) {
+        c = static_cast<char>(rng());
+    }
+
+    // Разные длины и смещения: невыровненные начало и хвост
+    for (size_t offset = 0; offset < 9; ++offset) {
+        for (size_t len = 0; len + offset <= data.size(); len += 37) {
+            const string_view chunk = string_view(data).substr(offset, len);
+            const uint32_t expected = Crc32c::extendSoftware(0, chunk.data(), chunk.size());
+            ASSERT_EQ(Crc32c::compute(chunk), expected) << "offset " << offset << ", len " << len;
+
+            const size_t split = len / 3;
+            ASSERT_EQ(Crc32c::extend(Crc32c::compute(chunk.substr(0, split)), chunk.substr(split)), expected);
+        }
+    }
+}
+
+TEST(NumaTest, TopologyAndBinding) {
+    ASSERT_GE(Numa::nodeCount(), 1U);
+    EXPECT_LT(Numa::currentNode(), Numa::nodeCount());
+    EXPECT_FALSE(Numa::cpusOfNode(0).empty());
+
+    // Привязка может быть запрещена окружением: проверяется только, что память остаётся рабочей
+    const size_t page = Numa::pageSize();
+    void* memory = ::operator new(page, align_val_t{page});
+    Numa::bindMemory(memory, page, 0);
+    static_cast<char*>(memory)[0] = 1;
+    ::operator delete(memory, page, align_val_t{page});
+}
+
+TEST_F(KVStorageTest, ShardedMatchesSingleStorage) {
+    vector<tuple<string, string, uint32_t>> entries;
+    for (int i = 0; i < 200; ++i) {
+        entries.emplace_back("key" + to_string(i), "value" + to_string(i), i % 3 == 0 ? 10 : 0);
+    }
+
+    ShardedKVStorage<MockClock> sharded(entries, clock, {.shards_per_node = 3, .workers_per_node = 2});
+    storage = make_unique<Storage>(entries, clock);
+    EXPECT_EQ(sharded.shardCount(), sharded.nodeCount() * 3);
+
+    sharded.set("key5", "updated", 0);
+    storage->set("key5", "updated", 0);
+    EXPECT_TRUE(sharded.remove("key7"));
+    EXPECT_FALSE(sharded.remove("key7"));
+    storage->remove("key7");
+
+    for (int i = 0; i < 200; ++i) {
+        const string key = "key" + to_string(i);
+        EXPECT_EQ(sharded.get(key), storage->get(key)) << key;
+        EXPECT_LT(sharded.nodeOf(key), sharded.nodeCount());
+    }
+    EXPECT_EQ(sharded.getManySorted("key1", 50), storage->getManySorted("key1", 50));
+    EXPECT_EQ(sharded.getManySorted("", 500), storage->getManySorted("", 500));
+
+    clock.advance(11s);
+    EXPECT_TRUE(sharded.removeOneExpiredEntry().has_value());
+    EXPECT_EQ(sharded.removeExpiredEntries(1'000), 66U);
+    EXPECT_FALSE(sharded.removeOneExpiredEntry().has_value());
+    EXPECT_EQ(sharded.getManySorted("", 500).size(), 199U - 67U);
+
+    sharded.clear();
+    EXPECT_TRUE(sharded.getManySorted("", 500).empty());
+}
+
+TEST_F(KVStorageTest, ShardedExecuteRunsOnOwningNode) {
+    ShardedKVStorage<MockClock> sharded(span<tuple<string, string, uint32_t>>{}, clock);
+
+    vector<future<void>> writes;
+    for (int i = 0; i < 100; ++i) {
+        const string key = "key" + to_string(i);
+        writes.push_back(sharded.execute(key, [key](auto& shard) { shard.set(key, key, 0); }));
+    }
+    for (auto& write : writes) {
+        write.get();
+    }
+
+    auto value = sharded.execute("key42", [](auto& shard) { return shard.get("key42"); }).get();
+    EXPECT_EQ(value, "key42");
+    EXPECT_EQ(sharded.getManySorted("", 200).size(), 100U);
+
+    // get/set с потока узла выполняются сразу, для ключей другого узла - передаются его потокам
+    EXPECT_EQ(sharded.execute("key1", [&](auto&) { return sharded.get("key2"); }).get(), "key2");
+    sharded.execute("key3", [&](auto&) { sharded.set("key3", "updated", 0); }).get();
+    EXPECT_EQ(sharded.get("key3"), "updated");
+
+    // С несколькими узлами задачи выполняются потоками узла-владельца
+    if (sharded.numaAware()) {
+        EXPECT_EQ(sharded.execute("key1", [](auto&) { return Numa::currentNode(); }).get(), sharded.nodeOf("key1"));
+    }
+}
+
+using TieredStorage =
+    KVStorage<MockClock, string, string, KVPolicies<MapIndexPolicy<>, ScanExpiry, NoLock, NoStats, NoFilter, SpillColdValues<8>>>;
+
+TEST(KVStorageTieringTest, SpillsColdValuesAndPromotesHotOnes) {
+    MockClock clock;
+    TieredStorage storage(span<tuple<string, string, uint32_t>>{}, clock);
+
+    auto value_of = [](int i) { return string(100, static_cast<char>('a' + i % 26)) + to_string(i); };
+    for (int i = 0; i < 100; ++i) {
+        storage.set("key" + to_string(i), value_of(i), i == 99 ? 10 : 0);
+    }
+    storage.set("short", "tiny", 0);
+
+    // Новая запись переживает первый проход; записи, прочитанные между проходами, остаются в памяти
+    EXPECT_EQ(storage.spillColdValues(1'000), 0U);
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_EQ(storage.get("key" + to_string(i)), value_of(i));
+    }
+    EXPECT_EQ(storage.spillColdValues(1'000), 90U);
+    EXPECT_EQ(storage.tieringStats().spilled_values, 90U);
+    EXPECT_EQ(storage.tieringStats().spill_file_bytes, 90U * 102);
+
+    // Холодные значения читаются из файла
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(storage.get("key" + to_string(i)), value_of(i)) << i;
+    }
+    auto sorted = storage.getManySorted("key5", 3);
+    ASSERT_EQ(sorted.size(), 3U);
+    EXPECT_EQ(sorted[0].second, value_of(5));
+    EXPECT_EQ(sorted[1].second, value_of(50));
+    EXPECT_EQ(storage.getWithTtl("key20")->value, value_of(20));
+
+    // К вытесненным key20, key50 и key51 обратились дважды - они возвращаются в память. key0..key9 читались
+    // и перед прошлым проходом, поэтому вытесняются только теперь, кроме дважды прочитанного key5
+    EXPECT_EQ(storage.spillColdValues(1'000), 0U);
+    EXPECT_EQ(storage.tieringStats().spilled_values, 87U);
+    EXPECT_EQ(storage.tieringStats().garbage_bytes, 3U * 102);
+    EXPECT_EQ(storage.spillColdValues(1'000), 9U);
+    EXPECT_EQ(storage.tieringStats().spilled_values, 96U);
+
+    // Перезапись и удаление вытесненных значений
+    storage.set("key30", "fresh", 0);
+    EXPECT_EQ(storage.get("key30"), "fresh");
+    EXPECT_TRUE(storage.remove("key31"));
+    EXPECT_FALSE(storage.get("key31").has_value());
+    EXPECT_EQ(storage.tieringStats().spilled_values, 94U);
+    EXPECT_EQ(storage.tieringStats().garbage_bytes, 5U * 102);
+
+    // Протухшая запись отдаётся со значением из файла
+    clock.advance(11s);
+    auto expired = storage.removeOneExpiredEntry();
+    ASSERT_TRUE(expired.has_value());
+    EXPECT_EQ(*expired, make_pair(string("key99"), value_of(99)));
+    EXPECT_EQ(storage.tieringStats().spilled_values, 93U);
+    EXPECT_EQ(storage.get("short"), "tiny");
+}
+
+TEST(KVStorageTieringTest, CompactsSpillFile) {
+    MockClock clock;
+    TieredStorage storage(span<tuple<string, string, uint32_t>>{}, clock);
+
+    const string big(4'096, 'x');
+    for (int i = 0; i < 400; ++i) {
+        storage.set("key" + to_string(i), big + to_string(i), 0);
+    }
+    storage.spillColdValues(1'000);
+    EXPECT_EQ(storage.spillColdValues(1'000), 400U);
+
+    // Три четверти файла становятся мусором - следующий проход переписывает файл
+    for (int i = 100; i < 400; ++i) {
+        storage.set("key" + to_string(i), to_string(i), 0);
+    }
+    EXPECT_EQ(storage.tieringStats().garbage_bytes, 300U * 4'099);
+    EXPECT_EQ(storage.spillColdValues(1'000), 0U);
+
+    auto stats = storage.tieringStats();
+    EXPECT_EQ(stats.garbage_bytes, 0U);
+    EXPECT_EQ(stats.spilled_values, 100U);
+    EXPECT_EQ(stats.spill_file_bytes, 10U * 4'097 + 90U * 4'098);
+
+    for (int i = 0; i < 400; ++i) {
+        ASSERT_EQ(storage.get("key" + to_string(i)), i < 100 ? big + to_string(i) : to_string(i)) << i;
+    }
+}
+
+TEST(KVStorageTieringTest, TriviallyCopyableValues) {
+    struct Blob {
+        uint64_t words[16];
+
+        bool operator==(const Blob&) const = default;
+    };
+
+    KVStorage<NoTtl, uint64_t, Blob, KVPolicies<AutoIndexPolicy, ScanExpiry, NoLock, NoStats, NoFilter, SpillColdValues<>>>
+        storage(span<tuple<uint64_t, Blob>>{});
+
+    auto blob_of = [](uint64_t i) {
+        Blob blob{};
+        for (uint64_t j = 0; j < 16; ++j) {
+            blob.words[j] = i * 100 + j;
+        }
+        return blob;
+    };
+
+    for (uint64_t i = 0; i < 50; ++i) {
+        storage.set(i, blob_of(i));
+    }
+    storage.spillColdValues(1'000);
+    EXPECT_EQ(storage.spillColdValues(1'000), 50U);
+
+    for (uint64_t i = 0; i < 50; ++i) {
+        ASSERT_EQ(storage.get(i), blob_of(i)) << i;
+    }
+}
+
+TEST(KVStorageLoadTest, ConcurrentMissesShareOneLoad) {
+    MockClock clock;
+    KVStorage<MockClock, string, string, KVPolicies<AutoIndexPolicy, ScanExpiry, SharedMutexLock>> storage(
+        span<tuple<string, string, uint32_t>>{}, clock);
+
+    atomic<int> loads = 0;
+    atomic<int> started = 0;
+    auto loader = [&](string_view key) {
+        ++loads;
+        // Загрузка длится, пока все потоки не сделают промах
+        while (started < 16) {
+            this_thread::yield();
+        }
+        this_thread::sleep_for(10ms);
+        return "loaded:" + string(key);
+    };
+
+    vector<string> results(16);
+    vector<thread> threads;
+    for (int t = 0; t < 16; ++t) {
+        threads.emplace_back([&, t] {
+            ++started;
+            results[t] = storage.getOrLoad("hot", loader, 10);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(loads, 1);
+    for (const auto& result : results) {
+        EXPECT_EQ(result, "loaded:hot");
+    }
+
+    // Попадание не вызывает loader; после протухания запись загружается заново
+    EXPECT_EQ(storage.getOrLoad("hot", loader, 10), "loaded:hot");
+    EXPECT_EQ(loads, 1);
+    clock.advance(11s);
+    EXPECT_EQ(storage.getOrLoad("hot", loader, 0), "loaded:hot");
+    EXPECT_EQ(loads, 2);
+    EXPECT_EQ(storage.getWithTtl("hot")->ttl, nullopt);
+}
+
+TEST(KVStorageLoadTest, LoaderFailureReachesEveryWaiter) {
+    MockClock clock;
+    KVStorage<MockClock, uint64_t, string, KVPolicies<AutoIndexPolicy, ScanExpiry, SharedMutexLock>> storage(
+        span<tuple<uint64_t, string, uint32_t>>{}, clock);
+
+    atomic<int> loads = 0;
+    atomic<int> started = 0;
+    auto failing = [&](uint64_t) -> string {
+        ++loads;
+        while (started < 4) {
+            this_thread::yield();
+        }
+        this_thread::sleep_for(10ms);
+        throw runtime_error("backend down");
+    };
+
+    atomic<int> failures = 0;
+    vector<thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&] {
+            ++started;
+            try {
+                storage.getOrLoad(7, failing, 0);
+            } catch (const runtime_error&) {
+                ++failures;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(loads, 1);
+    EXPECT_EQ(failures, 4);
+    EXPECT_FALSE(storage.get(7).has_value());
+
+    // Неудачная загрузка не остаётся в процессе: следующий промах загружает заново
+    EXPECT_EQ(storage.getOrLoad(7, [](uint64_t key) { return to_string(key); }, 0), "7");
+    EXPECT_EQ(storage.get(7), "7");
+
+    KVStorage<NoTtl> plain(span<tuple<string, string>>{});
+    EXPECT_EQ(plain.getOrLoad("a", [](string_view key) { return string(key) + "!"; }), "a!");
+    EXPECT_EQ(plain.get("a"), "a!");
+}
+
+// Получатель, запоминающий пачки; может бросать исключения и задерживать запись
+class RecordingSink : public WriteBehindSink<> {
+public:
+    void write(const vector<WriteBehindOp<>>& batch) override {
+        while (paused) {
+            this_thread::yield();
+        }
+        if (failures > 0) {
+            --failures;
+            throw runtime_error("slow store unavailable");
+        }
+
+        lock_guard lock(batches_mutex);
+        batches.push_back(batch);
+    }
+
+    vector<WriteBehindOp<>> ops() {
+        lock_guard lock(batches_mutex);
+        vector<WriteBehindOp<>> result;
+        for (const auto& batch : batches) {
+            result.insert(result.end(), batch.begin(), batch.end());
+        }
+        return result;
+    }
+
+    atomic<bool> paused = false;
+    atomic<int> failures = 0;
+    mutex batches_mutex;
+    vector<vector<WriteBehindOp<>>> batches;
+};
+
+TEST(WriteBehindTest, CoalescesAndFlushesInBatches) {
+    RecordingSink sink;
+    WriteBehindBuffer<> buffer(sink, {.max_batch = 3, .flush_interval = 1h});
+
+    buffer.set("a", "1", 10);
+    buffer.set("b", "1");
+    buffer.set("a", "2", 20);
+    buffer.remove("b");
+    buffer.remove("c");
+    EXPECT_TRUE(buffer.flush());
+
+    vector<WriteBehindOp<>> expected = {{"a", "2", 20}, {"b", nullopt, 0}, {"c", nullopt, 0}};
+    EXPECT_EQ(sink.ops(), expected);
+    EXPECT_EQ(sink.batches.size(), 1U);
+
+    auto stats = buffer.stats();
+    EXPECT_EQ(stats.writes, 5U);
+    EXPECT_EQ(stats.coalesced, 2U);
+    EXPECT_EQ(stats.flushed, 3U);
+    EXPECT_EQ(buffer.dirtyCount(), 0U);
+}
+
+TEST(WriteBehindTest, BackpressureBoundsDirtyKeys) {
+    RecordingSink sink;
+    sink.paused = true;
+    WriteBehindBuffer<> buffer(sink, {.max_dirty_keys = 4, .max_batch = 2, .flush_interval = 1ms});
+
+    atomic<bool> done = false;
+    thread writer([&] {
+        for (int i = 0; i < 20; ++i) {
+            buffer.set("key" + to_string(i), to_string(i));
+        }
+        done = true;
+    });
+
+    // Получатель стоит: после 4 ключей в буфере, считая пачку в отправке, запись ждёт
+    while (buffer.stats().blocked == 0) {
+        this_thread::yield();
+    }
+    EXPECT_LE(buffer.dirtyCount(), 4U);
+    EXPECT_FALSE(done);
+
+    sink.paused = false;
+    writer.join();
+    EXPECT_TRUE(buffer.flush());
+
+    auto ops = sink.ops();
+    ASSERT_EQ(ops.size(), 20U);
+    for (int i = 0; i < 20; ++i) {
+        EXPECT_EQ(ops[i].key, "key" + to_string(i));
+    }
+}
+
+TEST(WriteBehindTest, RetriesFailedBatches) {
+    RecordingSink sink;
+    sink.failures = numeric_limits<int>::max();
+    WriteBehindBuffer<> buffer(sink, {.flush_interval = 1ms});
+
+    buffer.set("a", "1");
+    buffer.set("b", "1");
+    EXPECT_FALSE(buffer.flush());
+
+    // Изменение во время повторов заменяет неотправленное значение
+    buffer.set("a", "2");
+    sink.failures = 0;
+    // Повтор, начатый до сброса failures, ещё может завершиться ошибкой
+    for (int attempt = 0; !buffer.flush(); ++attempt) {
+        ASSERT_LT(attempt, 10);
+    }
+
+    auto ops = sink.ops();
+    sort(ops.begin(), ops.end(), [](const auto& lhs, const auto& rhs) { return lhs.key < rhs.key; });
+    vector<WriteBehindOp<>> expected = {{"a", "2", 0}, {"b", "1", 0}};
+    EXPECT_EQ(ops, expected);
+    EXPECT_GE(buffer.stats().failed_batches, 1U);
+}
+
+TEST(WriteBehindTest, FlushDoesNotWaitForLaterWrites) {
+    RecordingSink sink;
+    WriteBehindBuffer<> buffer(sink, {.max_batch = 8, .flush_interval = 1h});
+
+    // Постоянная запись новых ключей: буфер не пустеет, но flush ждёт только уже записанные изменения
+    atomic<bool> stop = false;
+    thread writer([&] {
+        for (int i = 0; !stop; ++i) {
+            buffer.set("key" + to_string(i), "1");
+        }
+    });
+
+    for (int round = 0; round < 20; ++round) {
+        buffer.set("mark" + to_string(round), "1");
+        EXPECT_TRUE(buffer.flush());
+
+        auto ops = sink.ops();
+        const string mark = "mark" + to_string(round);
+        EXPECT_TRUE(any_of(ops.begin(), ops.end(), [&](const auto& op) { return op.key == mark; }));
+    }
+
+    stop = true;
+    writer.join();
+}
+
+TEST(WriteBehindTest, FailedBatchesStayWithinBound) {
+    RecordingSink sink;
+    sink.failures = numeric_limits<int>::max();
+    WriteBehindBuffer<> buffer(sink, {.max_dirty_keys = 4, .max_batch = 2, .flush_interval = 1ms});
+
+    thread writer([&] {
+        for (int i = 0; i < 20; ++i) {
+            buffer.set("key" + to_string(i), to_string(i));
+        }
+    });
+
+    // Неудачные пачки возвращаются в буфер, не превышая границу
+    while (buffer.stats().failed_batches < 20) {
+        EXPECT_LE(buffer.dirtyCount(), 4U);
+        this_thread::yield();
+    }
+    EXPECT_GE(buffer.stats().blocked, 1U);
+
+    sink.failures = 0;
+    writer.join();
+    for (int attempt = 0; !buffer.flush(); ++attempt) {
+        ASSERT_LT(attempt, 10);
+    }
+    EXPECT_EQ(sink.ops().size(), 20U);
+}
+
+TEST(WriteBehindTest, MirrorsStorageExpiry) {
+    MockClock clock;
+    KVStorage<MockClock> storage(span<tuple<string, string, uint32_t>>{}, clock);
+    RecordingSink sink;
+    WriteBehindBuffer<> buffer(sink, {.flush_interval = 1h});
+    storage.setExpiryListener(&buffer);
+
+    auto write = [&](const string& key, const string& value, uint32_t ttl) {
+        storage.set(key, value, ttl);
+        buffer.set(key, value, ttl);
+    };
+    write("a", "1", 5);
+    write("b", "2", 0);
+    EXPECT_TRUE(buffer.flush());
+
+    clock.advance(6s);
+    EXPECT_EQ(storage.removeExpiredEntries(10), 1U);
+    EXPECT_TRUE(buffer.flush());
+
+    vector<WriteBehindOp<>> expected = {{"a", "1", 5}, {"b", "2", 0}, {"a", nullopt, 0}};
+    EXPECT_EQ(sink.ops(), expected);
+    storage.setExpiryListener(nullptr);
+}
+
+TEST(HotKeysTest, CountMinSketchNeverUnderestimates) {
+    CountMinSketch sketch(256, 4);
+    mt19937_64 rng(3);
+    map<uint64_t, uint32_t> counts;
+
+    // Ключей больше, чем счётчиков в строке: коллизии неизбежны
+    vector<uint64_t> hashes(2'000);
+    for (auto& hash : hashes) {
+        hash = rng();
+    }
+    for (int i = 0; i < 50'000; ++i) {
+        const uint64_t hash = hashes[i % 50 == 0 ? rng() % hashes.size() : i % 10];
+        sketch.add(hash);
+        ++counts[hash];
+    }
+
+    for (const auto& [hash, count] : counts) {
+        EXPECT_GE(sketch.estimate(hash), count);
+    }
+    // Частые ключи оцениваются почти точно
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_LE(sketch.estimate(hashes[i]), counts[hashes[i]] * 11 / 10);
+    }
+
+    // Несколько периодов старения применяются разом, после 32 от счётчиков ничего не остаётся
+    const uint32_t before = sketch.estimate(hashes[0]);
+    sketch.halve(3);
+    EXPECT_EQ(sketch.estimate(hashes[0]), before >> 3);
+    sketch.halve(32);
+    EXPECT_EQ(sketch.estimate(hashes[0]), 0);
+}
+
+TEST(HotKeysTest, ReportsHottestKeysAcrossThreads) {
+    MockClock clock;
+    KVStorage<MockClock, string, string,
+              KVPolicies<AutoIndexPolicy, ScanExpiry, SharedMutexLock, NoStats, NoFilter, NoTiering, TrackHotKeys<4, 4>>>
+        storage(span<tuple<string, string, uint32_t>>{}, clock);
+
+    for (int i = 0; i < 1'000; ++i) {
+        storage.set("cold" + to_string(i), "v", 0);
+    }
+
+    // hot0 - самый частый, hot3 - самый редкий из горячих; холодные ключи читаются по разу
+    vector<thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < 20'000; ++i) {
+                storage.get("hot" + to_string(i % 10 < 4 ? 0 : i % 10 < 7 ? 1 : i % 10 < 9 ? 2 : 3));
+                if (i % 10 == 0) {
+                    storage.get("cold" + to_string((t * 20'000 + i) / 10 % 1'000));
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    auto hot = storage.hotKeys();
+    ASSERT_EQ(hot.size(), 4U);
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_EQ(hot[i].key, "hot" + to_string(i));
+        EXPECT_GT(hot[i].per_second, 0);
+    }
+    // Обращений к hot0 - 32000, оценка по выборке примерно та же
+    EXPECT_GT(hot[0].accesses, 32'000U * 8 / 10);
+    EXPECT_LT(hot[0].accesses, 32'000U * 12 / 10);
+}
+
+TEST(DeferredFreeTest, LargeValuesAreFreedOutsideMutations) {
+    MockClock clock;
+    KVStorage<MockClock, string, string,
+              KVPolicies<AutoIndexPolicy, ScanExpiry, NoLock, NoStats, NoFilter, NoTiering, NoHotKeys,
+                         DeferFreeLargeValues<1'000, false>>>
+        storage(span<tuple<string, string, uint32_t>>{}, clock);
+
+    const string big(10'000, 'b');
+    storage.set("a", big, 0);
+    storage.set("b", big, 0);
+    storage.set("small", "v", 0);
+    EXPECT_EQ(storage.deferredBytes(), 0U);
+
+    // Перезапись и удаление больших значений откладывают освобождение, маленькие освобождаются на месте
+    storage.set("a", "new", 0);
+    EXPECT_TRUE(storage.remove("b"));
+    storage.set("small", "w", 0);
+    EXPECT_GE(storage.deferredBytes(), 2 * big.size());
+
+    EXPECT_EQ(storage.get("a"), "new");
+    EXPECT_FALSE(storage.get("b").has_value());
+
+    // Освобождение порциями: хотя бы одно значение за вызов
+    EXPECT_GE(storage.freeDeferredValues(1), big.size());
+    EXPECT_GE(storage.freeDeferredValues(1), big.size());
+    EXPECT_EQ(storage.deferredBytes(), 0U);
+    EXPECT_EQ(storage.freeDeferredValues(1), 0U);
+}
+
+TEST(DeferredFreeTest, BackgroundThreadFreesValues) {
+    KVStorage<NoTtl, uint64_t, vector<uint64_t>,
+              KVPolicies<AutoIndexPolicy, ScanExpiry, NoLock, NoStats, NoFilter, NoTiering, NoHotKeys,
+                         DeferFreeLargeValues<4'096>>>
+        storage(span<tuple<uint64_t, vector<uint64_t>>>{});
+
+    for (uint64_t i = 0; i < 100; ++i) {
+        storage.set(i, vector<uint64_t>(1'000, i));
+    }
+    for (uint64_t i = 0; i < 100; ++i) {
+        if (i % 2 == 0) {
+            storage.remove(i);
+        } else {
+            storage.set(i, vector<uint64_t>{i});
+        }
+    }
+
+    for (int attempt = 0; storage.deferredBytes() != 0; ++attempt) {
+        ASSERT_LT(attempt, 1'000);
+        this_thread::sleep_for(1ms);
+    }
+    EXPECT_EQ(storage.get(3), vector<uint64_t>{3});
+    EXPECT_FALSE(storage.get(4).has_value());
+}
+
+TEST_F(KVStorageTest, ClearHandsLargeStructuresToBackgroundThread) {
+    using Cleared = KVStorage<MockClock, string, string,
+                              KVPolicies<MapIndexPolicy<>, QueueExpiry, SharedMutexLock, CollectStats, BloomFilter<>>>;
+    Cleared cleared(span<tuple<string, string, uint32_t>>{}, clock);
+
+    // Два раза подряд больше kMinBackgroundClear записей: второй clear ждёт разрушения от первого
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < 10'000; ++i) {
+            cleared.set("key" + to_string(i), "value" + to_string(i), i % 2 == 0 ? 5 : 0);
+        }
+        cleared.clear();
+
+        EXPECT_FALSE(cleared.get("key0").has_value());
+        EXPECT_FALSE(cleared.get("key1").has_value());
+        EXPECT_TRUE(cleared.getManySorted("", 10).empty());
+        EXPECT_EQ(cleared.expiryStats().infinite_entries, 0U);
+        EXPECT_EQ(cleared.expiryStats().sets, 10'000U * (round + 1));
+    }
+
+    cleared.set("key1", "new", 5);
+    EXPECT_EQ(cleared.get("key1"), "new");
+    clock.advance(6s);
+    EXPECT_EQ(cleared.expiryStats().expired_not_reclaimed, 1U);
+    EXPECT_EQ(cleared.removeExpiredEntries(100), 1U);
+}
+
+TEST(DoubleBufferedTest, PinnedInstanceOutlivesPublish) {
+    using Storage = KVStorage<NoTtl, string, shared_ptr<int>>;
+    vector<tuple<string, shared_ptr<int>>> entries{{"key", make_shared<int>(1)}};
+    weak_ptr<int> first = get<1>(entries[0]);
+
+    DoubleBufferedKVStorage<Storage> buffered(make_unique<Storage>(entries));
+    entries.clear();
+    EXPECT_EQ(*buffered.get("key").value(), 1);
+
+    {
+        auto pin = buffered.pin();
+        vector<tuple<string, shared_ptr<int>>> next{{"key", make_shared<int>(2)}};
+        buffered.rebuild(next);
+        EXPECT_EQ(buffered.version(), 1U);
+        EXPECT_EQ(*buffered.get("key").value(), 2);
+
+        // Закреплённый старый экземпляр не разрушается, пока читатель в нём
+        this_thread::sleep_for(20ms);
+        EXPECT_FALSE(first.expired());
+        EXPECT_EQ(*pin->get("key").value(), 1);
+    }
+
+    buffered.synchronize();
+    EXPECT_TRUE(first.expired());
+}
+
+// Считает живые экземпляры хранилища
+struct CountedStorage {
+    using KeyView = string_view;
+
+    CountedStorage() { peak = max(peak.load(), ++alive); }
+    ~CountedStorage() { --alive; }
+
+    inline static atomic<int> alive = 0;
+    inline static atomic<int> peak = 0;
+};
+
+TEST(DoubleBufferedTest, RebuildKeepsAtMostTwoInstances) {
+    DoubleBufferedKVStorage<CountedStorage> buffered(make_unique<CountedStorage>());
+
+    // Читатель держит первый экземпляр, пока идут следующие перестроения
+    thread reader([pin = buffered.pin()] { this_thread::sleep_for(50ms); });
+    buffered.rebuild();
+    buffered.rebuild();
+    reader.join();
+    buffered.synchronize();
+
+    EXPECT_EQ(CountedStorage::peak.load(), 2);
+    EXPECT_EQ(CountedStorage::alive.load(), 1);
+}
+
+TEST(DoubleBufferedTest, ReadersSeeWholeDatasetsDuringRebuilds) {
+    using Storage = KVStorage<NoTtl, uint64_t, uint64_t>;
+    constexpr uint64_t kKeys = 500;
+
+    auto dataset = [&](uint64_t version) {
+        vector<tuple<uint64_t, uint64_t>> entries;
+        for (uint64_t key = 0; key < kKeys; ++key) {
+            entries.emplace_back(key, version);
+        }
+        return entries;
+    };
+
+    auto initial = dataset(0);
+    DoubleBufferedKVStorage<Storage> buffered(make_unique<Storage>(initial));
+    atomic<bool> stop = false;
+    atomic<uint64_t> errors = 0;
+
+    vector<thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&, t] {
+            uint64_t last = 0;
+            for (uint64_t i = t; !stop.load(); i += 7) {
+                auto pin = buffered.pin();
+                const uint64_t version = pin->get(i % kKeys).value_or(UINT64_MAX);
+                // Весь набор одного экземпляра - одной версии, версии читателя не убывают
+                if (version < last || pin->get((i + 1) % kKeys) != version) {
+                    ++errors;
+                }
+                last = version;
+            }
+        });
+    }
+
+    for (uint64_t version = 1; version <= 20; ++version) {
+        auto entries = dataset(version);
+        buffered.rebuild(entries);
+    }
+    stop = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    EXPECT_EQ(errors.load(), 0U);
+    EXPECT_EQ(buffered.version(), 20U);
+    EXPECT_EQ(buffered.get(0), 20U);
+}
+
+TEST_F(KVStorageTest, MergeFromResolvesConflictsByPolicy) {
+    using Merged = KVStorage<MockClock, string, string,
+                             KVPolicies<MapIndexPolicy<>, QueueExpiry, SharedMutexLock, CollectStats, BloomFilter<>>>;
+    vector<tuple<string, string, uint32_t>> target_entries{
+        {"a", "target", 0}, {"b", "target", 10}, {"c", "target", 5}, {"e", "target", 0}};
+    vector<tuple<string, string, uint32_t>> source_entries{
+        {"b", "source", 20}, {"c", "source", 3}, {"d", "source", 5}, {"e", "source", 10}, {"f", "source", 0}};
+
+    auto merge = [&](MergeConflict conflict, size_t taken) {
+        auto target = make_unique<Merged>(target_entries, clock);
+        Merged source(source_entries, clock);
+        EXPECT_EQ(target->mergeFrom(std::move(source), conflict), taken);
+
+        // Источник пуст и работает дальше
+        EXPECT_TRUE(source.getManySorted("", 10).empty());
+        EXPECT_FALSE(source.get("d").has_value());
+        source.set("d", "again", 0);
+        EXPECT_EQ(source.get("d"), "again");
+        EXPECT_EQ(source.expiryStats().infinite_entries, 1U);
+        return target;
+    };
+
+    auto newest = merge(MergeConflict::kNewestExpiry, 3);
+    EXPECT_EQ(newest->getManySorted("", 10),
+              (vector<pair<string, string>>{
+                  {"a", "target"}, {"b", "source"}, {"c", "target"}, {"d", "source"}, {"e", "target"}, {"f", "source"}}));
+    EXPECT_EQ(newest->expiryStats().infinite_entries, 3U);
+
+    auto source_wins = merge(MergeConflict::kSourceWins, 5);
+    EXPECT_EQ(source_wins->get("a"), "target");
+    EXPECT_EQ(source_wins->get("c"), "source");
+    EXPECT_EQ(source_wins->get("e"), "source");
+
+    auto target_wins = merge(MergeConflict::kTargetWins, 2);
+    EXPECT_EQ(target_wins->get("b"), "target");
+    EXPECT_EQ(target_wins->get("d"), "source");
+
+    // Перенесённые записи протухают и удаляются механизмом целевого хранилища
+    clock.advance(6s);
+    EXPECT_EQ(newest->removeExpiredEntries(10), 2U); // c, d
+    EXPECT_EQ(source_wins->removeExpiredEntries(10), 2U); // c, d
+    EXPECT_EQ(target_wins->removeExpiredEntries(10), 2U); // c, d
+    EXPECT_EQ(newest->getManySorted("", 10).size(), 4U);
+}
+
+TEST(KVStorageMergeTest, RadixIndexAndSpilledValues) {
+    MockClock clock;
+    using Merged = KVStorage<MockClock, uint64_t, string, KVPolicies<RadixIndexPolicy, PackedExpiry, NoLock, NoStats,
+                                                                     NoFilter, SpillColdValues<1>>>;
+    Merged target(span<tuple<uint64_t, string, uint32_t>>{}, clock);
+    Merged source(span<tuple<uint64_t, string, uint32_t>>{}, clock);
+
+    for (uint64_t i = 0; i < 1'000; ++i) {
+        (i % 2 == 0 ? target : source).set(i, "v" + to_string(i), i % 10 == 1 ? 5 : 0);
+    }
+    source.set(0, "from source", 0);
+    source.spillColdValues(1'000);
+    EXPECT_EQ(source.spillColdValues(1'000), 501U);
+
+    EXPECT_EQ(target.mergeFrom(std::move(source), MergeConflict::kSourceWins), 501U);
+    EXPECT_EQ(source.tieringStats().spilled_values, 0U);
+    EXPECT_EQ(target.tieringStats().spilled_values, 0U);
+
+    EXPECT_EQ(target.get(0), "from source");
+    for (uint64_t i = 1; i < 1'000; ++i) {
+        ASSERT_EQ(target.get(i), "v" + to_string(i)) << i;
+    }
+
+    clock.advance(6s);
+    EXPECT_EQ(target.removeExpiredEntries(1'000), 100U);
+    EXPECT_EQ(target.getManySorted(0, 2'000).size(), 900U);
+}
+
+template <typename Policies>
+class KVStorageDiffTest : public testing::Test {
+protected:
+    MockClock clock;
+};
+
+using DiffPolicies = testing::Types<KVPolicies<MapIndexPolicy<>, QueueExpiry>,
+                                    KVPolicies<MapIndexPolicy<>, QueueExpiry, NoLock, NoStats, NoFilter, NoTiering,
+                                               NoHotKeys, FreeInPlace, MerkleDigest<8>>>;
+
+TYPED_TEST_SUITE(KVStorageDiffTest, DiffPolicies);
+
+TYPED_TEST(KVStorageDiffTest, MatchesEntryByEntryComparison) {
+    using Storage = KVStorage<MockClock, string, string, TypeParam>;
+    Storage before(span<tuple<string, string, uint32_t>>{}, this->clock);
+    Storage after(span<tuple<string, string, uint32_t>>{}, this->clock);
+
+    mt19937 rng(7);
+    auto key = [&] { return "key" + to_string(rng() % 2'000); };
+
+    for (int i = 0; i < 3'000; ++i) {
+        const string k = key();
+        before.set(k, "v" + to_string(i % 5), 0);
+        after.set(k, "v" + to_string(i % 5), 0);
+    }
+    EXPECT_TRUE(before.diff(after).empty());
+
+    // Перезаписи, удаления (в том числе ключей-границ диапазонов) и протухание
+    for (int i = 0; i < 300; ++i) {
+        switch (rng() % 4) {
+            case 0:
+                after.set(key(), "changed" + to_string(rng() % 3), 0);
+                break;
+            case 1:
+                after.remove(key());
+                break;
+            case 2:
+                before.set(key(), "v1", 0);
+                break;
+            default:
+                after.set(key(), "expiring", 1);
+                break;
+        }
+    }
+    this->clock.advance(2s);
+    after.removeExpiredEntries(10'000);
+
+    StorageDiff<string> expected;
+    auto ours = before.getManySorted("", 10'000);
+    auto theirs = after.getManySorted("", 10'000);
+    size_t i = 0;
+    size_t j = 0;
+    while (i < ours.size() || j < theirs.size()) {
+        if (j == theirs.size() || (i < ours.size() && ours[i].first < theirs[j].first)) {
+            expected.removed.push_back(ours[i++].first);
+        } else if (i == ours.size() || theirs[j].first < ours[i].first) {
+            expected.added.push_back(theirs[j++].first);
+        } else {
+            if (ours[i].second != theirs[j].second) {
+                expected.changed.push_back(ours[i].first);
+            }
+            ++i;
+            ++j;
+        }
+    }
+
+    StorageDiff<string> diff = before.diff(after);
+    EXPECT_EQ(diff, expected);
+    EXPECT_FALSE(expected.empty());
+
+    // Обратное сравнение меняет местами добавленные и удалённые
+    StorageDiff<string> reverse = after.diff(before);
+    EXPECT_EQ(reverse.added, diff.removed);
+    EXPECT_EQ(reverse.removed, diff.added);
+    EXPECT_EQ(reverse.changed, diff.changed);
+
+    // После слияния в копию before хранилища совпадают
+    Storage merged(span<tuple<string, string, uint32_t>>{}, this->clock);
+    Storage rest(span<tuple<string, string, uint32_t>>{}, this->clock);
+    for (auto& [k, value] : before.getManySorted("", 10'000)) {
+        (k < "key1" ? merged : rest).set(k, value, 0);
+    }
+    merged.mergeFrom(std::move(rest), MergeConflict::kSourceWins);
+    EXPECT_TRUE(before.diff(merged).empty());
+
+    merged.clear();
+    EXPECT_EQ(before.diff(merged).removed.size(), ours.size());
+}